@@ -1,5 +1,6 @@
 #include "tcc/common/logging.h"
 #include "tcc/core/ir_codegen.h"
+#include "tcc/core/ir_tuner.h"
 #include "tcc/frontend/parser.h"
 #include <iostream>
 #include <sys/stat.h>
@@ -11,6 +12,10 @@ struct tcc_config
     std::string input_path;
     std::unordered_map<std::string, tcc::dimensions> input_shapes;
     std::string target_name;
+    std::string schedule_path;
+    tcc::conv2d_lowering conv2d_lowering = tcc::conv2d_lowering::direct;
+    tcc::ir_codegen_options codegen_options;
+    tcc::ir_tuner_options tuner_options;
 };
 
 static void print_usage_and_exit()
@@ -20,9 +25,51 @@ static void print_usage_and_exit()
            "-input-shapes=\"{a:[1,2],b:[3,4]}\" -target-name=\"example\"\n"
         << "\t-input-path\t- Path to frozen tensorflow graph.\n"
         << "\t-input-shapes\t- A map of input placeholder names to "
-           "placeholder shapes.\n"
+           "placeholder shapes; a leading dimension of ? is a batch size "
+           "passed at runtime.\n"
         << "\t-target-name\t- A string used as path of the output folder and "
            "file and function name for the generated header and source files.\n"
+        << "\t-parallel\t- Distributes loops of the generated code across "
+           "threads with OpenMP.\n"
+        << "\t-threads\t- Number of OpenMP threads used by the generated code; "
+           "implies -parallel.\n"
+        << "\t-vectorize\t- Marks innermost loops of the generated code as "
+           "OpenMP simd loops.\n"
+        << "\t-weights\t- Storage of constant tensors, \"blob\" (default) "
+           "to embed <target-name>.weights with .incbin, \"external\" to map "
+           "it at runtime with <target-name>_load_weights(path) or \"text\" "
+           "for array initializers.\n"
+        << "\t-workspace\t- Takes intermediate buffers from a caller provided "
+           "workspace of <target-name>_workspace_size() bytes, making the "
+           "generated code reentrant.\n"
+        << "\t-conv\t\t- Lowering of convolutions, \"direct\" (default) for "
+           "stencil loops, \"gemm\" for im2col and a blocked matrix "
+           "multiplication or \"winograd\" for winograd's algorithm on "
+           "stride 1 3x3 convolutions.\n"
+        << "\t-math\t\t- Implementation of exp, sigmoid and tanh, \"exact\" "
+           "(default) for the c library or \"fast\" for vectorizable "
+           "polynomial approximations within 3 ulp.\n"
+        << "\t-max-batch\t- Upper bound of the runtime batch size of inputs "
+           "with a leading dimension of ?; the generated function returns -1 "
+           "for batch sizes out of range.\n"
+        << "\t-fused-tiling\t- Size in bytes, typically of the L2 cache, "
+           "that intermediates of chains of convolutions have to fit into, "
+           "otherwise they are computed depth first over stripes of rows.\n"
+        << "\t-print-fusion\t- Writes the decisions of the fusion planner "
+           "and their estimated costs to <target-name>.fusion.\n"
+        << "\t-schedule\t- Path to a schedule of the model that splits, "
+           "reorders, tiles, vectorizes, parallelizes and unrolls loops of "
+           "stages and places exprs, referring to exprs by their ids in "
+           "<target-name>.fusion.\n"
+        << "\t-tune\t\t- Path to a tuning database; times schedule "
+           "variants of the convolution and pooling layers on this machine, "
+           "uses the fastest and records it in the database, from which later "
+           "runs on the same cpu reuse it. Schedules given by -schedule take "
+           "precedence.\n"
+        << "\t-tune-cc\t- Command compiling a C file into a shared library "
+           "while tuning, which should use the flags the generated code is "
+           "compiled with (default \"gcc -O3 -march=native -fopenmp -shared "
+           "-fPIC\").\n"
         << "\t-help\t\t- Displays command line options.\n";
     exit(0);
 }
@@ -50,10 +97,11 @@ static void parse_input_shapes(tcc_config& config, std::string arg)
         tcc::dimensions shape;
         while ((pos = val.find(",")) != std::string::npos)
         {
-            shape.push_back(stol(val.substr(0, pos)));
+            std::string dim = val.substr(0, pos);
+            shape.push_back(shape.empty() && dim == "?" ? -1 : stol(dim));
             val.erase(0, pos + 1);
         }
-        shape.push_back(stol(val));
+        shape.push_back(shape.empty() && val == "?" ? -1 : stol(val));
 
         config.input_shapes[key] = shape;
     }
@@ -82,6 +130,121 @@ static tcc_config parse_config(int argc, char** argv)
         {
             config.target_name = arg.substr(arg.rfind("=") + 1);
         }
+        else if (arg == "-parallel")
+        {
+            config.codegen_options.parallelize = true;
+        }
+        else if (arg == "-vectorize")
+        {
+            config.codegen_options.vectorize = true;
+        }
+        else if (arg == "-workspace")
+        {
+            config.codegen_options.workspace = true;
+        }
+        else if (arg == "-print-fusion")
+        {
+            config.codegen_options.print_fusion = true;
+        }
+        else if (arg.rfind("-conv", 0) == 0)
+        {
+            std::string lowering = arg.substr(arg.rfind("=") + 1);
+            if (lowering == "direct")
+            {
+                config.conv2d_lowering = tcc::conv2d_lowering::direct;
+            }
+            else if (lowering == "gemm")
+            {
+                config.conv2d_lowering = tcc::conv2d_lowering::gemm;
+            }
+            else if (lowering == "winograd")
+            {
+                config.conv2d_lowering = tcc::conv2d_lowering::winograd;
+            }
+            else
+            {
+                tcc_error("unknown convolution lowering " + lowering + ".");
+            }
+        }
+        else if (arg.rfind("-math", 0) == 0)
+        {
+            std::string math = arg.substr(arg.rfind("=") + 1);
+            if (math == "exact")
+            {
+                config.codegen_options.math =
+                    tcc::ir_codegen_options::precision::exact;
+            }
+            else if (math == "fast")
+            {
+                config.codegen_options.math =
+                    tcc::ir_codegen_options::precision::fast;
+            }
+            else
+            {
+                tcc_error("unknown math precision " + math + ".");
+            }
+        }
+        else if (arg.rfind("-max-batch", 0) == 0)
+        {
+            config.codegen_options.max_batch =
+                stol(arg.substr(arg.rfind("=") + 1));
+        }
+        else if (arg.rfind("-weights", 0) == 0)
+        {
+            std::string storage = arg.substr(arg.rfind("=") + 1);
+            if (storage == "blob")
+            {
+                config.codegen_options.weights =
+                    tcc::ir_codegen_options::storage::blob;
+            }
+            else if (storage == "external")
+            {
+                config.codegen_options.weights =
+                    tcc::ir_codegen_options::storage::external;
+            }
+            else if (storage == "text")
+            {
+                config.codegen_options.weights =
+                    tcc::ir_codegen_options::storage::text;
+            }
+            else
+            {
+                tcc_error("unknown weights storage " + storage + ".");
+            }
+        }
+        else if (arg.rfind("-schedule", 0) == 0)
+        {
+            config.schedule_path = arg.substr(arg.rfind("=") + 1);
+        }
+        else if (arg.rfind("-tune-cc", 0) == 0)
+        {
+            /* compiler flags may contain = themselves. */
+            config.tuner_options.compiler = arg.substr(arg.find("=") + 1);
+        }
+        else if (arg.rfind("-tune", 0) == 0)
+        {
+            config.tuner_options.database_path =
+                arg.substr(arg.rfind("=") + 1);
+        }
+        else if (arg.rfind("-fused-tiling", 0) == 0)
+        {
+            config.codegen_options.fused_tiling =
+                stol(arg.substr(arg.rfind("=") + 1));
+        }
+        else if (arg.rfind("-threads", 0) == 0)
+        {
+            /* the thread count is a decimal number that fits unsigned. */
+            std::string threads = arg.find("=") == std::string::npos
+                                      ? ""
+                                      : arg.substr(arg.rfind("=") + 1);
+            if (threads.empty() || threads.size() > 9 ||
+                threads.find_first_not_of("0123456789") != std::string::npos)
+            {
+                tcc_error("invalid thread count " + threads + ".");
+            }
+            config.codegen_options.parallelize = true;
+            config.codegen_options.threads = stoul(threads);
+        }
         else
         {
             tcc_error("unknown command line argument " + arg + ".");
@@ -93,6 +256,20 @@ static tcc_config parse_config(int argc, char** argv)
         print_usage_and_exit();
     }
 
+    /* inputs are built with the largest batch; either all or none of them
+     * have a runtime batch. */
+    for (auto& input_shape : config.input_shapes)
+    {
+        bool dynamic = input_shape.second[0] < 0;
+        tcc_assert(dynamic == (config.codegen_options.max_batch > 0),
+                   "-max-batch requires a leading dimension of ? for every "
+                   "input.");
+        if (dynamic)
+        {
+            input_shape.second[0] = config.codegen_options.max_batch;
+        }
+    }
+
     return config;
 }
 
@@ -108,9 +285,27 @@ int main(int argc, char** argv)
                "failed to create output directory at " + config.target_name);
     tcc_info("successfully created target directory at " + config.target_name);
 
-    tcc::expr ir = tcc::parse(config.input_path, config.input_shapes);
+    tcc::expr ir = tcc::parse(
+        config.input_path, config.input_shapes, config.conv2d_lowering);
     tcc_info("successfully parsed tensorflow graph into tcc ir.");
 
-    tcc::ir_codegen::apply(config.target_name, ir);
+    if (!config.schedule_path.empty())
+    {
+        config.codegen_options.schedule =
+            tcc::ir_schedule_parser::apply(config.schedule_path, ir);
+        tcc_info("successfully parsed schedule.");
+    }
+
+    if (!config.tuner_options.database_path.empty())
+    {
+        config.codegen_options.schedule =
+            tcc::ir_tuner::apply(config.target_name,
+                                 ir,
+                                 config.codegen_options,
+                                 config.tuner_options);
+        tcc_info("successfully tuned schedule.");
+    }
+
+    tcc::ir_codegen::apply(config.target_name, ir, config.codegen_options);
     tcc_info("successfully generated source files.");
 }
@@ -27,7 +27,8 @@ datatype to_datatype()
     {
         return datatype::FP32;
     }
-    else if (typeid(T) == typeid(int64_t) || typeid(T) == typeid(long))
+    else if (typeid(T) == typeid(int64_t) || typeid(T) == typeid(long) ||
+             typeid(T) == typeid(long long))
     {
         return datatype::INT64;
     }
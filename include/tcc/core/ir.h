@@ -175,6 +175,8 @@ struct unary : base_expr<unary>
     enum class type
     {
         exp,
+        sigmoid,
+        tanh,
     };
 
     type unary_type;
@@ -2,29 +2,258 @@
 #define TCC_CORE_IR_CODEGEN_H
 
 #include "tcc/core/ir_dep_analysis.h"
+#include "tcc/core/ir_mem_planner.h"
+#include "tcc/core/ir_schedule.h"
 #include "tcc/core/ir_visitor.h"
 #include <functional>
+#include <map>
 #include <sstream>
 #include <unordered_map>
 
 namespace tcc {
 
-/* ir_codegen generates c code from ir. */
+/* ir_codegen_options configures the generated c code. */
+struct ir_codegen_options
+{
+    /* emit openmp worksharing loops over independent output dimensions. */
+    bool parallelize = false;
+
+    /* size of the openmp thread team; 0 defers to the openmp runtime. */
+    unsigned threads = 0;
+
+    /* emit openmp simd loops over innermost independent dimensions. */
+    bool vectorize = false;
+
+    /* storage of constant tensors: initializers in the source file or a
+     * binary blob, <target>.weights, that is either embedded into the object
+     * file or mapped at runtime by <target>_load_weights(path). loading
+     * swaps the weights of later calls, while running calls finish with the
+     * weights they started with; the generated function then returns -1
+     * while no weights are loaded and 0 otherwise. */
+    enum class storage
+    {
+        text,
+        blob,
+        external
+    };
+    storage weights = storage::blob;
+
+    /* take intermediate buffers from a workspace passed as the first
+     * parameter instead of static storage, so that concurrent calls are
+     * safe; its size in bytes is returned by <target>_workspace_size(). */
+    bool workspace = false;
+
+    /* when positive, the leading dimension of every input, which must be
+     * max_batch, is a batch size passed at runtime as the batch parameter of
+     * at most max_batch; all other dimensions stay specialized. only the
+     * leading batch images of inputs and output are accessed, and the
+     * generated function returns -1 without computing anything if batch is
+     * out of range and 0 otherwise. */
+    dimension max_batch = 0;
+
+    /* implementation of exp, sigmoid and tanh: the c library, or inlined
+     * polynomial approximations that vectorize in simd loops. exp is within
+     * 1 ulp for |x| <= 88 and saturates beyond, sigmoid is within 3 ulp for
+     * results above FLT_MIN and tanh within 2 ulp. all of them return nan
+     * for nan, like the c library. compiling the generated code with
+     * -ffast-math reassociates the range reduction of exp and degrades exp
+     * and sigmoid to about 64 ulp. */
+    enum class precision
+    {
+        exact,
+        fast
+    };
+    precision math = precision::exact;
+
+    /* when positive, runs of stages over the rows of 4d tensors, each but the
+     * last only read by a single later stage of the run, as in blocks of
+     * convolutions, are computed depth first over stripes of rows of the
+     * last stage when their intermediates do not fit into fused_tiling
+     * bytes, typically the size of the l2 cache. intermediates then only
+     * hold the rows of a stripe and the halo rows read by convolutions,
+     * which are recomputed for every stripe, in at most fused_tiling bytes.
+     * runtime batches are not tiled. */
+    dimension fused_tiling = 0;
+
+    /* write the decisions of the fusion planner and their estimated costs
+     * to <target>.fusion. */
+    bool print_fusion = false;
+
+    /* schedules of exprs, which override the loop nests of their stages and
+     * the decisions of the fusion planner. */
+    ir_schedule schedule;
+};
+
+/* ir_codegen generates c code from ir.
+ *
+ * every expr that has to be stored in memory (inputs, constants,
+ * reductions and sources of index exprs) is emitted as a stage with its
+ * own loop nest. the fusion planner decides for all other exprs whether
+ * they are inlined into the stages that consume them, stored by a stage of
+ * their own or computed by the stage of the reduction they read, unless
+ * their schedule decides it; schedules also override the loop nests of
+ * stages. stored intermediates are placed into a single arena by
+ * ir_mem_planner. */
 struct ir_codegen : ir_visitor
 {
   public:
-    static void apply(const std::string, expr);
+    static void apply(const std::string, expr, ir_codegen_options = {});
 
   protected:
-    void add_local_symbol(expr, std::string);
-    std::string add_global_symbol(expr, std::string = {});
-    std::string get_indices(exprs, dimensions = {}, exprs = {});
-    std::string get_symbol(expr);
+    struct loop
+    {
+        std::string symbol;
+        dimension begin, bound;
+        bool reduced;
+        bool batched;
+    };
+
+    /* region is a loop nest over part of an iteration space; selects in
+     * peeled_selects hold in interior regions of the stage being emitted. */
+    struct region
+    {
+        std::vector<loop> loops;
+        bool interior;
+    };
+
+    /* gemm multiplies groups matrices a [m, k] with b [k, n], where the
+     * groups are the outermost group_rank dimensions and group i uses the
+     * matrix i % b_groups of b. */
+    struct gemm
+    {
+        expr a, b;
+        unsigned group_rank;
+        dimension groups, b_groups, m, n, k;
+    };
+
+    /* affine is the sum of terms[i].second * terms[i].first + offset, where
+     * terms are keyed by the c expressions of integer values, usually loop
+     * indices. */
+    struct affine
+    {
+        std::map<std::string, dimension> terms;
+        dimension offset = 0;
+    };
+
+    /* chain is a run of stages [begin, end) computed depth first over
+     * stripes of rows rows of its last stage. */
+    struct chain
+    {
+        unsigned begin, end;
+        dimension rows;
+    };
+
+    /* window is the rows [origin, origin + rows) of a stage of a chain
+     * computed for a stripe. the stage after it that reads it reads rows
+     * stride * r + first through stride * r + last for each of its rows r.
+     * windows of all stages of a chain but the last are buffered, stored
+     * relative to their origin. */
+    struct window
+    {
+        std::string origin;
+        dimension rows, stride, first, last;
+        expr reader;
+        bool buffered;
+    };
+
+    /* scheduled_loop holds the directives of a loop of a scheduled stage. */
+    struct scheduled_loop
+    {
+        bool parallel, vectorized;
+        dimension unroll;
+    };
+
+    /* fusion is the decision of the fusion planner for an expr: it is
+     * recomputed by every stage reading it, materialized by a stage of its
+     * own, or computed as the epilogue of the stage of reduction, which
+     * then stores it instead of the reduction. estimates hold the
+     * arithmetic operations and bytes of memory traffic of the possible
+     * choices. */
+    struct fusion
+    {
+        enum class choice
+        {
+            recompute,
+            materialize,
+            epilogue
+        };
+        struct estimate
+        {
+            choice option;
+            double flops, bytes;
+        };
+        choice decision;
+        std::vector<estimate> estimates;
+        expr reduction;
+    };
+
+    /* accumulation is where a reduction accumulates its results: in local
+     * arrays of blocks of channels, in a local variable split by a simd
+     * reduction, or in its buffer. */
+    enum class accumulation
+    {
+        blocked,
+        simd,
+        memory
+    };
+
+    void schedule(expr);
+    void materialize();
+    void plan_fusion();
+    void write_fusion_plan(const std::string);
+    bool is_materialized(expr);
+    bool is_alias(expr);
+    bool is_scheduled(expr);
+    ir_schedule::placement get_placement(expr);
+    std::string get_node_id(expr);
+    void analyze_batch();
+    bool is_batched(expr, unsigned);
+    bool is_stripable(expr);
+    bool trace_window(expr, expr, window&);
+    void plan_chains();
+    void plan_memory();
+    exprs collect_reads(expr);
+    std::string add_global_symbol(expr);
+    std::string add_loop_symbol();
+    bool to_affine(expr, affine&);
+    affine get_affine(std::string);
+    affine get_flattened_index(std::vector<std::string>, dimensions);
+    affine get_address(expr, std::vector<std::string>);
+    std::string get_indices(std::vector<std::string>, dimensions);
+    std::string get_symbol(expr, std::vector<std::string>);
+    std::string generate(expr, std::vector<std::string>);
+    std::string generate(affine);
+    std::string generate_unary(unary::type, std::string);
+    std::string generate_hoisted(expr,
+                                 std::vector<std::string>,
+                                 std::string,
+                                 std::vector<std::string>&);
     std::string newline(int = 0);
-    void nest(exprs,
-              expr,
-              std::function<std::string()> = nullptr,
-              bool force_append = false);
+    std::vector<region> peel(std::vector<loop>, expr, std::vector<std::string>);
+    void open_loops(std::vector<loop>,
+                    std::string = {},
+                    dimension = 0,
+                    std::vector<std::string> = {});
+    void close_loops(std::vector<loop>);
+    void apply_schedule(expr, std::vector<loop>&, std::vector<std::string>&);
+    void apply_window(expr, std::vector<loop>&, std::vector<std::string>&);
+    std::string get_row_offset(expr, std::string);
+    void emit_chain(chain);
+    void emit_stage(expr);
+    void interchange(reduce_expr,
+                     std::vector<loop>&,
+                     std::vector<std::string>);
+    accumulation get_accumulation(reduce_expr, std::vector<loop>);
+    void emit_reduce_stage(reduce_expr);
+    void emit_blocked_reduce(std::vector<loop>,
+                             std::string,
+                             std::function<std::string(std::string)>,
+                             std::function<std::string(std::string)>,
+                             std::vector<std::string>);
+    gemm match_gemm(reduce_expr);
+    void emit_gemm_stage(reduce_expr, gemm);
+    expr match_softmax(expr);
+    void emit_softmax_stage(expr, expr);
 
     void visit(var_expr) override;
     void visit(cnst_expr) override;
@@ -35,16 +264,43 @@ struct ir_codegen : ir_visitor
     void visit(unary_expr) override;
     void visit(binary_expr) override;
 
-    bool opt_parallelize, opt_locality;
+    ir_codegen_options options;
+
+    exprs nodes, stages;
+    std::unordered_set<expr> indexed;
+
+    std::unordered_map<expr, unsigned> batch_axes;
+
+    std::vector<ir_mem_block> buffers;
+    ir_mem_planner_result mem_plan, batched_mem_plan;
 
-    std::unordered_set<std::string> reusable_symbols;
     std::unordered_map<expr, std::string> global_symbols;
-    std::unordered_map<expr, std::string> local_symbols;
-    exprs local_ranges;
+    std::unordered_map<expr, std::string> range_symbols;
+    std::unordered_set<expr> peeled_selects;
+    bool interior = false;
+    std::unordered_map<std::string, affine> affines;
+    std::string hoisted_loop;
+    std::vector<std::pair<std::string, std::string>> invariants;
+    unsigned vcount = 1, icount = 1;
 
     ir_dep_analysis_result dep_analysis;
     expr output;
 
+    std::unordered_map<expr, expr> softmaxes;
+    std::unordered_set<expr> fused;
+
+    std::unordered_map<expr, fusion> fusions;
+    std::unordered_map<expr, expr> epilogues;
+    std::unordered_map<expr, std::string> local_symbols;
+
+    std::vector<chain> chains;
+    std::unordered_map<expr, window> windows;
+    std::unordered_map<std::string, dimension> origins;
+
+    std::unordered_map<std::string, scheduled_loop> scheduled_loops;
+
+    std::unordered_map<expr, gemm> packed_weights;
+    bool uses_gemm = false;
     std::string indent_offset;
     std::stringstream body;
 };
@@ -0,0 +1,37 @@
+#ifndef TCC_CORE_IR_MEM_PLANNER_H
+#define TCC_CORE_IR_MEM_PLANNER_H
+
+#include "tcc/core/ir.h"
+#include <unordered_map>
+
+namespace tcc {
+
+/* ir_mem_block is a buffer of the given size in bytes that is live from
+ * the stage writing it through the last stage reading it, both inclusive. */
+struct ir_mem_block
+{
+    expr e;
+    dimension size;
+    unsigned first, last;
+};
+
+struct ir_mem_planner_result
+{
+    std::unordered_map<expr, dimension> offsets;
+    dimension arena_size = 0;
+    dimension peak_size = 0;
+};
+
+/* ir_mem_planner assigns buffers offsets within a single arena such that
+ * buffers with overlapping lifetimes never share memory. buffers are placed
+ * from the largest to the smallest, each into the smallest gap between the
+ * buffers it conflicts with that fits it. */
+struct ir_mem_planner
+{
+  public:
+    static ir_mem_planner_result apply(std::vector<ir_mem_block>, dimension);
+};
+
+} // namespace tcc
+
+#endif // TCC_CORE_IR_MEM_PLANNER_H
@@ -0,0 +1,157 @@
+#ifndef TCC_CORE_IR_SCHEDULE_H
+#define TCC_CORE_IR_SCHEDULE_H
+
+#include "tcc/core/ir_visitor.h"
+#include <unordered_map>
+
+namespace tcc {
+
+/* ir_schedule overrides how ir_codegen computes exprs. the loops of the
+ * stage computing an expr are named d0, d1, ... after the dimensions of its
+ * iteration space, which for reductions are the dimensions of the reduced
+ * operand; dimensions of extent 1 have no loop. loop directives transform
+ * these loops in the order they are given, and loops of scheduled stages
+ * are only parallelized and vectorized as scheduled. no directive changes
+ * results other than by reassociating reductions. */
+struct ir_schedule
+{
+    /* placement of the computation of an expr: decided by the fusion
+     * planner, inlined into its readers, stored by a stage of its own or
+     * computed depth first with a later stage over stripes of its rows. */
+    enum class placement
+    {
+        automatic,
+        inlined,
+        root,
+        at
+    };
+
+    /* directive transforms the named loops of a stage; a split turns
+     * loops[0] into loops[1] and loops[2] of factor iterations. */
+    struct directive
+    {
+        enum class type
+        {
+            split,
+            reorder,
+            vectorize,
+            parallel,
+            unroll
+        };
+
+        type directive_type;
+        std::vector<std::string> loops;
+        dimension factor;
+    };
+
+    struct stage
+    {
+        /* split splits loop into outer and inner loops, where the inner loop
+         * has factor iterations, which must divide the extent of loop. */
+        stage& split(std::string loop,
+                     std::string outer,
+                     std::string inner,
+                     dimension factor);
+
+        /* tile splits loops y and x into tiles of y_factor by x_factor
+         * iterations, ordered yo, xo, yi, xi. */
+        stage& tile(std::string y,
+                    std::string x,
+                    std::string yo,
+                    std::string xo,
+                    std::string yi,
+                    std::string xi,
+                    dimension y_factor,
+                    dimension x_factor);
+
+        /* reorder orders the given loops from outermost to innermost within
+         * the positions they occupy. */
+        stage& reorder(std::vector<std::string> loops);
+
+        /* vectorize makes loop, which must end up innermost, a simd loop. */
+        stage& vectorize(std::string loop);
+
+        /* parallel distributes loop, which must not be reduced, across
+         * threads. */
+        stage& parallel(std::string loop);
+
+        /* unroll unrolls loop, which must neither be parallel nor a simd
+         * loop, factor times. */
+        stage& unroll(std::string loop, dimension factor);
+
+        /* compute_inline recomputes the expr in every expr reading it. */
+        stage& compute_inline();
+
+        /* compute_root stores the expr by a stage of its own. */
+        stage& compute_root();
+
+        /* compute_at computes the stage depth first with the later stage
+         * consumer over stripes of rows rows of consumer, together with all
+         * stages in between, as for fused_tiling. */
+        stage& compute_at(expr consumer, dimension rows);
+
+        /* splits returns whether loop is split by a directive. */
+        bool splits(std::string loop) const;
+
+        std::vector<directive> directives;
+        placement compute = placement::automatic;
+        expr consumer;
+        dimension rows = 0;
+    };
+
+    stage& operator[](expr);
+
+    std::unordered_map<expr, stage> stages;
+};
+
+/* ir_schedule_parser reads a schedule of ir from a file holding a directive
+ * per line in one of the forms
+ *
+ *     <expr> split <loop> <outer> <inner> <factor>
+ *     <expr> tile <y> <x> <yo> <xo> <yi> <xi> <y_factor> <x_factor>
+ *     <expr> reorder <loop> <loop>...
+ *     <expr> vectorize <loop>
+ *     <expr> parallel <loop>
+ *     <expr> unroll <loop> <factor>
+ *     <expr> compute_inline
+ *     <expr> compute_root
+ *     <expr> compute_at <consumer> <rows>
+ *
+ * where exprs are referred to as n<i> by their position in post order, as
+ * in the fusion plan of ir_codegen. everything after a # is a comment. */
+struct ir_schedule_parser : ir_visitor
+{
+  public:
+    static ir_schedule apply(const std::string, expr);
+
+    /* parse_stage parses the directives of a single stage, separated by
+     * semicolons and written as above without the leading expr; compute_at
+     * is not supported. errors are reported at location. */
+    static ir_schedule::stage parse_stage(const std::string,
+                                          const std::string);
+
+    /* to_string writes the loop directives of a stage as parse_stage reads
+     * them. */
+    static std::string to_string(const ir_schedule::stage);
+
+  protected:
+    expr to_expr(const std::string, const std::string);
+    void parse(ir_schedule::stage&,
+               std::vector<std::string>,
+               const std::string);
+    void number(expr);
+    void visit(var_expr) override;
+    void visit(cnst_expr) override;
+    void visit(index_expr) override;
+    void visit(select_expr) override;
+    void visit(reshape_expr) override;
+    void visit(reduce_expr) override;
+    void visit(unary_expr) override;
+    void visit(binary_expr) override;
+
+    std::unordered_map<std::string, expr> ids;
+};
+
+} // namespace tcc
+
+#endif // TCC_CORE_IR_SCHEDULE_H
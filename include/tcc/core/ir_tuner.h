@@ -0,0 +1,47 @@
+#ifndef TCC_CORE_IR_TUNER_H
+#define TCC_CORE_IR_TUNER_H
+
+#include "tcc/core/ir_codegen.h"
+
+namespace tcc {
+
+/* ir_tuner_options configures how ir_tuner times schedules. */
+struct ir_tuner_options
+{
+    /* path of the tuning database, a text file holding a line per tuned
+     * layer with the cpu model, the signature of the layer and its fastest
+     * schedule, separated by tabs. */
+    std::string database_path;
+
+    /* command compiling a c file into a shared library, which should match
+     * the flags the generated code is finally compiled with. */
+    std::string compiler = "gcc -O3 -march=native -fopenmp -shared -fPIC";
+
+    /* number of timed calls of every variant, of which the fastest counts. */
+    unsigned repeats = 10;
+};
+
+/* ir_tuner picks schedules for the layers of ir by timing them on the local
+ * cpu. layers are the reductions that keep at least three dimensions, like
+ * convolutions and pooling; every distinct layer is compiled on its own,
+ * with the stored exprs it reads replaced by inputs, under its automatic
+ * loop nest and a set of variants that tile pixels, split channels into
+ * simd loops of several widths, unroll pixel tiles, move reductions inside
+ * or outside of channels and parallelize different loops. the fastest
+ * variant is recorded in the tuning database under the cpu model and the
+ * signature of the layer, which covers its structure and the codegen
+ * options, and reused by later runs without timing. the returned schedule
+ * is the schedule of codegen_options with the winning variants added for
+ * layers it does not schedule already. */
+struct ir_tuner
+{
+  public:
+    static ir_schedule apply(const std::string,
+                             expr,
+                             ir_codegen_options,
+                             ir_tuner_options);
+};
+
+} // namespace tcc
+
+#endif // TCC_CORE_IR_TUNER_H
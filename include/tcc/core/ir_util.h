@@ -16,6 +16,8 @@ std::shared_ptr<const T> downcast(expr e)
 /* declare unary expr wrappers and overload
  * arithmetic/logical operators for ir builder API. */
 expr exp(expr);
+expr sigmoid(expr);
+expr tanh(expr);
 expr operator+(expr, expr);
 expr operator-(expr, expr);
 expr operator*(expr, expr);
@@ -29,6 +31,9 @@ expr operator<(expr, expr);
 /* convert exprtype to string. */
 std::string to_string(exprtype);
 
+/* operands returns the exprs the given expr is computed from. */
+exprs operands(expr);
+
 /* to_ranges construct array of range from shape. */
 exprs to_ranges(dimensions);
 
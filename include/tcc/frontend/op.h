@@ -6,6 +6,19 @@
 
 namespace tcc {
 
+/* conv2d_lowering selects how build_conv2d expresses a convolution: as a
+ * reduction over a stencil of the input, as a matrix multiplication of an
+ * im2col buffer and the filter, which ir_codegen emits as a blocked gemm, or,
+ * for stride 1 3x3 convolutions with constant filters, by winograd's f(2x2,
+ * 3x3) algorithm, which trades exactness in the last bits for fewer
+ * multiplications. */
+enum class conv2d_lowering
+{
+    direct,
+    gemm,
+    winograd
+};
+
 expr build_placeholder(datatype, dimensions);
 
 expr build_const(std::string, datatype, dimensions);
@@ -16,7 +29,13 @@ expr build_avgpool(std::string, std::string, dimensions, dimensions, expr);
 
 expr build_biasadd(std::string, expr, expr);
 
-expr build_conv2d(std::string, std::string, dimensions, dimensions, expr, expr);
+expr build_conv2d(std::string,
+                  std::string,
+                  dimensions,
+                  dimensions,
+                  expr,
+                  expr,
+                  conv2d_lowering = conv2d_lowering::direct);
 
 expr build_depthwiseconv2dnative(std::string,
                                  std::string,
@@ -33,10 +52,16 @@ expr build_reshape(expr, expr);
 
 expr build_shape(expr);
 
+expr build_sigmoid(expr);
+
 expr build_softmax(expr);
 
 expr build_squeeze(dimensions, expr);
 
+expr build_tanh(expr);
+
+expr build_transpose(expr, expr);
+
 } // namespace tcc
 
 #endif // TCC_FRONTEND_OP_H
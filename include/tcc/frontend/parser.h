@@ -2,12 +2,16 @@
 #define TCC_FRONTEND_PARSER_H
 
 #include "tcc/core/ir.h"
+#include "tcc/frontend/op.h"
 #include <unordered_map>
 
 namespace tcc {
 
-/* parse deserializes the tensorflow frozen graph and parses it into core ir. */
-expr parse(const std::string, std::unordered_map<std::string, dimensions>&);
+/* parse deserializes the tensorflow frozen graph and parses it into core ir;
+ * convolutions are lowered as selected by conv2d_lowering. */
+expr parse(const std::string,
+           std::unordered_map<std::string, dimensions>&,
+           conv2d_lowering = conv2d_lowering::direct);
 
 } // namespace tcc
 
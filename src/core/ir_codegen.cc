@@ -1,105 +1,524 @@
 #include "tcc/core/ir_codegen.h"
 #include "tcc/core/ir_util.h"
 #include <algorithm>
+#include <cctype>
+#include <cmath>
 #include <fstream>
+#include <functional>
 #include <iomanip>
+#include <limits>
+#include <map>
 
 namespace tcc {
 
-/* remove all cnst dimensions from ranges. */
-static exprs squeeze_ranges(exprs ranges)
+/* stages with fewer loop iterations than parallel_min_work are not worth
+ * distributing across threads; outer loops are collapsed until there are
+ * at least parallel_min_iters iterations to share between threads. */
+static const dimension parallel_min_work = 1 << 14;
+static const dimension parallel_min_iters = 64;
+
+/* reductions into elements of a tensor with fewer innermost iterations are
+ * better left to the c compiler, which unrolls them and vectorizes across
+ * output elements instead. */
+static const dimension simd_min_reduce_iters = 16;
+
+/* alignment in bytes of stored arrays, wide enough for avx-512. */
+static const unsigned vector_alignment = 64;
+
+/* caches move memory in lines of cache_line bytes. */
+static const unsigned cache_line = 64;
+
+/* the fusion planner weighs a byte moved to or from memory like
+ * fusion_byte_cost arithmetic operations, and exp, sigmoid and tanh like
+ * transcendental_flops of them. */
+static const double fusion_byte_cost = 1;
+static const double transcendental_flops = 20;
+
+/* to_literal prints a float with enough digits to round trip exactly;
+ * infinities and nan are printed as the macros of math.h, parenthesized
+ * when negative so that they may follow a binary minus. */
+static std::string to_literal(float value)
 {
-    exprs squeezed_ranges;
-    std::remove_copy_if(
-        ranges.begin(),
-        ranges.end(),
-        std::back_inserter(squeezed_ranges),
-        [](expr e) -> bool { return e->type == exprtype::cnst; });
-    return squeezed_ranges;
+    if (std::isnan(value))
+    {
+        return "NAN";
+    }
+    if (std::isinf(value))
+    {
+        return value < 0 ? "(-INFINITY)" : "INFINITY";
+    }
+
+    std::stringstream ss;
+    ss << std::setprecision(9) << value;
+    std::string literal = ss.str();
+    if (literal.find_first_of(".en") == std::string::npos)
+    {
+        literal += ".";
+    }
+    return literal + "f";
+}
+
+/* is_identifier returns whether the c expression s is a single symbol. */
+static bool is_identifier(std::string s)
+{
+    return !s.empty() && std::isalpha(s.front()) &&
+           std::all_of(s.begin(), s.end(), [](char c) {
+               return std::isalnum(c) || c == '_';
+           });
+}
+
+/* is_operand returns whether the c expression s binds tighter than any
+ * operator, that is whether it is a symbol, a literal or parenthesized. */
+static bool is_operand(std::string s)
+{
+    if (s.empty() || std::all_of(s.begin(), s.end(), [](char c) {
+            return std::isalnum(c) || c == '_';
+        }))
+    {
+        return !s.empty();
+    }
+
+    int depth = 0;
+    for (unsigned i = 0; i < s.size(); i++)
+    {
+        depth += s[i] == '(' ? 1 : (s[i] == ')' ? -1 : 0);
+        if (depth == 0 && i + 1 < s.size())
+        {
+            return false;
+        }
+    }
+    return s.front() == '(';
+}
+
+/* generate_weights_loader returns functions that map a weights file into
+ * memory. the page cache shares a mapped file between processes and loading
+ * another file swaps the weights in place: calls starting after the swap
+ * read the new weights, while the previous mapping is released once the
+ * calls still reading it have returned. calls count themselves as readers
+ * of the current epoch, which a swap flips before it waits for the readers
+ * of the previous epoch; loads and unloads must not run concurrently with
+ * each other. */
+static std::string generate_weights_loader(std::string target_name,
+                                           size_t size)
+{
+    std::string base = target_name + "_weights_base";
+    std::string epoch = target_name + "_weights_epoch";
+    std::string readers = target_name + "_weights_readers";
+    std::string sz = std::to_string(size);
+    if (size == 0)
+    {
+        return "void " + target_name + "_unload_weights(void) {}\n" + "int " +
+               target_name + "_load_weights(const char* path) {\n" +
+               "    return path ? 0 : -1;\n" + "}\n";
+    }
+
+    return "#include <fcntl.h>\n"
+           "#include <sched.h>\n"
+           "#include <sys/mman.h>\n"
+           "#include <sys/stat.h>\n"
+           "#include <unistd.h>\n"
+           "static const float* " +
+           base + ";\n" + "static int " + epoch + ";\n" + "static int " +
+           readers + "[2];\n" + "static int " + target_name +
+           "_enter_weights(void) {\n"
+           "    for (;;) {\n"
+           "        int epoch=__atomic_load_n(&" +
+           epoch +
+           ",__ATOMIC_SEQ_CST);\n"
+           "        __atomic_add_fetch(&" +
+           readers +
+           "[epoch],1,__ATOMIC_SEQ_CST);\n"
+           "        if (epoch==__atomic_load_n(&" +
+           epoch +
+           ",__ATOMIC_SEQ_CST)) return epoch;\n"
+           "        __atomic_sub_fetch(&" +
+           readers +
+           "[epoch],1,__ATOMIC_SEQ_CST);\n"
+           "    }\n"
+           "}\n"
+           "static void " +
+           target_name +
+           "_leave_weights(int epoch) {\n"
+           "    __atomic_sub_fetch(&" +
+           readers +
+           "[epoch],1,__ATOMIC_RELEASE);\n"
+           "}\n"
+           "static void " +
+           target_name +
+           "_swap_weights(const float* weights) {\n"
+           "    const float* previous=__atomic_exchange_n(&" +
+           base +
+           ",weights,__ATOMIC_SEQ_CST);\n"
+           "    int epoch=__atomic_load_n(&" +
+           epoch +
+           ",__ATOMIC_SEQ_CST);\n"
+           "    __atomic_store_n(&" +
+           epoch +
+           ",!epoch,__ATOMIC_SEQ_CST);\n"
+           "    while (__atomic_load_n(&" +
+           readers +
+           "[epoch],__ATOMIC_SEQ_CST)) sched_yield();\n"
+           "    if (previous) munmap((void*)previous," +
+           sz +
+           ");\n"
+           "}\n"
+           "void " +
+           target_name +
+           "_unload_weights(void) {\n"
+           "    " +
+           target_name +
+           "_swap_weights((const float*)0);\n"
+           "}\n"
+           "int " +
+           target_name +
+           "_load_weights(const char* path) {\n"
+           "    struct stat st;\n"
+           "    int fd=open(path,O_RDONLY);\n"
+           "    if (fd<0) return -1;\n"
+           "    if (fstat(fd,&st) || st.st_size!=" +
+           sz +
+           ") {\n"
+           "        close(fd);\n"
+           "        return -1;\n"
+           "    }\n"
+           "    void* weights=mmap(0," +
+           sz +
+           ",PROT_READ,MAP_SHARED,fd,0);\n"
+           "    close(fd);\n"
+           "    if (weights==MAP_FAILED) return -1;\n"
+           "    " +
+           target_name +
+           "_swap_weights((const float*)weights);\n"
+           "    return 0;\n"
+           "}\n";
+}
+
+/* b matrices of gemms are read in panels of gemm_panel columns. */
+static const dimension gemm_panel = 32;
+
+/* generate_gemm_kernel returns a function computing c[l] = a[l] * b[l % h]
+ * for g groups of row major matrices a [m, k] and c [m, n]. b [k, n] is
+ * either row major or packed into zero padded panels of 32 columns stored
+ * one after another, each row major [k, 32]. k is split into blocks that keep
+ * panels of b in cache, and each block is computed in tiles of 6 rows and two
+ * vectors of columns, which stay in vector registers of the width of the
+ * target isa; the remaining tiles at the edges of c are computed by scalar
+ * loops. */
+static std::string generate_gemm_kernel(ir_codegen_options options)
+{
+    std::string parallel =
+        options.parallelize
+            ? "        #pragma omp parallel for collapse(2)" +
+                  (options.threads > 0
+                       ? " num_threads(" + std::to_string(options.threads) + ")"
+                       : std::string()) +
+                  " if((long)g*m*n*kc>=" + std::to_string(parallel_min_work) +
+                  ")\n"
+            : "";
+
+    return "#if defined(__AVX512F__)\n"
+           "#define TCC_VL 16\n"
+           "#elif defined(__AVX__)\n"
+           "#define TCC_VL 8\n"
+           "#else\n"
+           "#define TCC_VL 4\n"
+           "#endif\n"
+           "typedef float tcc_vf __attribute__((vector_size(TCC_VL*4)));\n"
+           "static void tcc_gemm(int g,int h,int m,int n,int k,"
+           "const float* restrict a,const float* restrict b,int packed,"
+           "float* restrict c) {\n"
+           "    long bg=packed?(long)(n+31)/32*32*k:(long)k*n;\n"
+           "    int rs=packed?32:n;\n"
+           "    for (int k0=0;k0<k;k0+=256) {\n"
+           "        int kc=k-k0<256?k-k0:256;\n" +
+           parallel +
+           "        for (int l=0;l<g;l++) {\n"
+           "            for (int i=0;i<m;i+=6) {\n"
+           "                const float* restrict al=a+(long)l*m*k;\n"
+           "                float* restrict cl=c+(long)l*m*n;\n"
+           "                for (int j=0;j<n;j+=2*TCC_VL) {\n"
+           "                    const float* restrict bl=b+(l%h)*bg+"
+           "(packed?(long)j/32*32*k+j%32:j);\n"
+           "                    int w=n-j<2*TCC_VL?n-j:2*TCC_VL;\n"
+           "                    if (i+6<=m && (w==2*TCC_VL || packed)) {\n"
+           "                        tcc_vf acc[6][2];\n"
+           "                        #pragma GCC unroll 6\n"
+           "                        for (int r=0;r<6;r++) {\n"
+           "                            acc[r][0]=acc[r][1]=(tcc_vf){0};\n"
+           "                            if (k0) __builtin_memcpy(acc[r],"
+           "cl+(long)(i+r)*n+j,w*4);\n"
+           "                        }\n"
+           "                        for (int p=k0;p<k0+kc;p++) {\n"
+           "                            tcc_vf bv[2];\n"
+           "                            __builtin_memcpy(bv,bl+(long)p*rs,"
+           "sizeof(bv));\n"
+           "                            #pragma GCC unroll 6\n"
+           "                            for (int r=0;r<6;r++) {\n"
+           "                                acc[r][0]+="
+           "al[(long)(i+r)*k+p]*bv[0];\n"
+           "                                acc[r][1]+="
+           "al[(long)(i+r)*k+p]*bv[1];\n"
+           "                            }\n"
+           "                        }\n"
+           "                        #pragma GCC unroll 6\n"
+           "                        for (int r=0;r<6;r++) "
+           "__builtin_memcpy(cl+(long)(i+r)*n+j,acc[r],w*4);\n"
+           "                    } else {\n"
+           "                        for (int r=i;r<m && r<i+6;r++) {\n"
+           "                            for (int s=0;s<w;s++) {\n"
+           "                                float sum=k0?cl[(long)r*n+j+s]:0;\n"
+           "                                for (int p=k0;p<k0+kc;p++) "
+           "sum+=al[(long)r*k+p]*bl[(long)p*rs+s];\n"
+           "                                cl[(long)r*n+j+s]=sum;\n"
+           "                            }\n"
+           "                        }\n"
+           "                    }\n"
+           "                }\n"
+           "            }\n"
+           "        }\n"
+           "    }\n"
+           "}\n";
+}
+
+/* generate_math_library returns the fast exp, sigmoid and tanh as simd
+ * functions without branches. exp reduces x = n * ln2 + r with ln2 split in
+ * two, approximates e^r with a polynomial of degree 7 and scales it by 2^n,
+ * built from exponent bits in two factors so that results below FLT_MIN
+ * flush gracefully; |x| is clamped through its bits since fminf does not
+ * vectorize without -ffast-math, after nan, whose bits exceed those of inf,
+ * is set aside to be returned unchanged. tanh uses an odd polynomial below
+ * 0.625 and 1 - 2 / (e^2|x| + 1) above, blended by a bit mask. */
+static std::string generate_math_library()
+{
+    return "#pragma omp declare simd\n"
+           "static inline float tcc_expf(float x) {\n"
+           "    float a=__builtin_fabsf(x);\n"
+           "    int b,nan;\n"
+           "    __builtin_memcpy(&b,&a,4);\n"
+           "    nan=b>0x7f800000;\n"
+           "    b=b<0x42b00000?b:0x42b00000;\n"
+           "    __builtin_memcpy(&a,&b,4);\n"
+           "    float y=__builtin_copysignf(a,x);\n"
+           "    int n=(int)(y*1.44269504f+__builtin_copysignf(.5f,y));\n"
+           "    float r=y-(float)n*.693359375f+(float)n*2.12194440e-4f;\n"
+           "    float p=1.9875691500e-4f;\n"
+           "    p=p*r+1.3981999507e-3f;\n"
+           "    p=p*r+8.3334519073e-3f;\n"
+           "    p=p*r+4.1665795894e-2f;\n"
+           "    p=p*r+1.6666665459e-1f;\n"
+           "    p=p*r+5.0000001201e-1f;\n"
+           "    p=p*r*r+r+1.f;\n"
+           "    int i1=((n>>1)+127)<<23,i2=(n-(n>>1)+127)<<23;\n"
+           "    float s1,s2;\n"
+           "    __builtin_memcpy(&s1,&i1,4);\n"
+           "    __builtin_memcpy(&s2,&i2,4);\n"
+           "    return nan?x:p*s1*s2;\n"
+           "}\n"
+           "#pragma omp declare simd\n"
+           "static inline float tcc_sigmoidf(float x) {\n"
+           "    return 1.f/(1.f+tcc_expf(-x));\n"
+           "}\n"
+           "#pragma omp declare simd\n"
+           "static inline float tcc_tanhf(float x) {\n"
+           "    float a=__builtin_fabsf(x),z=x*x;\n"
+           "    float p=-5.70498872745e-3f;\n"
+           "    p=p*z+2.06390887954e-2f;\n"
+           "    p=p*z-5.37397155531e-2f;\n"
+           "    p=p*z+1.33314422036e-1f;\n"
+           "    p=p*z-3.33332819422e-1f;\n"
+           "    p=p*z*x+x;\n"
+           "    float t=__builtin_copysignf(1.f-2.f/(tcc_expf(2.f*a)+1.f),x);\n"
+           "    int pb,tb,m=-(a<.625f);\n"
+           "    __builtin_memcpy(&pb,&p,4);\n"
+           "    __builtin_memcpy(&tb,&t,4);\n"
+           "    tb=(pb&m)|(tb&~m);\n"
+           "    __builtin_memcpy(&t,&tb,4);\n"
+           "    return t;\n"
+           "}\n";
 }
 
-/* count coalesable dimensions of given ranges. */
-static unsigned match_ranges(exprs old, exprs current)
+/* pack_panels packs h row major matrices [k, n] into zero padded panels of
+ * gemm_panel columns as read by the gemm kernel. */
+static std::string pack_panels(std::string data,
+                               dimension h,
+                               dimension k,
+                               dimension n)
 {
-    unsigned matched_dims = 0;
-    for (expr dim : current)
+    dimension panels = (n + gemm_panel - 1) / gemm_panel;
+    std::vector<float> matrices = vector_deserialize<float>(data, h * k * n),
+                       packed(h * panels * k * gemm_panel, 0.0f);
+    for (dimension l = 0; l < h; l++)
     {
-        if (matched_dims < old.size())
+        for (dimension p = 0; p < k; p++)
         {
-            tcc_assert(dim->type == exprtype::range &&
-                           old[matched_dims]->type == exprtype::range,
-                       "non-squeezed dimension is found.");
-            if (downcast<range>(dim)->bound !=
-                downcast<range>(old[matched_dims])->bound)
+            for (dimension j = 0; j < n; j++)
             {
-                break;
+                packed[((l * panels + j / gemm_panel) * k + p) * gemm_panel +
+                       j % gemm_panel] = matrices[(l * k + p) * n + j];
             }
-            matched_dims++;
         }
     }
-    return matched_dims;
+    return vector_serialize<float>(packed);
+}
+
+/* floor_div rounds the quotient towards negative infinity; b is positive. */
+static dimension floor_div(dimension a, dimension b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+static std::string to_ctype(datatype dtype)
+{
+    switch (dtype)
+    {
+        case datatype::FP32:
+            return "float";
+        case datatype::INT64:
+            return "int";
+        case datatype::INT32:
+            return "int";
+        default:
+            tcc_error("unsupported datatype.");
+    }
 }
 
-void ir_codegen::apply(const std::string target_name, expr ir)
+void ir_codegen::apply(const std::string target_name,
+                       expr ir,
+                       ir_codegen_options options)
 {
     /* initialize and apply codegen visitor. */
     std::shared_ptr<ir_codegen> v(new ir_codegen);
-    v->opt_parallelize = false;
-    v->opt_locality = true;
+    v->options = options;
     v->dep_analysis = ir_dep_analysis::apply(ir);
     v->output = ir;
-    v->body << v->newline(1);
     ir->accept(v);
+    v->materialize();
+    v->analyze_batch();
+    v->plan_chains();
+    v->plan_memory();
+
+    v->body << v->newline(1);
+    std::vector<chain>::iterator c = v->chains.begin();
+    for (unsigned i = 0; i < v->stages.size(); i++)
+    {
+        if (c != v->chains.end() && c->begin == i)
+        {
+            v->emit_chain(*c);
+            i = c++->end - 1;
+        }
+        else
+        {
+            v->emit_stage(v->stages[i]);
+        }
+    }
     v->body << v->newline(-1);
     tcc_assert_has_key(v->global_symbols, v->output);
+    if (v->options.print_fusion)
+    {
+        v->write_fusion_plan(target_name);
+    }
 
-    /* generate static global variables. */
-    std::function<std::string(expr)> generate_var_signature = [&v](expr e) {
-        tcc_assert_has_key(v->global_symbols, e);
+    /* inputs and output are passed as function parameters. */
+    exprs inouts(v->dep_analysis.inputs.begin(), v->dep_analysis.inputs.end());
+    inouts.push_back(v->output);
 
-        std::string ctype = [&]() -> std::string {
-            switch (e->dtype)
-            {
-                case datatype::FP32:
-                    return "float";
-                case datatype::INT64:
-                    return "int";
-                case datatype::INT32:
-                    return "int";
-                default:
-                    tcc_error("unsupported datatype.");
-            }
-        }();
+    /* generate static global variables; arrays are aligned to vector
+     * registers and parameters of the definition are restrict qualified. */
+    std::function<std::string(expr, std::string)> generate_var_signature =
+        [&](expr e, std::string qualifier) {
+            tcc_assert_has_key(v->global_symbols, e);
 
-        std::string size = [&]() -> std::string {
-            return e->shape.empty() ? ""
-                                    : ("[" + std::to_string(e->size()) + "]");
-        }();
+            std::string size = [&]() -> std::string {
+                dimension elements = e->size();
+                if (v->packed_weights.find(e) != v->packed_weights.end())
+                {
+                    gemm g = v->packed_weights.at(e);
+                    elements = g.b_groups * g.k *
+                               ((g.n + gemm_panel - 1) / gemm_panel) *
+                               gemm_panel;
+                }
+                return e->shape.empty() ? ""
+                                        : ("[" + qualifier +
+                                           std::to_string(elements) + "]");
+            }();
+
+            std::string alignment = [&]() -> std::string {
+                return e->shape.empty() || std::count(inouts.begin(),
+                                                      inouts.end(),
+                                                      e)
+                           ? ""
+                           : " __attribute__((aligned(" +
+                                 std::to_string(vector_alignment) + ")))";
+            }();
+
+            return to_ctype(e->dtype) + " " + v->global_symbols.at(e) + size +
+                   alignment;
+        };
 
-        return ctype + " " + v->global_symbols.at(e) + size;
-    };
+    /* the function returns whether it ran when it can fail, which mapped
+     * weights do before they are loaded and runtime batches out of range. */
+    bool fallible =
+        v->options.weights == ir_codegen_options::storage::external ||
+        v->options.max_batch > 0;
 
     /* generate function signature. */
-    exprs inouts(v->dep_analysis.inputs.begin(), v->dep_analysis.inputs.end());
-    inouts.push_back(v->output);
-    std::function<std::string()> generate_func_signature = [&]() {
-        return "void " + target_name + "(" +
-               std::accumulate(inouts.begin() + 1,
-                               inouts.end(),
-                               generate_var_signature(inouts[0]),
-                               [&](std::string str, expr e) {
-                                   return str + "," + generate_var_signature(e);
-                               }) +
-               ")";
-    };
+    std::function<std::string(std::string)> generate_func_signature =
+        [&](std::string qualifier) {
+            return (fallible ? "int " : "void ") + target_name + "(" +
+                   std::accumulate(
+                       inouts.begin() + 1,
+                       inouts.end(),
+                       (v->options.workspace ? "void* " + qualifier +
+                                                   "workspace,"
+                                             : "") +
+                           (v->options.max_batch > 0 ? "int batch," : "") +
+                           generate_var_signature(inouts[0], qualifier),
+                       [&](std::string str, expr e) {
+                           return str + "," +
+                                  generate_var_signature(e, qualifier);
+                       }) +
+                   ")";
+        };
 
     /* generate header file. */
     std::string header_path = target_name + "/" + target_name + ".h";
     std::ofstream hfile(header_path, std::ios::trunc);
     tcc_assert(hfile, "failed to open file at " + header_path);
 
-    hfile << "#pragma once" << v->newline() << "extern "
-          << generate_func_signature() << ";";
+    std::string workspace_size_signature =
+        "size_t " + target_name + "_workspace_size(" +
+        (v->options.max_batch > 0 ? "int batch" : "void") + ")";
+
+    hfile << "#pragma once" << v->newline();
+    if (v->options.workspace)
+    {
+        hfile << "#include <stddef.h>" << v->newline() << "extern "
+              << workspace_size_signature << ";" << v->newline();
+    }
+    if (fallible)
+    {
+        std::vector<std::string> failures;
+        if (v->options.max_batch > 0)
+        {
+            failures.push_back("batch is not within [1, " +
+                               std::to_string(v->options.max_batch) + "]");
+        }
+        if (v->options.weights == ir_codegen_options::storage::external)
+        {
+            failures.push_back("no weights are loaded");
+        }
+        hfile << "/* returns 0, or -1 without computing anything if "
+              << failures[0]
+              << (failures.size() > 1 ? " or " + failures[1] : "") << ". */"
+              << v->newline();
+    }
+    hfile << "extern " << generate_func_signature({}) << ";";
+    if (v->options.weights == ir_codegen_options::storage::external)
+    {
+        hfile << v->newline() << "extern int " << target_name
+              << "_load_weights(const char* path);" << v->newline()
+              << "extern void " << target_name << "_unload_weights(void);";
+    }
     hfile.close();
 
     /* generate source file. */
@@ -107,516 +526,3363 @@ void ir_codegen::apply(const std::string target_name, expr ir)
     std::ofstream sfile(source_path, std::ios::trunc);
     tcc_assert(sfile, "failed to open file at " + source_path);
 
-    sfile << "#include <math.h>" << v->newline()
-          << (v->opt_parallelize ? "#include <omp.h>" : "") << v->newline()
-          << "#include \"" + target_name + ".h\"" << v->newline();
+    sfile << "#include <math.h>" << v->newline()
+          << "#include \"" + target_name + ".h\"" << v->newline();
+
+    /* symbols of inputs and output are function parameters, scalars are
+     * local variables and other buffers point into the arena. buffers with
+     * a runtime batch follow the other buffers and are placed by a plan for
+     * a single batch, with offsets and sizes scaled by the batch size. */
+    std::unordered_set<std::string> declared_symbols;
+    for (expr e : inouts)
+    {
+        declared_symbols.insert(v->global_symbols.at(e));
+    }
+
+    std::string weights_symbol = target_name + "_weights";
+    std::string weights_blob;
+    std::stringstream weights_decls;
+
+    std::string arena_symbol = target_name + "_arena";
+    std::stringstream arena_decls, scalar_decls;
+    bool local_arena_decls = v->options.workspace || v->options.max_batch > 0;
+    dimension arena_size =
+        v->mem_plan.arena_size +
+        std::max(v->options.max_batch, dimension(0)) *
+            v->batched_mem_plan.arena_size;
+    for (expr e : v->nodes)
+    {
+        if (v->global_symbols.find(e) == v->global_symbols.end() ||
+            declared_symbols.count(v->global_symbols.at(e)))
+        {
+            continue;
+        }
+
+        if (e->type == exprtype::cnst)
+        {
+            tcc_assert(e->dtype == datatype::FP32,
+                       "cnst datatype is not FP32.");
+            std::string data = downcast<cnst>(e)->data;
+            if (v->packed_weights.find(e) != v->packed_weights.end())
+            {
+                gemm g = v->packed_weights.at(e);
+                data = pack_panels(data, g.b_groups, g.k, g.n);
+            }
+
+            if (v->options.weights == ir_codegen_options::storage::text)
+            {
+                weights_decls << "static const "
+                              << generate_var_signature(e, {}) << "= {";
+                for (float ele : vector_deserialize<float>(
+                         data, data.size() / sizeof(float)))
+                {
+                    weights_decls << to_literal(ele) << ",";
+                }
+                weights_decls << "};" << v->newline();
+            }
+            else
+            {
+                /* tensors are stored back to back in the blob, each
+                 * starting at an offset aligned to vector registers. */
+                size_t padding = (vector_alignment - weights_blob.size() %
+                                                         vector_alignment) %
+                                 vector_alignment;
+                weights_blob.append(padding, '\0');
+                weights_decls
+                    << (v->options.weights == ir_codegen_options::storage::blob
+                            ? "static const float* const "
+                            : "    const float* const ")
+                    << v->global_symbols.at(e) << "=" << weights_symbol << "+"
+                    << weights_blob.size() / sizeof(float) << ";"
+                    << v->newline();
+                weights_blob += data;
+            }
+            declared_symbols.insert(v->global_symbols.at(e));
+        }
+        else if (e->shape.empty())
+        {
+            scalar_decls << "    " << generate_var_signature(e, {}) << ";"
+                         << v->newline();
+        }
+        else
+        {
+            std::string ctype = to_ctype(e->dtype);
+            std::string offset =
+                v->batch_axes.find(e) == v->batch_axes.end()
+                    ? std::to_string(v->mem_plan.offsets.at(e) / sizeof(float))
+                    : std::to_string(v->mem_plan.arena_size / sizeof(float)) +
+                          "+batch*" +
+                          std::to_string(v->batched_mem_plan.offsets.at(e) /
+                                         sizeof(float));
+            arena_decls << (local_arena_decls ? "    " : "static ") << ctype
+                        << "* const " << v->global_symbols.at(e) << "="
+                        << (ctype == "float" ? "" : "(" + ctype + "*)")
+                        << arena_symbol << "+" << offset << ";"
+                        << v->newline();
+        }
+        declared_symbols.insert(v->global_symbols.at(e));
+    }
+
+    if (v->options.workspace)
+    {
+        sfile << workspace_size_signature << " {" << v->newline(1)
+              << "return " << v->mem_plan.arena_size
+              << (v->options.max_batch > 0
+                      ? "+(size_t)batch*" +
+                            std::to_string(v->batched_mem_plan.arena_size)
+                      : "")
+              << ";" << v->newline(-1) << "}" << v->newline();
+    }
+    else if (arena_size > 0)
+    {
+        sfile << "static float " << arena_symbol << "["
+              << arena_size / sizeof(float) << "] __attribute__((aligned("
+              << vector_alignment << ")));" << v->newline();
+        if (!local_arena_decls)
+        {
+            sfile << arena_decls.str();
+        }
+    }
+
+    /* generate memory plan report. */
+    std::string memplan_path = target_name + "/" + target_name + ".memplan";
+    std::ofstream mfile(memplan_path, std::ios::trunc);
+    tcc_assert(mfile, "failed to open file at " + memplan_path);
+
+    mfile << "arena size: " << v->mem_plan.arena_size << " bytes";
+    if (v->options.max_batch > 0)
+    {
+        mfile << " + " << v->batched_mem_plan.arena_size << " bytes per batch";
+    }
+    mfile << v->newline() << "peak activation size: " << v->mem_plan.peak_size
+          << " bytes";
+    if (v->options.max_batch > 0)
+    {
+        mfile << " + " << v->batched_mem_plan.peak_size << " bytes per batch";
+    }
+    mfile << v->newline() << "symbol offset size first_stage last_stage"
+          << v->newline();
+    for (ir_mem_block buffer : v->buffers)
+    {
+        mfile << v->global_symbols.at(buffer.e) << " ";
+        if (v->batch_axes.find(buffer.e) == v->batch_axes.end())
+        {
+            mfile << v->mem_plan.offsets.at(buffer.e);
+        }
+        else
+        {
+            mfile << v->mem_plan.arena_size << "+batch*"
+                  << v->batched_mem_plan.offsets.at(buffer.e);
+        }
+        mfile << " "
+              << (v->batch_axes.find(buffer.e) == v->batch_axes.end()
+                      ? ""
+                      : "batch*")
+              << buffer.size << " " << buffer.first << " " << buffer.last
+              << v->newline();
+    }
+    mfile.close();
+
+    /* generate weights file; it is either embedded into the read-only data
+     * section of the object file, in which case the assembler looks it up
+     * relative to its working directory and the directories given with
+     * -Wa,-I, or mapped into memory at runtime. */
+    if (!weights_blob.empty())
+    {
+        std::string weights_path = target_name + "/" + target_name + ".weights";
+        std::ofstream wfile(weights_path, std::ios::trunc | std::ios::binary);
+        tcc_assert(wfile, "failed to open file at " + weights_path);
+        wfile.write(weights_blob.data(), weights_blob.size());
+        wfile.close();
+    }
+
+    if (v->options.weights == ir_codegen_options::storage::external)
+    {
+        sfile << generate_weights_loader(target_name, weights_blob.size());
+    }
+    else if (!weights_blob.empty())
+    {
+        std::string incbin = ".incbin \\\"" + target_name + ".weights\\\"\\n";
+        sfile << "#ifdef __APPLE__" << v->newline()
+              << "__asm__(\".const\\n.p2align 6\\n.private_extern _"
+              << weights_symbol << "\\n_" << weights_symbol << ":\\n"
+              << incbin << ".text\");" << v->newline() << "#else"
+              << v->newline()
+              << "__asm__(\".section .rodata\\n.balign 64\\n.globl "
+              << weights_symbol << "\\n.hidden " << weights_symbol << "\\n"
+              << weights_symbol << ":\\n" << incbin << ".previous\");"
+              << v->newline() << "#endif" << v->newline()
+              << "extern const float " << weights_symbol
+              << "[] __attribute__((aligned(" << vector_alignment
+              << "), visibility(\"hidden\")));" << v->newline();
+    }
+    if (v->options.weights != ir_codegen_options::storage::external)
+    {
+        sfile << weights_decls.str();
+    }
+
+    if (v->uses_gemm)
+    {
+        sfile << generate_gemm_kernel(v->options);
+    }
+    if (v->options.math == ir_codegen_options::precision::fast)
+    {
+        sfile << generate_math_library();
+    }
+
+    /* write function body to file and remove any empty lines */
+    sfile << generate_func_signature("restrict ") << " {\n"
+          << scalar_decls.str();
+    if (v->options.max_batch > 0)
+    {
+        sfile << "    if (batch<1 || batch>" << v->options.max_batch
+              << ") return -1;" << v->newline();
+    }
+    if (v->options.workspace && arena_size > 0)
+    {
+        sfile << "    float* const " << arena_symbol << "=(float*)workspace;"
+              << v->newline();
+    }
+    if (local_arena_decls)
+    {
+        sfile << arena_decls.str();
+    }
+
+    /* mapped weights are read through a pointer loaded once per call, so a
+     * call never observes two different sets of weights, and the call is a
+     * reader of them until it returns. */
+    bool mapped = v->options.weights == ir_codegen_options::storage::external &&
+                  !weights_blob.empty();
+    if (mapped)
+    {
+        sfile << "    int epoch=" << target_name << "_enter_weights();"
+              << v->newline() << "    const float* " << weights_symbol
+              << "=__atomic_load_n(&" << weights_symbol
+              << "_base,__ATOMIC_SEQ_CST);" << v->newline() << "    if (!"
+              << weights_symbol << ") {" << v->newline() << "        "
+              << target_name << "_leave_weights(epoch);" << v->newline()
+              << "        return -1;" << v->newline() << "    }"
+              << v->newline() << weights_decls.str();
+    }
+
+    std::string line;
+    while (std::getline(v->body, line))
+        if (line.find_first_not_of(' ') != std::string::npos)
+            sfile << line << '\n';
+
+    if (mapped)
+    {
+        sfile << "    " << target_name << "_leave_weights(epoch);"
+              << v->newline();
+    }
+    if (fallible)
+    {
+        sfile << "    return 0;" << v->newline();
+    }
+    sfile << "}";
+    sfile.close();
+}
+
+void ir_codegen::schedule(expr e)
+{
+    if (!e->shape.empty() || e->type == exprtype::reduce)
+    {
+        nodes.push_back(e);
+    }
+}
+
+void ir_codegen::materialize()
+{
+    /* softmaxes are computed by a single stage reading their logits; the
+     * exprs in between are not emitted, unless any of them is scheduled. */
+    for (expr e : nodes)
+    {
+        expr logits = match_softmax(e);
+        if (!logits)
+        {
+            continue;
+        }
+
+        std::unordered_set<expr> between;
+        std::function<void(expr)> fuse = [&](expr x) {
+            for (expr operand : operands(x))
+            {
+                if (operand != logits && between.insert(operand).second)
+                {
+                    fuse(operand);
+                }
+            }
+        };
+        fuse(e);
+        between.insert(e);
+        if (std::any_of(between.begin(), between.end(), [&](expr x) {
+                return options.schedule.stages.find(x) !=
+                       options.schedule.stages.end();
+            }))
+        {
+            continue;
+        }
+
+        between.erase(e);
+        softmaxes.insert({ e, logits });
+        fused.insert(between.begin(), between.end());
+    }
+
+    /* sources of index exprs are read at arbitrary positions and
+     * are stored rather than recomputed for every access. */
+    for (expr e : nodes)
+    {
+        if (e->type == exprtype::index)
+        {
+            indexed.insert(downcast<index>(e)->x);
+        }
+    }
+
+    plan_fusion();
+    for (expr e : nodes)
+    {
+        if (!is_materialized(e) || fused.find(e) != fused.end())
+        {
+            continue;
+        }
+
+        if (e->type == exprtype::var || e->type == exprtype::cnst)
+        {
+            add_global_symbol(e);
+        }
+        else
+        {
+            stages.push_back(e);
+        }
+    }
+
+    /* loop directives and placements other than inlining apply to stages
+     * with code of their own. */
+    for (auto it : options.schedule.stages)
+    {
+        expr e = it.first;
+        std::string id = get_node_id(e);
+        ir_schedule::placement placement = it.second.compute;
+        if (placement == ir_schedule::placement::inlined)
+        {
+            tcc_assert(!is_materialized(e),
+                       id + " is stored and can not be computed inline.");
+        }
+        else if (is_scheduled(e) ||
+                 placement != ir_schedule::placement::automatic)
+        {
+            tcc_assert(std::find(stages.begin(), stages.end(), e) !=
+                               stages.end() &&
+                           !is_alias(e),
+                       id + " is not computed by a stage of its own.");
+        }
+    }
+}
+
+/* plan_fusion decides for every expr that need not be stored whether it is
+ * recomputed by the exprs reading it or materialized, whichever is
+ * estimated to be cheaper. recomputing costs the arithmetic and loads of
+ * the inlined expr for every evaluation by its readers; materializing costs
+ * them once per element, plus storing the buffer and loading it for every
+ * evaluation. as evaluations depend on whether readers are recomputed
+ * themselves, decisions are repeated until they settle. finally, the only
+ * stored reader of a reduction that accumulates in local variables, if it
+ * is elementwise, is computed as the epilogue of the reduction, which
+ * saves storing and loading the reduction. scheduled exprs are placed as
+ * their schedules say and take no part in epilogues. */
+void ir_codegen::plan_fusion()
+{
+    typedef fusion::choice choice;
+    typedef fusion::estimate estimate;
+
+    std::unordered_map<expr, exprs> readers;
+    for (expr e : nodes)
+    {
+        if (fused.find(e) != fused.end())
+        {
+            continue;
+        }
+        for (expr operand : operands(e))
+        {
+            if (!operand->shape.empty())
+            {
+                readers[operand].push_back(e);
+            }
+        }
+        if (!e->shape.empty() && !is_materialized(e))
+        {
+            fusions.insert({ e, { choice::recompute, {}, nullptr } });
+        }
+    }
+
+    /* evaluate returns the cost of computing an element of e inlined. */
+    std::unordered_map<expr, estimate> elements;
+    std::function<estimate(expr)> evaluate = [&](expr e) {
+        if (elements.find(e) != elements.end())
+        {
+            return elements.at(e);
+        }
+
+        estimate element = { choice::recompute, 0, 0 };
+        if (e->type == exprtype::unary)
+        {
+            element.flops = transcendental_flops;
+        }
+        else if (e->type == exprtype::binary || e->type == exprtype::select)
+        {
+            element.flops = 1;
+        }
+        else if (e->type == exprtype::reshape)
+        {
+            /* reshapes other than of unit dimensions divide flattened
+             * indices into the indices of x. */
+            dimensions x_shape = downcast<reshape>(e)->x->shape, e_dims,
+                       x_dims;
+            std::remove_copy(e->shape.begin(),
+                             e->shape.end(),
+                             std::back_inserter(e_dims),
+                             1);
+            std::remove_copy(x_shape.begin(),
+                             x_shape.end(),
+                             std::back_inserter(x_dims),
+                             1);
+            element.flops = e_dims == x_dims ? 0 : 2 * x_shape.size();
+        }
+
+        for (expr operand : operands(e))
+        {
+            if (operand->shape.empty())
+            {
+                continue;
+            }
+            else if (is_materialized(operand))
+            {
+                element.bytes += sizeof(float);
+            }
+            else
+            {
+                estimate x = evaluate(operand);
+                element.flops += x.flops;
+                element.bytes += x.bytes;
+            }
+        }
+        elements.insert({ e, element });
+        return element;
+    };
+
+    /* evaluations counts how often every expr is computed when inlined. */
+    std::unordered_map<expr, double> evaluations;
+    std::function<std::vector<estimate>(expr)> estimate_choices =
+        [&](expr e) {
+            estimate element = evaluate(e);
+            double count = evaluations.at(e), size = e->size();
+            estimate recompute = { choice::recompute,
+                                   count * element.flops,
+                                   count * element.bytes },
+                     materialize = { choice::materialize,
+                                     size * element.flops,
+                                     size * (element.bytes + sizeof(float)) +
+                                         count * sizeof(float) };
+            if (is_alias(e))
+            {
+                materialize = { choice::materialize,
+                                0,
+                                count * sizeof(float) };
+            }
+            return std::vector<estimate>{ recompute, materialize };
+        };
+    std::function<double(estimate)> total = [](estimate choice) {
+        return choice.flops + choice.bytes * fusion_byte_cost;
+    };
+
+    bool settled = false;
+    for (unsigned pass = 0; !settled && pass < nodes.size(); pass++)
+    {
+        evaluations.clear();
+        elements.clear();
+        for (auto it = nodes.rbegin(); it != nodes.rend(); it++)
+        {
+            double count = 0;
+            for (expr reader : readers[*it])
+            {
+                count += reader->type == exprtype::reduce ? (*it)->size()
+                         : is_materialized(reader) ? reader->size()
+                                                   : evaluations.at(reader);
+            }
+            evaluations.insert({ *it, count });
+        }
+
+        settled = true;
+        for (expr e : nodes)
+        {
+            if (fusions.find(e) == fusions.end())
+            {
+                continue;
+            }
+
+            /* scheduled exprs are placed as scheduled. */
+            fusion& f = fusions.at(e);
+            f.estimates = estimate_choices(e);
+            ir_schedule::placement placement = get_placement(e);
+            choice decision =
+                placement == ir_schedule::placement::inlined ? choice::recompute
+                : placement != ir_schedule::placement::automatic ||
+                        is_scheduled(e) ||
+                        total(f.estimates[1]) < total(f.estimates[0])
+                    ? choice::materialize
+                    : choice::recompute;
+            settled = settled && decision == f.decision;
+            f.decision = decision;
+        }
+    }
+
+    for (expr e : nodes)
+    {
+        if (e->type != exprtype::reduce || e->shape.empty() || e == output ||
+            indexed.find(e) != indexed.end() ||
+            fused.find(e) != fused.end() || !is_materialized(e) ||
+            softmaxes.find(e) != softmaxes.end() ||
+            options.schedule.stages.find(e) != options.schedule.stages.end())
+        {
+            continue;
+        }
+
+        reduce_expr r = downcast<reduce>(e);
+        std::vector<loop> loops;
+        std::vector<std::string> indices;
+        for (unsigned i = 0; i < r->x->shape.size(); i++)
+        {
+            indices.push_back("0");
+            if (r->x->shape[i] != 1)
+            {
+                loops.push_back({ add_loop_symbol(),
+                                  0,
+                                  r->x->shape[i],
+                                  r->reduce_dims.find(i) !=
+                                      r->reduce_dims.end(),
+                                  false });
+                indices.back() = loops.back().symbol;
+            }
+        }
+        interchange(r, loops, indices);
+        if (match_gemm(r).a ||
+            get_accumulation(r, loops) == accumulation::memory)
+        {
+            continue;
+        }
+
+        /* the reduction must reach a single stored expr through inlined
+         * elementwise exprs of its shape only. */
+        expr stage = nullptr;
+        bool fusable = true;
+        exprs pending = { e };
+        std::unordered_set<expr> seen;
+        while (!pending.empty() && fusable)
+        {
+            expr x = pending.back();
+            pending.pop_back();
+            for (expr reader : readers[x])
+            {
+                if (!seen.insert(reader).second)
+                {
+                    continue;
+                }
+                else if ((reader->type != exprtype::unary &&
+                          reader->type != exprtype::binary &&
+                          reader->type != exprtype::select) ||
+                         reader->shape != e->shape)
+                {
+                    fusable = false;
+                }
+                else if (is_materialized(reader))
+                {
+                    fusable = fusable && (!stage || stage == reader);
+                    stage = reader;
+                }
+                else
+                {
+                    pending.push_back(reader);
+                }
+            }
+        }
+        if (!fusable || !stage || softmaxes.find(stage) != softmaxes.end() ||
+            std::any_of(softmaxes.begin(),
+                        softmaxes.end(),
+                        [&](std::pair<const expr, expr> softmax) {
+                            return softmax.second == stage;
+                        }) ||
+            (fusions.find(stage) != fusions.end() &&
+             fusions.at(stage).decision == choice::epilogue) ||
+            options.schedule.stages.find(stage) !=
+                options.schedule.stages.end())
+        {
+            continue;
+        }
+
+        /* the epilogue reads the reduction from its accumulators. */
+        std::vector<estimate> estimates = estimate_choices(stage);
+        if (fusions.find(stage) == fusions.end())
+        {
+            estimates.erase(estimates.begin());
+        }
+        estimate epilogue = estimates.back();
+        epilogue.option = choice::epilogue;
+        epilogue.bytes -= evaluations.at(e) * sizeof(float);
+        estimates.push_back(epilogue);
+
+        fusions[stage] = { choice::epilogue, estimates, e };
+        epilogues.insert({ e, stage });
+    }
+}
+
+/* write_fusion_plan writes a line for every expr with the decision of the
+ * fusion planner and its estimates, referring to exprs by their position
+ * in post order and to stored exprs by their symbol. */
+void ir_codegen::write_fusion_plan(const std::string target_name)
+{
+    std::string fusion_path = target_name + "/" + target_name + ".fusion";
+    std::ofstream file(fusion_path, std::ios::trunc);
+    tcc_assert(file, "failed to open file at " + fusion_path + ".");
+
+    std::unordered_map<expr, std::string> ids;
+    for (unsigned i = 0; i < nodes.size(); i++)
+    {
+        ids.insert({ nodes[i], "n" + std::to_string(i) });
+    }
+
+    std::function<std::string(fusion::choice)> to_string =
+        [](fusion::choice option) {
+            switch (option)
+            {
+                case fusion::choice::recompute:
+                    return "recompute";
+                case fusion::choice::materialize:
+                    return "materialize";
+                case fusion::choice::epilogue:
+                    return "epilogue";
+                default:
+                    tcc_error("unknown fusion choice.");
+            }
+        };
+
+    file << std::setprecision(3);
+    for (expr e : nodes)
+    {
+        file << ids.at(e) << " " << tcc::to_string(e->type) << " [";
+        for (unsigned i = 0; i < e->shape.size(); i++)
+        {
+            file << (i ? "," : "") << e->shape[i];
+        }
+        file << "]";
+        for (expr operand : operands(e))
+        {
+            if (ids.find(operand) != ids.end())
+            {
+                file << " " << ids.at(operand);
+            }
+        }
+        file << ": ";
+
+        if (fusions.find(e) != fusions.end())
+        {
+            fusion f = fusions.at(e);
+            file << to_string(f.decision);
+            if (f.reduction)
+            {
+                file << " of " << ids.at(f.reduction);
+            }
+        }
+        else if (fused.find(e) != fused.end())
+        {
+            file << "softmax";
+        }
+        else if (epilogues.find(e) != epilogues.end())
+        {
+            file << "accumulated by " << ids.at(epilogues.at(e));
+        }
+        else
+        {
+            file << (e->type == exprtype::var    ? "input"
+                     : e->type == exprtype::cnst ? "constant"
+                                                 : "materialize");
+        }
+        if (global_symbols.find(e) != global_symbols.end())
+        {
+            file << " as " << global_symbols.at(e);
+        }
+
+        if (fusions.find(e) != fusions.end())
+        {
+            for (fusion::estimate choice : fusions.at(e).estimates)
+            {
+                file << ", " << to_string(choice.option) << " "
+                     << choice.flops << " flops " << choice.bytes << " bytes";
+            }
+        }
+        file << "\n";
+    }
+    file.close();
+}
+
+/* analyze_batch finds the axis of every expr that carries the runtime batch
+ * of the inputs. it is the outermost dimension of the expr, so that strides
+ * of all other dimensions are independent of the batch size. */
+void ir_codegen::analyze_batch()
+{
+    if (options.max_batch <= 0)
+    {
+        return;
+    }
+
+    std::function<int(expr)> get_axis = [&](expr e) {
+        return batch_axes.find(e) == batch_axes.end()
+                   ? -1
+                   : static_cast<int>(batch_axes.at(e));
+    };
+
+    for (expr e : nodes)
+    {
+        int axis = -1;
+        switch (e->type)
+        {
+            case exprtype::var:
+                tcc_assert(e->shape[0] == options.max_batch,
+                           "leading dimension of input is not max batch.");
+                axis = 0;
+                break;
+            case exprtype::cnst:
+                break;
+            case exprtype::index:
+            {
+                index_expr i = downcast<index>(e);
+                int x_axis = get_axis(i->x);
+                if (x_axis >= 0)
+                {
+                    exprs::const_iterator it = std::find(
+                        i->ranges.begin(), i->ranges.end(), i->indices[x_axis]);
+                    tcc_assert(it != i->ranges.end(),
+                               "batch dimension is not indexed by a range.");
+                    axis = it - i->ranges.begin();
+                }
+                break;
+            }
+            case exprtype::reshape:
+            {
+                reshape_expr r = downcast<reshape>(e);
+                if (get_axis(r->x) >= 0)
+                {
+                    axis = 0;
+                    while (axis + 1 < static_cast<int>(r->shape.size()) &&
+                           r->shape[axis] == 1)
+                    {
+                        axis++;
+                    }
+                    tcc_assert(r->shape[axis] % options.max_batch == 0,
+                               "reshape of batch dimension is not supported.");
+                }
+                break;
+            }
+            case exprtype::reduce:
+            {
+                reduce_expr r = downcast<reduce>(e);
+                int x_axis = get_axis(r->x);
+                if (x_axis >= 0 && r->reduce_dims.count(x_axis))
+                {
+                    tcc_assert(r->reduce_type != reduce::type::avg,
+                               "average over batch dimension is not "
+                               "supported.");
+                }
+                else if (x_axis >= 0)
+                {
+                    axis = x_axis;
+                    for (dimension dim : r->reduce_dims)
+                    {
+                        axis -= dim < x_axis ? 1 : 0;
+                    }
+                }
+                break;
+            }
+            default:
+                /* operands of elementwise exprs have the shape of e. */
+                for (expr operand : operands(e))
+                {
+                    int operand_axis = get_axis(operand);
+                    tcc_assert(operand_axis < 0 || axis < 0 ||
+                                   operand_axis == axis,
+                               "batch dimensions of operands do not agree.");
+                    axis = std::max(axis, operand_axis);
+                }
+        }
+
+        if (axis >= 0)
+        {
+            for (int i = 0; i < axis; i++)
+            {
+                tcc_assert(e->shape[i] == 1,
+                           "batch dimension is not the outermost dimension.");
+            }
+            batch_axes.insert({ e, axis });
+        }
+    }
+}
+
+bool ir_codegen::is_batched(expr e, unsigned axis)
+{
+    return batch_axes.find(e) != batch_axes.end() && batch_axes.at(e) == axis;
+}
+
+/* is_stripable returns whether stage e can be computed for a window of
+ * rows: e is a 4d tensor with a single batch and, if it is or has the
+ * epilogue of a reduction, the reduction keeps its leading dimensions and
+ * is either a loop nest or a gemm that multiplies rows of a single
+ * matrix. the loop over rows of scheduled stages must not be split. */
+bool ir_codegen::is_stripable(expr e)
+{
+    if (e->shape.size() != 4 || e->shape[0] != 1 || e->shape[1] == 1 ||
+        is_alias(e) || softmaxes.find(e) != softmaxes.end() ||
+        batch_axes.find(e) != batch_axes.end() ||
+        (is_scheduled(e) && options.schedule.stages.at(e).splits("d1")))
+    {
+        return false;
+    }
+    if (fusions.find(e) != fusions.end() &&
+        fusions.at(e).decision == fusion::choice::epilogue)
+    {
+        e = fusions.at(e).reduction;
+    }
+    if (e->type != exprtype::reduce)
+    {
+        return true;
+    }
+
+    reduce_expr r = downcast<reduce>(e);
+    return r->reduce_dims.find(0) == r->reduce_dims.end() &&
+           r->reduce_dims.find(1) == r->reduce_dims.end() &&
+           (!match_gemm(r).a || match_gemm(r).group_rank == 0);
+}
+
+/* trace_window finds the rows of e that stage reader reads for each of its
+ * rows r, which must be stride * r plus offsets bounded by the extents of
+ * the loops reader reduces, by binding rows of reader to the symbol h,
+ * reduced loops to k<dim> and all other loops to ? while walking through
+ * the exprs inlined into reader. */
+bool ir_codegen::trace_window(expr reader, expr e, window& w)
+{
+    std::unordered_map<std::string, dimension> extents;
+    std::vector<std::string> rows;
+    std::function<void(expr, std::vector<std::string>)> trace =
+        [&](expr t, std::vector<std::string> t_indices) {
+            if (t == e)
+            {
+                rows.push_back(t_indices[1]);
+                return;
+            }
+            else if (t != reader && t->type != exprtype::reshape &&
+                     is_materialized(t))
+            {
+                return;
+            }
+
+            std::function<void(exprs)> bind_ranges = [&](exprs ranges) {
+                for (unsigned i = 0; i < ranges.size(); i++)
+                {
+                    if (ranges[i]->type == exprtype::range)
+                    {
+                        range_symbols[ranges[i]] = t_indices[i];
+                    }
+                }
+            };
+
+            switch (t->type)
+            {
+                case exprtype::index:
+                {
+                    index_expr i = downcast<index>(t);
+                    bind_ranges(i->ranges);
+                    std::vector<std::string> x_indices;
+                    for (expr idx : i->indices)
+                    {
+                        x_indices.push_back(generate(idx, {}));
+                    }
+                    trace(i->x, x_indices);
+                    break;
+                }
+                case exprtype::reduce:
+                {
+                    reduce_expr r = downcast<reduce>(t);
+                    std::vector<std::string> x_indices;
+                    unsigned kept = 0;
+                    for (unsigned dim = 0; dim < r->x->shape.size(); dim++)
+                    {
+                        if (r->reduce_dims.find(dim) != r->reduce_dims.end())
+                        {
+                            x_indices.push_back("k" + std::to_string(dim));
+                            extents.insert(
+                                { x_indices.back(), r->x->shape[dim] });
+                        }
+                        else
+                        {
+                            x_indices.push_back(t_indices[kept++]);
+                        }
+                    }
+                    trace(r->x, x_indices);
+                    break;
+                }
+                case exprtype::reshape:
+                {
+                    /* rows are not traced through reshapes. */
+                    expr x = downcast<reshape>(t)->x;
+                    trace(x, std::vector<std::string>(x->shape.size(), "?"));
+                    break;
+                }
+                case exprtype::select:
+                    bind_ranges(downcast<select>(t)->ranges);
+                    /* fall through */
+                default:
+                    for (expr operand : operands(t))
+                    {
+                        if (!operand->shape.empty())
+                        {
+                            trace(operand, t_indices);
+                        }
+                    }
+            }
+        };
+    trace(reader, { "0", "h", "?", "?" });
+
+    w.stride = 0;
+    for (std::string row : rows)
+    {
+        affine a = get_affine(row);
+        dimension stride = a.terms.count("h") ? a.terms.at("h") : 0;
+        dimension first = a.offset, last = a.offset;
+        for (auto term : a.terms)
+        {
+            if (term.first == "h")
+            {
+                continue;
+            }
+            else if (extents.find(term.first) == extents.end())
+            {
+                return false;
+            }
+            dimension extreme = term.second * (extents.at(term.first) - 1);
+            first += std::min(extreme, dimension(0));
+            last += std::max(extreme, dimension(0));
+        }
+
+        if (stride <= 0 || (w.stride > 0 && stride != w.stride))
+        {
+            return false;
+        }
+        w.first = w.stride > 0 ? std::min(w.first, first) : first;
+        w.last = w.stride > 0 ? std::max(w.last, last) : last;
+        w.stride = stride;
+    }
+    w.reader = reader;
+    return w.stride > 0;
+}
+
+/* plan_chains finds chains when fused tiling is enabled, extending chains
+ * from their last stage towards earlier stages read by a single later stage
+ * of the chain through a window. the stripe height is the largest one for
+ * which the buffered windows fit into the fused tiling size and are smaller
+ * than their tensors, which is then balanced across stripes. stages are
+ * dropped from the front of a chain until such a height exists, and chains
+ * whose intermediates fit into the fused tiling size as a whole are not
+ * tiled. stages scheduled to be computed at a later stage instead form a
+ * chain ending at that stage with the scheduled stripe height, whether
+ * fused tiling is enabled or not. */
+void ir_codegen::plan_chains()
+{
+    std::unordered_set<expr> consumers;
+    for (expr e : stages)
+    {
+        if (get_placement(e) == ir_schedule::placement::at)
+        {
+            consumers.insert(options.schedule.stages.at(e).consumer);
+        }
+    }
+    tcc_assert(consumers.empty() || options.max_batch <= 0,
+               "stages with a runtime batch can not be computed at other "
+               "stages.");
+    if ((options.fused_tiling <= 0 && consumers.empty()) ||
+        options.max_batch > 0)
+    {
+        return;
+    }
+
+    std::unordered_map<expr, std::vector<unsigned>> readers;
+    for (unsigned i = 0; i < stages.size(); i++)
+    {
+        for (expr read : collect_reads(stages[i]))
+        {
+            readers[read].push_back(i);
+        }
+    }
+
+    /* set_rows sizes the windows of stages [begin, end) for stripes of the
+     * given height and returns the arena size of the buffered ones, which
+     * is unbounded if a stripe needs all rows of a buffered window. */
+    std::function<dimension(unsigned, unsigned, dimension)> set_rows =
+        [&](unsigned begin, unsigned end, dimension rows) {
+            std::vector<ir_mem_block> blocks;
+            expr last = stages[end - 1];
+            windows.at(last).rows = rows;
+            for (unsigned i = end - 1; i-- > begin;)
+            {
+                expr e = stages[i];
+                if (windows.find(e) == windows.end())
+                {
+                    continue;
+                }
+                window& w = windows.at(e);
+                w.rows = std::min(
+                    e->shape[1],
+                    w.stride * (windows.at(w.reader).rows - 1) + w.last -
+                        w.first + 1);
+                if (w.rows == e->shape[1] && rows < last->shape[1])
+                {
+                    return std::numeric_limits<dimension>::max();
+                }
+                blocks.push_back({ e,
+                                   e->size() / e->shape[1] * w.rows *
+                                       static_cast<dimension>(sizeof(float)),
+                                   i,
+                                   readers.at(e)[0] });
+            }
+            return ir_mem_planner::apply(blocks, vector_alignment).arena_size;
+        };
+
+    /* get_rows returns the stripe height of stages [begin, end), or 0 if
+     * they are not tiled. */
+    std::function<dimension(unsigned, unsigned)> get_rows =
+        [&](unsigned begin, unsigned end) -> dimension {
+        dimension full_rows = stages[end - 1]->shape[1];
+        if (set_rows(begin, end, full_rows) <= options.fused_tiling)
+        {
+            return 0;
+        }
+        for (dimension rows = full_rows - 1; rows > 0; rows--)
+        {
+            if (set_rows(begin, end, rows) <= options.fused_tiling)
+            {
+                dimension stripes = (full_rows + rows - 1) / rows;
+                return (full_rows + stripes - 1) / stripes;
+            }
+        }
+        return 0;
+    };
+
+    unsigned end = stages.size();
+    while (end > 0)
+    {
+        unsigned begin = end - 1, first = end - 1;
+        expr last = stages[end - 1];
+        if (is_stripable(last))
+        {
+            windows[last] = { {}, 0, 1, 0, 0, nullptr, false };
+            for (unsigned i = end - 1; i-- > 0;)
+            {
+                expr e = stages[i];
+                window w = { {}, 0, 0, 0, 0, nullptr, true };
+                if (is_alias(e) && e != output)
+                {
+                    /* aliases inside a chain emit no code. */
+                    continue;
+                }
+                else if (e == output || !is_stripable(e) ||
+                         consumers.find(e) != consumers.end() ||
+                         (get_placement(e) == ir_schedule::placement::at &&
+                          options.schedule.stages.at(e).consumer != last) ||
+                         readers[e].size() != 1 || readers.at(e)[0] >= end ||
+                         windows.find(stages[readers.at(e)[0]]) ==
+                             windows.end() ||
+                         !trace_window(stages[readers.at(e)[0]], e, w))
+                {
+                    break;
+                }
+                windows[e] = w;
+                begin = i;
+            }
+            first = begin;
+        }
+
+        /* the earliest stage computed at the last stage begins the chain. */
+        dimension rows = 0;
+        for (unsigned i = end - 1; i-- > first;)
+        {
+            if (windows.find(stages[i]) != windows.end() &&
+                get_placement(stages[i]) == ir_schedule::placement::at)
+            {
+                dimension stage_rows = std::min(
+                    options.schedule.stages.at(stages[i]).rows, last->shape[1]);
+                tcc_assert(rows == 0 || rows == stage_rows,
+                           "stages computed at " + get_node_id(last) +
+                               " have different stripe heights.");
+                rows = stage_rows;
+                begin = i;
+            }
+        }
+        while (rows == 0 && options.fused_tiling > 0 && begin + 1 < end &&
+               (rows = get_rows(begin, end)) == 0)
+        {
+            do
+            {
+                begin++;
+            } while (windows.find(stages[begin]) == windows.end());
+        }
+
+        /* stages dropped from the chain have no windows. */
+        for (unsigned i = first; i < (rows > 0 ? begin : end); i++)
+        {
+            windows.erase(stages[i]);
+        }
+        if (rows > 0)
+        {
+            set_rows(begin, end, rows);
+            chains.insert(chains.begin(), { begin, end, rows });
+            end = begin;
+        }
+        else
+        {
+            end--;
+        }
+    }
+
+    for (unsigned i = 0; i < stages.size(); i++)
+    {
+        if (get_placement(stages[i]) != ir_schedule::placement::at)
+        {
+            continue;
+        }
+        expr consumer = options.schedule.stages.at(stages[i]).consumer;
+        tcc_assert(std::any_of(chains.begin(),
+                               chains.end(),
+                               [&](chain c) {
+                                   return c.begin <= i && i < c.end &&
+                                          stages[c.end - 1] == consumer;
+                               }),
+                   get_node_id(stages[i]) + " can not be computed at " +
+                       get_node_id(consumer) + ".");
+    }
+}
+
+/* plan_memory places the buffers of stages into the arena. a buffer is live
+ * from the stage computing it through the last stage reading it; inputs,
+ * constants, scalars and the output are not placed. buffers with a runtime
+ * batch are planned separately with their size for a single batch. */
+void ir_codegen::plan_memory()
+{
+    std::unordered_map<expr, unsigned> buffer_ids;
+    for (unsigned i = 0; i < stages.size(); i++)
+    {
+        for (expr read : collect_reads(stages[i]))
+        {
+            if (buffer_ids.find(read) != buffer_ids.end())
+            {
+                buffers[buffer_ids.at(read)].last = i;
+            }
+        }
+
+        expr e = stages[i];
+        if (e != output && !e->shape.empty() && !is_alias(e))
+        {
+            dimension size = e->size() * static_cast<dimension>(sizeof(float));
+            if (batch_axes.find(e) != batch_axes.end())
+            {
+                size /= options.max_batch;
+            }
+            if (windows.find(e) != windows.end() && windows.at(e).buffered)
+            {
+                size = size / e->shape[1] * windows.at(e).rows;
+            }
+            buffer_ids.insert({ e, buffers.size() });
+            buffers.push_back({ e, size, i, i });
+        }
+    }
+
+    /* lifetimes are final once all stages are visited. as stripes repeat
+     * the stages of a chain, the buffered windows of a chain are placed
+     * into a block of their own that is live throughout the chain, like all
+     * buffers the chain reads. */
+    std::vector<ir_mem_block> unbatched_buffers, batched_buffers;
+    std::vector<ir_mem_planner_result> chain_plans;
+    for (chain c : chains)
+    {
+        std::vector<ir_mem_block> chain_buffers;
+        for (ir_mem_block buffer : buffers)
+        {
+            if (windows.find(buffer.e) != windows.end() &&
+                windows.at(buffer.e).buffered && buffer.first >= c.begin &&
+                buffer.first < c.end)
+            {
+                chain_buffers.push_back(buffer);
+            }
+        }
+        chain_plans.push_back(
+            ir_mem_planner::apply(chain_buffers, vector_alignment));
+        unbatched_buffers.push_back({ stages[c.begin],
+                                      chain_plans.back().arena_size,
+                                      c.begin,
+                                      c.end - 1 });
+    }
+    for (ir_mem_block buffer : buffers)
+    {
+        if (windows.find(buffer.e) != windows.end() &&
+            windows.at(buffer.e).buffered)
+        {
+            continue;
+        }
+        for (chain c : chains)
+        {
+            if (buffer.first < c.begin && buffer.last >= c.begin)
+            {
+                buffer.last = std::max(buffer.last, c.end - 1);
+            }
+        }
+        (batch_axes.find(buffer.e) == batch_axes.end() ? unbatched_buffers
+                                                       : batched_buffers)
+            .push_back(buffer);
+    }
+
+    mem_plan = ir_mem_planner::apply(unbatched_buffers, vector_alignment);
+    batched_mem_plan = ir_mem_planner::apply(batched_buffers, vector_alignment);
+    for (unsigned i = 0; i < chains.size(); i++)
+    {
+        dimension base = mem_plan.offsets.at(stages[chains[i].begin]);
+        for (auto offset : chain_plans[i].offsets)
+        {
+            mem_plan.offsets[offset.first] = base + offset.second;
+        }
+    }
+}
+
+bool ir_codegen::is_materialized(expr e)
+{
+    return e->type == exprtype::var ||
+           (e->type == exprtype::cnst && !e->shape.empty()) ||
+           (e->type == exprtype::reduce &&
+            epilogues.find(e) == epilogues.end()) ||
+           e == output ||
+           (fusions.find(e) != fusions.end() &&
+            fusions.at(e).decision != fusion::choice::recompute) ||
+           indexed.find(e) != indexed.end() ||
+           softmaxes.find(e) != softmaxes.end() ||
+           std::any_of(softmaxes.begin(),
+                       softmaxes.end(),
+                       [&](std::pair<const expr, expr> softmax) {
+                           return softmax.second == e;
+                       });
+}
+
+/* reshapes of stored exprs other than the output alias their input. */
+bool ir_codegen::is_alias(expr e)
+{
+    return e->type == exprtype::reshape && e != output &&
+           is_materialized(downcast<reshape>(e)->x);
+}
+
+/* is_scheduled returns whether the loops of e have directives. */
+bool ir_codegen::is_scheduled(expr e)
+{
+    return options.schedule.stages.find(e) != options.schedule.stages.end() &&
+           !options.schedule.stages.at(e).directives.empty();
+}
+
+ir_schedule::placement ir_codegen::get_placement(expr e)
+{
+    return options.schedule.stages.find(e) == options.schedule.stages.end()
+               ? ir_schedule::placement::automatic
+               : options.schedule.stages.at(e).compute;
+}
+
+/* get_node_id returns the id of e in the fusion plan and in schedules. */
+std::string ir_codegen::get_node_id(expr e)
+{
+    unsigned id = std::find(nodes.begin(), nodes.end(), e) - nodes.begin();
+    tcc_assert(id < nodes.size(), "scheduled expr is not part of the ir.");
+    return "n" + std::to_string(id);
+}
+
+/* collect_reads returns the stored exprs read by the stage computing e,
+ * looking through inlined exprs and reshapes aliasing their input. */
+exprs ir_codegen::collect_reads(expr e)
+{
+    exprs reads;
+    std::unordered_set<expr> seen;
+    std::function<void(expr)> collect = [&](expr x) {
+        for (expr operand : operands(x))
+        {
+            if (seen.count(operand))
+            {
+                continue;
+            }
+            seen.insert(operand);
+
+            if (!is_materialized(operand))
+            {
+                collect(operand);
+                continue;
+            }
+
+            while (operand->type == exprtype::reshape &&
+                   is_materialized(downcast<reshape>(operand)->x))
+            {
+                operand = downcast<reshape>(operand)->x;
+            }
+            if (std::find(reads.begin(), reads.end(), operand) == reads.end())
+            {
+                reads.push_back(operand);
+            }
+        }
+    };
+
+    if (softmaxes.find(e) != softmaxes.end())
+    {
+        /* softmaxes only read their logits. */
+        seen.insert(fused.begin(), fused.end());
+        seen.erase(softmaxes.at(e));
+    }
+    collect(e);
+    return reads;
+}
+
+std::string ir_codegen::add_global_symbol(expr e)
+{
+    tcc_assert_no_key(global_symbols, e);
+
+    std::string symbol = "v" + std::to_string(vcount++);
+    global_symbols.insert({ e, symbol });
+    return symbol;
+}
+
+std::string ir_codegen::add_loop_symbol()
+{
+    return "i" + std::to_string(icount++);
+}
+
+/* to_affine rewrites the integer expr e into an affine of the values its
+ * ranges are bound to; it fails unless e only adds, subtracts and scales
+ * ranges by constants. */
+bool ir_codegen::to_affine(expr e, affine& a)
+{
+    if (e->type == exprtype::cnst && e->shape.empty() &&
+        e->dtype == datatype::INT64)
+    {
+        a = affine();
+        a.offset = downcast<cnst>(e)->to_scalar<int64_t>();
+        return true;
+    }
+    else if (e->type == exprtype::range &&
+             range_symbols.find(e) != range_symbols.end())
+    {
+        a = get_affine(range_symbols.at(e));
+        return true;
+    }
+    else if (e->type != exprtype::binary)
+    {
+        return false;
+    }
+
+    binary_expr b = downcast<binary>(e);
+    affine x_affine, y_affine;
+    if (!to_affine(b->x, x_affine) || !to_affine(b->y, y_affine))
+    {
+        return false;
+    }
+
+    dimension sign = b->binary_type == binary::type::sub ? -1 : 1;
+    switch (b->binary_type)
+    {
+        case binary::type::add:
+        case binary::type::sub:
+            a = x_affine;
+            for (auto term : y_affine.terms)
+            {
+                a.terms[term.first] += sign * term.second;
+            }
+            a.offset += sign * y_affine.offset;
+            break;
+        case binary::type::mul:
+            if (!x_affine.terms.empty() && !y_affine.terms.empty())
+            {
+                return false;
+            }
+            a = x_affine.terms.empty() ? y_affine : x_affine;
+            for (auto& term : a.terms)
+            {
+                term.second *= (x_affine.terms.empty() ? x_affine.offset
+                                                       : y_affine.offset);
+            }
+            a.offset = x_affine.offset * y_affine.offset;
+            break;
+        default:
+            return false;
+    }
+
+    for (auto it = a.terms.begin(); it != a.terms.end();)
+    {
+        it = it->second == 0 ? a.terms.erase(it) : std::next(it);
+    }
+    return true;
+}
+
+/* get_affine returns the affine of a generated integer c expression, which
+ * is either a literal, an affine generated before or a single term. */
+ir_codegen::affine ir_codegen::get_affine(std::string symbol)
+{
+    affine a;
+    if (affines.find(symbol) != affines.end())
+    {
+        a = affines.at(symbol);
+    }
+    else if (!symbol.empty() &&
+             symbol.find_first_not_of("0123456789", symbol[0] == '-') ==
+                 std::string::npos &&
+             std::isdigit(symbol.back()))
+    {
+        a.offset = std::stoll(symbol);
+    }
+    else
+    {
+        a.terms[symbol] = 1;
+    }
+    return a;
+}
+
+/* get_flattened_index returns the affine of the row major offset of the
+ * element at indices of a tensor of the given shape. */
+ir_codegen::affine ir_codegen::get_flattened_index(
+    std::vector<std::string> indices, dimensions shape)
+{
+    tcc_assert(indices.size() == shape.size(),
+               "size of indices does not equal to size of shape.");
+
+    affine flattened_index;
+    dimension index_multiplier = 1;
+    for (int i = shape.size() - 1; i >= 0; i--)
+    {
+        affine index = get_affine(indices[i]);
+        for (auto term : index.terms)
+        {
+            flattened_index.terms[term.first] +=
+                term.second * index_multiplier;
+        }
+        flattened_index.offset += index.offset * index_multiplier;
+        index_multiplier *= shape[i];
+    }
+    return flattened_index;
+}
+
+/* get_address returns the affine of the offset of the element at indices
+ * in the buffer of the stored expr e, where buffered windows of chains hold
+ * only their rows. */
+ir_codegen::affine ir_codegen::get_address(expr e,
+                                           std::vector<std::string> indices)
+{
+    if (windows.find(e) == windows.end() || !windows.at(e).buffered)
+    {
+        return get_flattened_index(indices, e->shape);
+    }
+
+    window w = windows.at(e);
+    affine row = get_affine(indices[1]);
+    row.terms[w.origin] -= 1;
+    if (row.terms[w.origin] == 0)
+    {
+        row.terms.erase(w.origin);
+    }
+    indices[1] = generate(row);
+    if (!is_operand(indices[1]))
+    {
+        indices[1] = "(" + indices[1] + ")";
+        affines.insert({ indices[1], row });
+    }
+
+    dimensions shape = e->shape;
+    shape[1] = w.rows;
+    return get_flattened_index(indices, shape);
+}
+
+std::string ir_codegen::get_indices(std::vector<std::string> indices,
+                                    dimensions shape)
+{
+    return generate(get_flattened_index(indices, shape));
+}
+
+std::string ir_codegen::get_symbol(expr e, std::vector<std::string> indices)
+{
+    tcc_assert_has_key(global_symbols, e);
+    return e->shape.empty()
+               ? global_symbols.at(e)
+               : (global_symbols.at(e) + "[" +
+                  generate(get_address(e, indices)) + "]");
+}
+
+/* generate returns the c expression computing element indices of e, or
+ * its local symbol if it has one. integer exprs that are affine in loop
+ * indices are generated with their constant terms folded. while
+ * hoisted_loop is set, the parts of addresses of stored exprs that do not
+ * depend on it are added to invariants. */
+std::string ir_codegen::generate(expr e, std::vector<std::string> indices)
+{
+    if (local_symbols.find(e) != local_symbols.end())
+    {
+        return local_symbols.at(e);
+    }
+    else if (global_symbols.find(e) != global_symbols.end())
+    {
+        if (hoisted_loop.empty() || e->shape.empty())
+        {
+            return get_symbol(e, indices);
+        }
+
+        affine address = get_address(e, indices), invariant;
+        for (auto it = address.terms.begin(); it != address.terms.end();)
+        {
+            if (it->first != hoisted_loop && is_identifier(it->first))
+            {
+                invariant.terms.insert(*it);
+                it = address.terms.erase(it);
+            }
+            else
+            {
+                it++;
+            }
+        }
+        invariant.offset = address.offset;
+        if (invariant.terms.empty() ||
+            (invariant.terms.size() == 1 && invariant.offset == 0 &&
+             invariant.terms.begin()->second == 1))
+        {
+            return get_symbol(e, indices);
+        }
+        address.offset = 0;
+
+        std::string value = generate(invariant), invariant_symbol;
+        for (auto i : invariants)
+        {
+            invariant_symbol = i.second == value ? i.first : invariant_symbol;
+        }
+        if (invariant_symbol.empty())
+        {
+            invariant_symbol = add_loop_symbol();
+            invariants.push_back({ invariant_symbol, value });
+        }
+        address.terms[invariant_symbol] = 1;
+        return global_symbols.at(e) + "[" + generate(address) + "]";
+    }
+
+    if (e->type == exprtype::binary && e->dtype == datatype::INT64)
+    {
+        affine a;
+        if (to_affine(e, a))
+        {
+            std::string symbol = generate(a);
+            if (!is_operand(symbol))
+            {
+                symbol = "(" + symbol + ")";
+                affines.insert({ symbol, a });
+            }
+            return symbol;
+        }
+    }
+
+    std::function<std::vector<std::string>(expr)> operand_indices =
+        [&](expr x) {
+            return x->shape.empty() ? std::vector<std::string>() : indices;
+        };
+
+    std::function<void(exprs)> bind_ranges = [&](exprs ranges) {
+        tcc_assert_size_eq(ranges, indices.size());
+        for (unsigned i = 0; i < ranges.size(); i++)
+        {
+            if (ranges[i]->type == exprtype::range)
+            {
+                range_symbols[ranges[i]] = indices[i];
+            }
+        }
+    };
+
+    switch (e->type)
+    {
+        case exprtype::cnst:
+        {
+            cnst_expr c = downcast<cnst>(e);
+            tcc_assert(c->shape.empty(), "cnst tensor is not stored.");
+            switch (c->dtype)
+            {
+                case datatype::FP32:
+                    return to_literal(c->to_scalar<float>());
+                case datatype::INT64:
+                    return std::to_string(c->to_scalar<int64_t>());
+                default:
+                    tcc_error("unsupported dtype.");
+            }
+        }
+        case exprtype::range:
+            tcc_assert_has_key(range_symbols, e);
+            return range_symbols.at(e);
+        case exprtype::index:
+        {
+            index_expr i = downcast<index>(e);
+            bind_ranges(i->ranges);
+
+            std::vector<std::string> x_indices;
+            for (expr idx : i->indices)
+            {
+                x_indices.push_back(generate(idx, {}));
+            }
+            return generate(i->x, x_indices);
+        }
+        case exprtype::select:
+        {
+            select_expr s = downcast<select>(e);
+            bind_ranges(s->ranges);
+            if (interior && peeled_selects.find(e) != peeled_selects.end())
+            {
+                return generate(s->t, operand_indices(s->t));
+            }
+            return "(" + generate(s->cond, operand_indices(s->cond)) + "?" +
+                   generate(s->t, operand_indices(s->t)) + ":" +
+                   generate(s->f, operand_indices(s->f)) + ")";
+        }
+        case exprtype::reshape:
+        {
+            reshape_expr r = downcast<reshape>(e);
+
+            /* reshapes that only add or remove unit dimensions map indices
+             * one to one; others go through the flattened index. */
+            dimensions e_dims, x_dims;
+            std::vector<std::string> e_indices;
+            for (unsigned i = 0; i < r->shape.size(); i++)
+            {
+                if (r->shape[i] != 1)
+                {
+                    e_dims.push_back(r->shape[i]);
+                    e_indices.push_back(indices[i]);
+                }
+            }
+            std::remove_copy(r->x->shape.begin(),
+                             r->x->shape.end(),
+                             std::back_inserter(x_dims),
+                             1);
+
+            std::vector<std::string> x_indices;
+            std::string flattened_index = get_indices(indices, r->shape);
+            dimension index_multiplier = r->x->size();
+            unsigned matched_dims = 0;
+            for (dimension dim : r->x->shape)
+            {
+                index_multiplier /= dim;
+                if (dim == 1)
+                {
+                    x_indices.push_back("0");
+                }
+                else if (e_dims == x_dims)
+                {
+                    x_indices.push_back(e_indices[matched_dims++]);
+                }
+                else
+                {
+                    x_indices.push_back("(((" + flattened_index + ")/" +
+                                        std::to_string(index_multiplier) +
+                                        ")%" + std::to_string(dim) + ")");
+                }
+            }
+            return generate(r->x, x_indices);
+        }
+        case exprtype::unary:
+        {
+            unary_expr u = downcast<unary>(e);
+            return generate_unary(u->unary_type, generate(u->x, indices));
+        }
+        case exprtype::binary:
+        {
+            binary_expr b = downcast<binary>(e);
+            std::string expr_symbol = ([&]() {
+                switch (b->binary_type)
+                {
+                    case binary::type::add:
+                        return "+";
+                    case binary::type::sub:
+                        return "-";
+                    case binary::type::mul:
+                        return "*";
+                    case binary::type::div:
+                        return "/";
+                    case binary::type::mod:
+                        return "%";
+                    case binary::type::logical_and:
+                        return "&&";
+                    case binary::type::greater:
+                        return ">";
+                    case binary::type::greater_eq:
+                        return ">=";
+                    case binary::type::less:
+                        return "<";
+                    default:
+                        tcc_error("unknown binary type.");
+                }
+            }());
+
+            return "(" + generate(b->x, operand_indices(b->x)) + expr_symbol +
+                   generate(b->y, operand_indices(b->y)) + ")";
+        }
+        default:
+            tcc_error(to_string(e->type) + " expr is not stored.");
+    }
+}
+
+/* generate returns the c expression of affine a. */
+std::string ir_codegen::generate(affine a)
+{
+    std::string symbol;
+    for (auto term : a.terms)
+    {
+        if (term.second == 0)
+        {
+            continue;
+        }
+
+        dimension coefficient = std::abs(term.second);
+        symbol += term.second < 0 ? "-" : (symbol.empty() ? "" : "+");
+        symbol += is_operand(term.first) ? term.first : "(" + term.first + ")";
+        symbol += coefficient == 1 ? "" : "*" + std::to_string(coefficient);
+    }
+    if (a.offset != 0 || symbol.empty())
+    {
+        symbol += (a.offset < 0 || symbol.empty() ? "" : "+") +
+                  std::to_string(a.offset);
+    }
+    return symbol;
+}
+
+/* generate_unary returns the c expression applying unary type t to x with
+ * the implementation selected by options.math. */
+std::string ir_codegen::generate_unary(unary::type t, std::string x)
+{
+    bool fast = options.math == ir_codegen_options::precision::fast;
+    switch (t)
+    {
+        case unary::type::exp:
+            return (fast ? "tcc_expf(" : "expf(") + x + ")";
+        case unary::type::sigmoid:
+            return fast ? "tcc_sigmoidf(" + x + ")"
+                        : "(1.f/(1.f+expf(-(" + x + "))))";
+        case unary::type::tanh:
+            return (fast ? "tcc_tanhf(" : "tanhf(") + x + ")";
+        default:
+            tcc_error("unknown unary type.");
+    }
+}
+
+/* generate_hoisted generates e inside the loop with symbol loop_symbol and
+ * returns in declarations the statements computing the loop invariant parts
+ * of its addresses, which precede that loop. */
+std::string ir_codegen::generate_hoisted(
+    expr e,
+    std::vector<std::string> indices,
+    std::string loop_symbol,
+    std::vector<std::string>& declarations)
+{
+    hoisted_loop = loop_symbol;
+    std::string symbol = generate(e, indices);
+    for (auto i : invariants)
+    {
+        declarations.push_back("const int " + i.first + "=" + i.second + ";");
+    }
+    hoisted_loop.clear();
+    invariants.clear();
+    return symbol;
+}
+
+std::string ir_codegen::newline(int indent)
+{
+    tcc_assert(!(indent < 0 && indent_offset.empty()),
+               "can not unindent while indent offset is zero.");
+
+    if (indent != 0)
+        indent_offset = indent > 0
+                            ? indent_offset + "    "
+                            : indent_offset.substr(0, indent_offset.size() - 4);
+    return "\n" + indent_offset;
+}
+
+/* open_loops opens the given loops; when parallelization is enabled, the
+ * leading loops are shared across threads as a single worksharing loop and
+ * when vectorization is enabled, the innermost loop is a simd loop. loops
+ * must not be reduced unless a reduction clause is given. inner is the
+ * number of iterations of loops opened inside them, if any, in which case
+ * no loop is a simd loop. declarations precede the innermost loop unless it
+ * is part of the worksharing loop. loops of scheduled stages are instead
+ * parallelized, vectorized with the reduction clause and unrolled as
+ * scheduled. */
+void ir_codegen::open_loops(std::vector<loop> loops,
+                            std::string reduction,
+                            dimension inner,
+                            std::vector<std::string> declarations)
+{
+    bool scheduled =
+        !loops.empty() &&
+        scheduled_loops.find(loops[0].symbol) != scheduled_loops.end();
+    dimension work = std::max(inner, dimension(1)), iters = 1;
+    unsigned collapsed = 0;
+    for (loop l : loops)
+    {
+        work *= l.bound - l.begin;
+    }
+    for (loop l : loops)
+    {
+        if (iters >= parallel_min_iters || (l.reduced && reduction.empty()))
+        {
+            break;
+        }
+        iters *= l.bound - l.begin;
+        collapsed++;
+    }
+
+    bool parallel = !scheduled && options.parallelize && collapsed > 0 &&
+                    work >= parallel_min_work;
+    bool simd = !scheduled && options.vectorize && !loops.empty() &&
+                inner == 0 && (!loops.back().reduced || !reduction.empty());
+
+    if (parallel)
+    {
+        body << "#pragma omp parallel for"
+             << (simd && collapsed == loops.size() ? " simd" : "")
+             << (collapsed > 1 ? " collapse(" + std::to_string(collapsed) + ")"
+                               : "")
+             << (options.threads > 0
+                     ? " num_threads(" + std::to_string(options.threads) + ")"
+                     : "")
+             << reduction << newline();
+    }
+
+    bool hoisted = !(parallel && collapsed == loops.size());
+    for (unsigned i = 0; i < loops.size(); i++)
+    {
+        if (hoisted && i == loops.size() - 1)
+        {
+            for (std::string declaration : declarations)
+            {
+                body << declaration << newline();
+            }
+        }
+        if (simd && hoisted && i == loops.size() - 1)
+        {
+            body << "#pragma omp simd" << reduction << newline();
+        }
+        if (scheduled)
+        {
+            scheduled_loop directive = scheduled_loops.at(loops[i].symbol);
+            if (directive.parallel || directive.vectorized)
+            {
+                body << "#pragma omp"
+                     << (directive.parallel ? " parallel for" : "")
+                     << (directive.vectorized ? " simd" : "")
+                     << (directive.parallel && options.threads > 0
+                             ? " num_threads(" +
+                                   std::to_string(options.threads) + ")"
+                             : "")
+                     << (directive.vectorized ? reduction : "") << newline();
+            }
+            else if (directive.unroll > 0)
+            {
+                body << "#pragma GCC unroll " << directive.unroll << newline();
+            }
+        }
+
+        /* batched loops scale with the runtime batch size. */
+        std::string bound = std::to_string(loops[i].bound);
+        if (loops[i].batched)
+        {
+            dimension factor = loops[i].bound / options.max_batch;
+            bound = factor == 1 ? "batch" : "batch*" + std::to_string(factor);
+        }
+
+        body << "for (int " << loops[i].symbol << "=" << loops[i].begin << ";"
+             << loops[i].symbol
+             << "<" << bound << ";" << loops[i].symbol << "++) {"
+             << newline(1);
+    }
+    if (!hoisted || loops.empty())
+    {
+        for (std::string declaration : declarations)
+        {
+            body << declaration << newline();
+        }
+    }
+}
+
+/* peel splits the loops computing x into regions such that the conditions
+ * of selects inlined into x hold everywhere in the interior region, where
+ * only their true branches are evaluated. conditions must be conjunctions
+ * of comparisons between affine functions of loop indices; the bounds of
+ * the interior region are derived for unreduced loops, taking the extremes
+ * of all other loops. ranges are bound to loop indices by generating x. */
+std::vector<ir_codegen::region> ir_codegen::peel(
+    std::vector<loop> loops, expr x, std::vector<std::string> indices)
+{
+    /* selects peeled for earlier stages may not hold in the interior of
+     * this one. */
+    peeled_selects.clear();
+    generate(x, indices);
+
+    std::unordered_map<std::string, unsigned> loop_ids;
+    for (unsigned i = 0; i < loops.size(); i++)
+    {
+        loop_ids.insert({ loops[i].symbol, i });
+    }
+
+    /* peeled conditions must only depend on the given loops and origins
+     * of windows. */
+    std::function<bool(expr, affine&)> to_loop_affine = [&](expr e,
+                                                            affine& a) {
+        return to_affine(e, a) &&
+               std::all_of(a.terms.begin(),
+                           a.terms.end(),
+                           [&](std::pair<const std::string, dimension> t) {
+                               return loop_ids.find(t.first) !=
+                                          loop_ids.end() ||
+                                      origins.find(t.first) != origins.end();
+                           });
+    };
+
+    /* to_constraints rewrites a condition into affines that are all
+     * non-negative exactly when the condition holds. */
+    std::function<bool(expr, std::vector<affine>&)> to_constraints =
+        [&](expr cond, std::vector<affine>& constraints) {
+            if (cond->type != exprtype::binary)
+            {
+                return false;
+            }
+
+            binary_expr b = downcast<binary>(cond);
+            if (b->binary_type == binary::type::logical_and)
+            {
+                return to_constraints(b->x, constraints) &&
+                       to_constraints(b->y, constraints);
+            }
+
+            affine lhs, rhs;
+            if (!to_loop_affine(b->x, lhs) || !to_loop_affine(b->y, rhs))
+            {
+                return false;
+            }
+            switch (b->binary_type)
+            {
+                case binary::type::greater:
+                    lhs.offset -= 1;
+                    break;
+                case binary::type::greater_eq:
+                    break;
+                case binary::type::less:
+                    std::swap(lhs, rhs);
+                    lhs.offset -= 1;
+                    break;
+                default:
+                    return false;
+            }
+            for (auto term : rhs.terms)
+            {
+                lhs.terms[term.first] -= term.second;
+            }
+            lhs.offset -= rhs.offset;
+            constraints.push_back(lhs);
+            return true;
+        };
+
+    /* collect selects inlined into x. */
+    exprs selects;
+    std::unordered_set<expr> seen;
+    std::function<void(expr)> collect_selects = [&](expr e) {
+        for (expr operand : operands(e))
+        {
+            if (seen.find(operand) == seen.end() && !is_materialized(operand))
+            {
+                seen.insert(operand);
+                collect_selects(operand);
+            }
+        }
+        if (e->type == exprtype::select)
+        {
+            selects.push_back(e);
+        }
+    };
+    if (global_symbols.find(x) == global_symbols.end())
+    {
+        collect_selects(x);
+    }
+
+    std::vector<dimension> lower, upper;
+    for (loop l : loops)
+    {
+        lower.push_back(l.begin);
+        upper.push_back(l.bound);
+    }
+
+    for (expr s : selects)
+    {
+        std::vector<affine> constraints;
+        if (!to_constraints(downcast<select>(s)->cond, constraints))
+        {
+            continue;
+        }
+
+        std::vector<dimension> s_lower = lower, s_upper = upper;
+        bool peelable = true;
+        for (affine constraint : constraints)
+        {
+            /* peeled loops must be unreduced with static bounds; the
+             * others and origins take the values minimizing the
+             * constraint. */
+            int peeled_loop = -1;
+            dimension coefficient = 0, offset = constraint.offset;
+            for (auto term : constraint.terms)
+            {
+                if (origins.find(term.first) != origins.end())
+                {
+                    offset += std::min(term.second * origins.at(term.first),
+                                       dimension(0));
+                    continue;
+                }
+
+                unsigned id = loop_ids.at(term.first);
+                loop l = loops[id];
+                if (term.second == 0)
+                {
+                    continue;
+                }
+                else if (!l.reduced && !l.batched && peeled_loop < 0)
+                {
+                    peeled_loop = id;
+                    coefficient = term.second;
+                }
+                else if (!l.reduced && !l.batched)
+                {
+                    peelable = false;
+                }
+                else
+                {
+                    offset += term.second *
+                              (term.second > 0 ? l.begin : l.bound - 1);
+                }
+            }
+
+            /* coefficient * index + offset >= 0 */
+            if (peeled_loop < 0)
+            {
+                peelable &= offset >= 0;
+            }
+            else if (coefficient > 0)
+            {
+                s_lower[peeled_loop] =
+                    std::max(s_lower[peeled_loop],
+                             -floor_div(offset, coefficient));
+            }
+            else
+            {
+                s_upper[peeled_loop] =
+                    std::min(s_upper[peeled_loop],
+                             floor_div(offset, -coefficient) + 1);
+            }
+        }
+
+        if (peelable)
+        {
+            peeled_selects.insert(s);
+            lower = s_lower;
+            upper = s_upper;
+        }
+    }
+
+    /* the interior region is surrounded by border regions, each of which
+     * spans the interior along loops before the split loop. */
+    std::vector<region> regions;
+    std::vector<loop> interior_loops = loops;
+    for (unsigned i = 0; i < loops.size(); i++)
+    {
+        if (lower[i] >= upper[i])
+        {
+            return { { loops, false } };
+        }
+    }
+    for (unsigned i = 0; i < loops.size(); i++)
+    {
+        if (lower[i] > loops[i].begin)
+        {
+            regions.push_back({ interior_loops, false });
+            regions.back().loops[i].bound = lower[i];
+        }
+        if (upper[i] < loops[i].bound)
+        {
+            regions.push_back({ interior_loops, false });
+            regions.back().loops[i].begin = upper[i];
+        }
+        interior_loops[i].begin = lower[i];
+        interior_loops[i].bound = upper[i];
+    }
+    regions.push_back({ interior_loops, true });
+
+    return regions;
+}
+
+void ir_codegen::close_loops(std::vector<loop> loops)
+{
+    for (unsigned i = 0; i < loops.size(); i++)
+    {
+        body << newline(-1) << "}";
+    }
+    body << newline();
+}
+
+/* apply_schedule transforms the loops of the scheduled stage computing e,
+ * where indices[i] is the index of dimension d<i> of its iteration space,
+ * by the directives of its schedule and rewrites indices as affines of the
+ * resulting loops. */
+void ir_codegen::apply_schedule(expr e,
+                                std::vector<loop>& loops,
+                                std::vector<std::string>& indices)
+{
+    if (!is_scheduled(e))
+    {
+        return;
+    }
+
+    std::string id = get_node_id(e);
+    std::vector<std::string> names;
+    std::vector<affine> dims;
+    for (loop l : loops)
+    {
+        unsigned dim =
+            std::find(indices.begin(), indices.end(), l.symbol) -
+            indices.begin();
+        names.push_back("d" + std::to_string(dim));
+    }
+    for (std::string index : indices)
+    {
+        dims.push_back(get_affine(index));
+    }
+
+    std::function<unsigned(std::string)> find_loop = [&](std::string name) {
+        unsigned i = std::find(names.begin(), names.end(), name) -
+                     names.begin();
+        tcc_assert(i < names.size(), id + " has no loop " + name + ".");
+        return i;
+    };
+
+    std::unordered_map<std::string, scheduled_loop> directives;
+    for (ir_schedule::directive d : options.schedule.stages.at(e).directives)
+    {
+        switch (d.directive_type)
+        {
+            case ir_schedule::directive::type::split:
+            {
+                unsigned i = find_loop(d.loops[0]);
+                loop l = loops[i];
+                tcc_assert(!l.batched,
+                           id + " can not split batched loop " + d.loops[0] +
+                               ".");
+                tcc_assert((l.bound - l.begin) % d.factor == 0,
+                           id + " can not split loop " + d.loops[0] +
+                               " of " + std::to_string(l.bound - l.begin) +
+                               " iterations by " + std::to_string(d.factor) +
+                               ".");
+                tcc_assert(d.loops[1] != d.loops[2] &&
+                               std::count(names.begin(),
+                                          names.end(),
+                                          d.loops[1]) == 0 &&
+                               std::count(names.begin(),
+                                          names.end(),
+                                          d.loops[2]) == 0,
+                           id + " already has a loop named " + d.loops[1] +
+                               " or " + d.loops[2] + ".");
+
+                loop outer = { add_loop_symbol(),
+                               0,
+                               (l.bound - l.begin) / d.factor,
+                               l.reduced,
+                               false },
+                     inner = {
+                         add_loop_symbol(), 0, d.factor, l.reduced, false
+                     };
+                for (affine& dim : dims)
+                {
+                    if (dim.terms.find(l.symbol) == dim.terms.end())
+                    {
+                        continue;
+                    }
+                    dimension coefficient = dim.terms.at(l.symbol);
+                    dim.terms.erase(l.symbol);
+                    dim.terms[outer.symbol] = coefficient * d.factor;
+                    dim.terms[inner.symbol] = coefficient;
+                    dim.offset += coefficient * l.begin;
+                }
+
+                loops[i] = inner;
+                names[i] = d.loops[2];
+                loops.insert(loops.begin() + i, outer);
+                names.insert(names.begin() + i, d.loops[1]);
+                break;
+            }
+            case ir_schedule::directive::type::reorder:
+            {
+                std::vector<unsigned> positions;
+                for (std::string name : d.loops)
+                {
+                    positions.push_back(find_loop(name));
+                }
+                std::vector<unsigned> sorted = positions;
+                std::sort(sorted.begin(), sorted.end());
+                tcc_assert(std::unique(sorted.begin(), sorted.end()) ==
+                               sorted.end(),
+                           id + " reorders a loop twice.");
+
+                std::vector<loop> reordered = loops;
+                std::vector<std::string> reordered_names = names;
+                for (unsigned i = 0; i < positions.size(); i++)
+                {
+                    reordered[sorted[i]] = loops[positions[i]];
+                    reordered_names[sorted[i]] = names[positions[i]];
+                }
+                loops = reordered;
+                names = reordered_names;
+                break;
+            }
+            case ir_schedule::directive::type::vectorize:
+                find_loop(d.loops[0]);
+                directives[d.loops[0]].vectorized = true;
+                break;
+            case ir_schedule::directive::type::parallel:
+                find_loop(d.loops[0]);
+                directives[d.loops[0]].parallel = true;
+                break;
+            case ir_schedule::directive::type::unroll:
+                find_loop(d.loops[0]);
+                directives[d.loops[0]].unroll = d.factor;
+                break;
+            default:
+                tcc_error("unknown schedule directive.");
+        }
+    }
+
+    /* directives apply to the final loops. */
+    for (auto directive : directives)
+    {
+        find_loop(directive.first);
+    }
+    for (unsigned i = 0; i < loops.size(); i++)
+    {
+        scheduled_loop directive = directives[names[i]];
+        tcc_assert(!directive.vectorized || i + 1 == loops.size(),
+                   id + " can only vectorize its innermost loop, not " +
+                       names[i] + ".");
+        tcc_assert(!directive.parallel || !loops[i].reduced,
+                   id + " can not parallelize reduced loop " + names[i] +
+                       ".");
+        tcc_assert(directive.unroll == 0 ||
+                       !(directive.parallel || directive.vectorized),
+                   id + " can not unroll parallel or simd loop " + names[i] +
+                       ".");
+        scheduled_loops.insert({ loops[i].symbol, directive });
+    }
+    for (unsigned i = 0; i < indices.size(); i++)
+    {
+        indices[i] = generate(dims[i]);
+        if (!is_operand(indices[i]))
+        {
+            indices[i] = "(" + indices[i] + ")";
+            affines.insert({ indices[i], dims[i] });
+        }
+    }
+}
+
+/* apply_window restricts the loop over rows of a stage of a chain, whose
+ * index is indices[1], to the rows of its window. */
+void ir_codegen::apply_window(expr e,
+                              std::vector<loop>& loops,
+                              std::vector<std::string>& indices)
+{
+    if (windows.find(e) == windows.end())
+    {
+        return;
+    }
+
+    window w = windows.at(e);
+    for (loop& l : loops)
+    {
+        l.bound = l.symbol == indices[1] ? w.rows : l.bound;
+    }
+
+    affine row;
+    row.terms[w.origin] = 1;
+    row.terms[indices[1]] = 1;
+    indices[1] = "(" + generate(row) + ")";
+    affines.insert({ indices[1], row });
+}
+
+/* get_row_offset returns the offset of the row origin of the stored expr e,
+ * relative to the origin of its window when it is buffered. */
+std::string ir_codegen::get_row_offset(expr e, std::string origin)
+{
+    dimension row_size = e->size() / e->shape[1];
+    affine offset;
+    offset.terms[origin] = row_size;
+    if (windows.find(e) != windows.end() && windows.at(e).buffered)
+    {
+        offset.terms[windows.at(e).origin] -= row_size;
+    }
+    for (auto it = offset.terms.begin(); it != offset.terms.end();)
+    {
+        it = it->second == 0 ? offset.terms.erase(it) : std::next(it);
+    }
+
+    std::string symbol = generate(offset);
+    return symbol == "0" ? "" : (symbol[0] == '-' ? "" : "+") + symbol;
+}
+
+/* emit_chain emits the stages of chain c for every stripe of rows of its
+ * last stage. the window of the last stage is clamped into its tensor, so
+ * that the last stripe may overlap the one before it, and every other
+ * window begins at the first row its reader reads, clamped likewise. */
+void ir_codegen::emit_chain(chain c)
+{
+    expr last = stages[c.end - 1];
+    dimension stripes = (last->shape[1] + c.rows - 1) / c.rows;
+    std::string stripe = add_loop_symbol();
+    body << "for (int " << stripe << "=0;" << stripe << "<" << stripes << ";"
+         << stripe << "++) {" << newline(1);
+
+    for (unsigned i = c.end; i-- > c.begin;)
+    {
+        expr e = stages[i];
+        if (windows.find(e) == windows.end())
+        {
+            continue;
+        }
+        window& w = windows.at(e);
+
+        /* clamps are only emitted where the window may leave the tensor,
+         * and windows beginning where their reader's does share its origin.
+         */
+        affine begin;
+        dimension lowest = 0, highest = (stripes - 1) * c.rows;
+        if (e == last)
+        {
+            begin.terms[stripe] = c.rows;
+        }
+        else
+        {
+            std::string reader = windows.at(w.reader).origin;
+            begin.terms[reader] = w.stride;
+            begin.offset = w.first;
+            lowest = w.first;
+            highest = w.stride * origins.at(reader) + w.first;
+        }
+        std::string b = generate(begin);
+        dimension bound = e->shape[1] - w.rows;
+        if (e != last && w.stride == 1 && w.first == 0 && highest <= bound)
+        {
+            w.origin = b;
+            continue;
+        }
+
+        b = is_operand(b) ? b : "(" + b + ")";
+        w.origin = add_loop_symbol();
+        body << "const int " << w.origin << "=";
+        if (lowest < 0)
+        {
+            body << b << "<0?0:";
+        }
+        if (highest > bound)
+        {
+            body << b << "<" << bound << "?" << b << ":" << bound;
+        }
+        else
+        {
+            body << b;
+        }
+        body << ";" << newline();
+        origins.insert({ w.origin, std::min(highest, bound) });
+    }
+
+    for (unsigned i = c.begin; i < c.end; i++)
+    {
+        emit_stage(stages[i]);
+    }
+    body << newline(-1) << "}" << newline();
+}
+
+void ir_codegen::emit_stage(expr e)
+{
+    if (is_alias(e))
+    {
+        /* reshape of a stored expr aliases its buffer. */
+        global_symbols.insert(
+            { e, global_symbols.at(downcast<reshape>(e)->x) });
+    }
+    else if (e->type == exprtype::reduce)
+    {
+        emit_reduce_stage(downcast<reduce>(e));
+    }
+    else if (fusions.find(e) != fusions.end() &&
+             fusions.at(e).decision == fusion::choice::epilogue)
+    {
+        emit_reduce_stage(downcast<reduce>(fusions.at(e).reduction));
+    }
+    else if (softmaxes.find(e) != softmaxes.end())
+    {
+        emit_softmax_stage(e, softmaxes.at(e));
+    }
+    else
+    {
+        std::vector<loop> loops;
+        std::vector<std::string> indices;
+        for (unsigned i = 0; i < e->shape.size(); i++)
+        {
+            if (e->shape[i] == 1)
+            {
+                indices.push_back("0");
+            }
+            else
+            {
+                loops.push_back({ add_loop_symbol(),
+                                  0,
+                                  e->shape[i],
+                                  false,
+                                  is_batched(e, i) });
+                indices.push_back(loops.back().symbol);
+            }
+        }
+        apply_schedule(e, loops, indices);
+        apply_window(e, loops, indices);
+
+        std::vector<region> regions = peel(loops, e, indices);
+        std::vector<std::string> values;
+        std::vector<std::vector<std::string>> declarations(regions.size());
+        for (unsigned i = 0; i < regions.size(); i++)
+        {
+            interior = regions[i].interior;
+            values.push_back(generate_hoisted(
+                e,
+                indices,
+                loops.empty() ? "" : loops.back().symbol,
+                declarations[i]));
+        }
+        interior = false;
+        add_global_symbol(e);
+
+        for (unsigned i = 0; i < regions.size(); i++)
+        {
+            open_loops(regions[i].loops, {}, 0, declarations[i]);
+            body << get_symbol(e, indices) << "=" << values[i] << ";";
+            close_loops(regions[i].loops);
+        }
+    }
+}
+
+/* interchange orders the loops of the stage computing reduction e, where
+ * indices are the indices of x, by the strides of its accesses to stored
+ * exprs and to e. a loop costs about a cache line per access and iteration
+ * when it strides through memory, the fraction of a line it advances when
+ * it walks it, and one access over all of its iterations when the access
+ * does not depend on it. the cheapest loop becomes the innermost one and,
+ * if it is reduced, all reduced loops move inside the unreduced ones, so
+ * that e accumulates locally. as every element of e is independent, only
+ * reduced loops carry dependences, and these keep their order; the loop
+ * over the batch stays outermost. */
+void ir_codegen::interchange(reduce_expr e,
+                             std::vector<loop>& loops,
+                             std::vector<std::string> indices)
+{
+    if (is_scheduled(e) || loops.size() < 2)
+    {
+        return;
+    }
+
+    std::vector<affine> accesses;
+    std::function<void(expr, std::vector<std::string>)> trace =
+        [&](expr t, std::vector<std::string> t_indices) {
+            if (t->shape.empty())
+            {
+                return;
+            }
+            else if (t->type == exprtype::reshape ||
+                     t->type == exprtype::reduce || is_materialized(t))
+            {
+                accesses.push_back(get_flattened_index(t_indices, t->shape));
+                return;
+            }
+
+            std::function<void(exprs)> bind_ranges = [&](exprs ranges) {
+                for (unsigned i = 0; i < ranges.size(); i++)
+                {
+                    if (ranges[i]->type == exprtype::range)
+                    {
+                        range_symbols[ranges[i]] = t_indices[i];
+                    }
+                }
+            };
 
-    std::unordered_map<std::string, expr> reused_symbols;
-    for (auto sym : v->global_symbols)
-    {
-        if (!(sym.first->shape.empty() &&
-              (sym.first->type == exprtype::cnst ||
-               sym.first->type == exprtype::range)) &&
-            sym.second != v->global_symbols.at(v->output) &&
-            v->dep_analysis.inputs.find(sym.first) ==
-                v->dep_analysis.inputs.end())
-        {
-            if (sym.first->type == exprtype::cnst)
+            if (t->type == exprtype::index)
             {
-                tcc_assert(sym.first->dtype == datatype::FP32,
-                           "cnst datatype is not FP32.");
-                sfile << "static const " << generate_var_signature(sym.first)
-                      << "= {";
-                for (float ele : downcast<cnst>(sym.first)->to_vector<float>())
+                index_expr i = downcast<index>(t);
+                bind_ranges(i->ranges);
+                std::vector<std::string> x_indices;
+                for (expr idx : i->indices)
                 {
-                    sfile << std::fixed << std::setprecision(6) << ele << ",";
+                    x_indices.push_back(generate(idx, {}));
                 }
-                sfile << "};" << v->newline();
+                trace(i->x, x_indices);
+                return;
             }
-            else if (sym.first->shape.empty())
+            else if (t->type == exprtype::select)
             {
-                sfile << "static " << generate_var_signature(sym.first) << ";"
-                      << v->newline();
+                bind_ranges(downcast<select>(t)->ranges);
             }
-            else
+            for (expr operand : operands(t))
+            {
+                trace(operand, t_indices);
+            }
+        };
+    trace(e->x, indices);
+
+    std::vector<std::string> e_indices;
+    for (unsigned i = 0; i < indices.size(); i++)
+    {
+        if (e->reduce_dims.find(i) == e->reduce_dims.end())
+        {
+            e_indices.push_back(indices[i]);
+        }
+    }
+    if (!e->shape.empty())
+    {
+        accesses.push_back(get_flattened_index(e_indices, e->shape));
+    }
+
+    /* the stride of a loop in an index that is not affine, such as a
+     * quotient, is taken to be the stride of the whole index. */
+    std::function<double(loop)> cost = [&](loop l) {
+        double lines = 0;
+        for (affine a : accesses)
+        {
+            dimension stride = 0;
+            for (auto term : a.terms)
             {
-                if (reused_symbols.find(sym.second) == reused_symbols.end())
+                std::string::size_type at = term.first.find(l.symbol);
+                while (at != std::string::npos &&
+                       at + l.symbol.size() < term.first.size() &&
+                       std::isdigit(term.first[at + l.symbol.size()]))
                 {
-                    reused_symbols.insert({ sym.second, sym.first });
+                    at = term.first.find(l.symbol, at + 1);
                 }
-                else if (reused_symbols.at(sym.second)->size() <
-                         sym.first->size())
+                if (at != std::string::npos)
                 {
-                    reused_symbols.at(sym.second) = sym.first;
+                    stride = std::max(stride, std::abs(term.second));
                 }
             }
+            lines += stride == 0 ? 1. / (l.bound - l.begin)
+                                 : std::min(static_cast<double>(stride) *
+                                                sizeof(float) / cache_line,
+                                            1.);
         }
-    }
+        return lines;
+    };
 
-    for (auto sym : reused_symbols)
+    /* the batch is the outermost loop, if any. */
+    unsigned first = options.max_batch > 0 ? 1 : 0,
+             innermost = loops.size() - 1;
+    double innermost_cost = cost(loops.back());
+    for (unsigned i = first; i + 1 < loops.size(); i++)
     {
-        sfile << "static " << generate_var_signature(sym.second) << ";"
-              << v->newline();
+        bool movable =
+            !loops[i].reduced ||
+            std::none_of(loops.begin() + i + 1,
+                         loops.end(),
+                         [](loop l) { return l.reduced; });
+        double loop_cost = movable ? cost(loops[i]) : innermost_cost;
+        if (loop_cost < innermost_cost)
+        {
+            innermost = i;
+            innermost_cost = loop_cost;
+        }
     }
 
-    /* write function body to file and remove any empty lines */
-    sfile << generate_func_signature() << " {\n";
-
-    std::string line;
-    while (std::getline(v->body, line))
-        if (line.find_first_not_of(' ') != std::string::npos)
-            sfile << line << '\n';
-
-    sfile << "}";
-    sfile.close();
+    loop last = loops[innermost];
+    loops.erase(loops.begin() + innermost);
+    loops.push_back(last);
+    if (last.reduced)
+    {
+        std::stable_partition(loops.begin() + first,
+                              loops.end(),
+                              [](loop l) { return !l.reduced; });
+    }
 }
 
-void ir_codegen::add_local_symbol(expr e, std::string symbol)
+/* get_accumulation returns where reduction e over the given loops of x
+ * accumulates: in local arrays of blocks of channels when the innermost
+ * loop is not reduced, in a local variable when all reduced loops are
+ * innermost and either all loops are reduced or the innermost one is long,
+ * and in its buffer otherwise. scheduled reductions keep their loop order,
+ * so they accumulate in a local variable whenever their reduced loops are
+ * innermost and in their buffer otherwise. */
+ir_codegen::accumulation ir_codegen::get_accumulation(reduce_expr e,
+                                                      std::vector<loop> loops)
 {
-    tcc_assert(!symbol.empty(), "symbol is empty.");
-    tcc_assert(local_symbols.find(e) == local_symbols.end() ||
-                   local_symbols.at(e) == symbol,
-               "a different symbol for e already exists.");
-    local_symbols.insert({ e, symbol });
+    bool scheduled = is_scheduled(e);
+    if (!scheduled && !e->shape.empty() && !loops.empty() &&
+        !loops.back().reduced &&
+        std::any_of(loops.begin(), loops.end(), [](loop l) {
+            return l.reduced;
+        }))
+    {
+        return accumulation::blocked;
+    }
+
+    unsigned reduced_begin = std::find_if(loops.begin(),
+                                          loops.end(),
+                                          [](loop l) { return l.reduced; }) -
+                             loops.begin();
+    if (reduced_begin < loops.size() &&
+        std::all_of(loops.begin() + reduced_begin,
+                    loops.end(),
+                    [](loop l) { return l.reduced; }) &&
+        (scheduled || reduced_begin == 0 ||
+         loops.back().bound - loops.back().begin >= simd_min_reduce_iters))
+    {
+        return accumulation::simd;
+    }
+    return accumulation::memory;
 }
 
-std::string ir_codegen::add_global_symbol(expr e, std::string symbol)
+/* emit_reduce_stage emits the loops of x in the order chosen by
+ * interchange, unless e is scheduled. leading unreduced loops index
+ * disjoint output elements, so reductions are private to the thread
+ * executing them. results accumulated in local variables,
+ * where a simd reduction splits every output element into independent
+ * partial results, are stored once, through the epilogue of e if it has
+ * one. otherwise the output is initialized on every call as its memory may
+ * hold values of other buffers. averages are scaled by the reciprocal of
+ * their size. */
+void ir_codegen::emit_reduce_stage(reduce_expr e)
 {
-    if (symbol.empty())
+    gemm g = match_gemm(e);
+    if (g.a)
     {
-        tcc_assert_no_key(global_symbols, e);
+        emit_gemm_stage(e, g);
+        return;
+    }
 
-        if (opt_locality && e->type != exprtype::cnst &&
-            e->type != exprtype::reduce && !e->shape.empty() &&
-            !reusable_symbols.empty())
+    std::vector<loop> loops;
+    std::vector<std::string> x_indices, e_indices;
+    for (unsigned i = 0; i < e->x->shape.size(); i++)
+    {
+        x_indices.push_back("0");
+        if (e->x->shape[i] != 1)
         {
-            symbol = *reusable_symbols.begin();
-            reusable_symbols.erase(reusable_symbols.begin());
+            loops.push_back({ add_loop_symbol(),
+                              0,
+                              e->x->shape[i],
+                              e->reduce_dims.find(i) != e->reduce_dims.end(),
+                              is_batched(e->x, i) });
+            x_indices.back() = loops.back().symbol;
         }
-        else
+    }
+    interchange(e, loops, x_indices);
+    apply_schedule(e, loops, x_indices);
+    for (unsigned i = 0; i < e->x->shape.size(); i++)
+    {
+        if (e->reduce_dims.find(i) == e->reduce_dims.end())
         {
-            static unsigned vcount = 1;
-            symbol = "v" + std::to_string(vcount++);
-            if (e->type != exprtype::cnst && !e->shape.empty() &&
-                !dep_analysis.inputs.count(e) && output != e &&
-                dep_analysis.reused.find(e) == dep_analysis.reused.end())
-            {
-                reusable_symbols.insert(symbol);
-            }
+            e_indices.push_back(x_indices[i]);
         }
     }
-    global_symbols.insert({ e, symbol });
-    return symbol;
-}
+    accumulation where = get_accumulation(e, loops);
+    expr stage = epilogues.find(e) != epilogues.end() ? epilogues.at(e) : e;
+    if (windows.find(stage) != windows.end())
+    {
+        apply_window(stage, loops, x_indices);
+        e_indices[1] = x_indices[1];
+    }
 
-std::string ir_codegen::get_indices(exprs ranges,
-                                    dimensions shape,
-                                    exprs indices)
-{
-    ranges = squeeze_ranges(ranges);
-    tcc_assert(!ranges.empty(), "ranges is empty.");
+    std::vector<region> regions = peel(loops, e->x, x_indices);
+    std::vector<std::string> x_symbols;
+    std::vector<std::vector<std::string>> declarations(regions.size());
+    for (unsigned i = 0; i < regions.size(); i++)
+    {
+        interior = regions[i].interior;
+        x_symbols.push_back(
+            generate_hoisted(e->x,
+                             x_indices,
+                             loops.empty() ? "" : loops.back().symbol,
+                             declarations[i]));
+    }
+    interior = false;
+
+    std::string e_symbol = add_global_symbol(stage);
+    if (!e->shape.empty())
+    {
+        e_symbol = get_symbol(stage, e_indices);
+    }
+
+    std::function<std::string(std::string, std::string)> reduce_stmt =
+        [&](std::string target, std::string x_symbol) {
+            switch (e->reduce_type)
+            {
+                case reduce::type::max:
+                    return target + "=" + x_symbol + ">" + target + "?" +
+                           x_symbol + ":" + target;
+                case reduce::type::avg:
+                case reduce::type::sum:
+                    return target + "+=" + x_symbol;
+                default:
+                    tcc_error("unknown reduce type");
+            }
+        };
+    std::string scale = e->reduce_type == reduce::type::avg
+                            ? "*" + to_literal(1.f / e->reduce_size)
+                            : "";
+    std::string reduction =
+        std::string(e->reduce_type == reduce::type::max ? "max" : "+") + ":";
+
+    /* the epilogue computes stage from the accumulated value instead of
+     * reading its buffer. */
+    std::function<std::string(std::string)> store =
+        [&](std::string acc) -> std::string {
+        if (stage == e)
+        {
+            return e_symbol + "=" + acc + scale;
+        }
 
-    unsigned matched_dims = match_ranges(local_ranges, ranges);
-    tcc_assert(matched_dims == ranges.size(), "unmatched index ranges.");
+        std::string symbol = global_symbols.at(stage);
+        global_symbols.erase(stage);
+        local_symbols.insert({ e, "(" + acc + scale + ")" });
+        std::string epilogue = generate(stage, e_indices);
+        local_symbols.erase(e);
+        global_symbols.insert({ stage, symbol });
+        return e_symbol + "=" + epilogue;
+    };
 
-    /* alias index symbols. */
-    for (unsigned i = 0; i < ranges.size(); i++)
+    std::string init = e->reduce_type == reduce::type::max ? "-INFINITY" : "0";
+    if (where == accumulation::blocked)
     {
-        tcc_assert_has_key(global_symbols, local_ranges[i]);
-        if (ranges[i] != local_ranges[i])
+        for (unsigned i = 0; i < regions.size(); i++)
         {
-            add_global_symbol(ranges[i], global_symbols.at(local_ranges[i]));
+            emit_blocked_reduce(
+                regions[i].loops,
+                init,
+                [&](std::string target) {
+                    return reduce_stmt(target, x_symbols[i]);
+                },
+                store,
+                declarations[i]);
         }
+        return;
     }
 
-    shape = indices.empty() ? to_shape(ranges) : shape;
-    indices = indices.empty() ? ranges : indices;
-    tcc_assert(indices.size() == shape.size(),
-               "size of indices does not equal to size of shape.");
+    if (where == accumulation::simd)
+    {
+        unsigned reduced_begin =
+            std::find_if(loops.begin(),
+                         loops.end(),
+                         [](loop l) { return l.reduced; }) -
+            loops.begin();
+        for (unsigned i = 0; i < regions.size(); i++)
+        {
+            std::vector<loop> outer(regions[i].loops.begin(),
+                                    regions[i].loops.begin() + reduced_begin),
+                reduced(regions[i].loops.begin() + reduced_begin,
+                        regions[i].loops.end());
+
+            /* without unreduced loops, the reduction may be shared across
+             * threads. */
+            if (outer.empty())
+            {
+                body << "{" << newline(1) << "float acc=" << init << ";"
+                     << newline();
+                open_loops(reduced,
+                           " reduction(" + reduction + "acc)",
+                           0,
+                           declarations[i]);
+                body << reduce_stmt("acc", x_symbols[i]) << ";";
+                close_loops(reduced);
+                body << store("acc") << ";" << newline(-1) << "}"
+                     << newline();
+                continue;
+            }
 
-    std::string flattened_index;
-    dimension index_multiplier = 1;
-    for (int i = shape.size() - 1; i >= 0; i--)
+            dimension reduced_work = 1;
+            for (loop l : reduced)
+            {
+                reduced_work *= l.bound - l.begin;
+            }
+
+            loop last = reduced.back();
+            reduced.pop_back();
+            open_loops(outer, {}, reduced_work);
+            body << "float acc=" << init << ";" << newline();
+            open_loops(reduced);
+            if (scheduled_loops.find(last.symbol) != scheduled_loops.end())
+            {
+                open_loops({ last },
+                           " reduction(" + reduction + "acc)",
+                           0,
+                           declarations[i]);
+                body << reduce_stmt("acc", x_symbols[i]) << ";";
+                close_loops({ last });
+            }
+            else
+            {
+                for (std::string declaration : declarations[i])
+                {
+                    body << declaration << newline();
+                }
+                if (options.vectorize)
+                {
+                    body << "#pragma omp simd reduction(" << reduction
+                         << "acc)" << newline();
+                }
+                body << "for (int " << last.symbol << "=" << last.begin << ";"
+                     << last.symbol << "<" << last.bound << ";"
+                     << last.symbol << "++) {" << newline(1)
+                     << reduce_stmt("acc", x_symbols[i]) << ";"
+                     << newline(-1) << "}" << newline();
+            }
+            close_loops(reduced);
+            body << store("acc") << ";";
+            close_loops(outer);
+        }
+        return;
+    }
+
+    tcc_assert(loops.empty() || !loops.back().reduced ||
+                   scheduled_loops.find(loops.back().symbol) ==
+                       scheduled_loops.end() ||
+                   !scheduled_loops.at(loops.back().symbol).vectorized,
+               get_node_id(e) + " accumulates in memory and can not "
+                                "vectorize a reduced loop.");
+    if (!e->shape.empty())
     {
-        std::string multiplier_symbol =
-            index_multiplier == 1 ? ""
-                                  : ("*" + std::to_string(index_multiplier));
-        std::string remainder_symbol =
-            flattened_index.empty() ? "" : ("+" + flattened_index);
-        flattened_index = "(" + get_symbol(indices[i]) + multiplier_symbol +
-                          ")" + remainder_symbol;
+        std::vector<loop> init_loops;
+        std::vector<std::string> init_indices;
+        for (unsigned i = 0; i < e->shape.size(); i++)
+        {
+            init_indices.push_back("0");
+            if (e->shape[i] != 1)
+            {
+                init_loops.push_back({ add_loop_symbol(),
+                                       0,
+                                       e->shape[i],
+                                       false,
+                                       is_batched(e, i) });
+                init_indices.back() = init_loops.back().symbol;
+            }
+        }
+        apply_window(e, init_loops, init_indices);
 
-        index_multiplier *= shape[i];
+        open_loops(init_loops);
+        body << get_symbol(e, init_indices) << "=" << init << ";";
+        close_loops(init_loops);
+    }
+    else
+    {
+        body << e_symbol << "=" << init << ";" << newline();
     }
 
-    return "[" + flattened_index + "]";
+    for (unsigned i = 0; i < regions.size(); i++)
+    {
+        open_loops(regions[i].loops, {}, 0, declarations[i]);
+        body << reduce_stmt(e_symbol, x_symbols[i] + scale) << ";";
+        close_loops(regions[i].loops);
+    }
 }
 
-std::string ir_codegen::get_symbol(expr e)
+/* emit_blocked_reduce emits the loops of a reduction whose innermost loop,
+ * typically over channels, is not reduced, as in convolutions and pooling.
+ * a block of channels of pixel_block consecutive outputs along the next
+ * unreduced loop is accumulated in a local array across all reduced loops,
+ * which keeps partial results in registers and reuses every element of x
+ * that does not depend on the channel. stmt returns the statement reducing
+ * the element of x into the given target, store the statement storing the
+ * given accumulator and declarations precede the channel loop around stmt. */
+void ir_codegen::emit_blocked_reduce(
+    std::vector<loop> loops,
+    std::string init,
+    std::function<std::string(std::string)> stmt,
+    std::function<std::string(std::string)> store,
+    std::vector<std::string> declarations)
 {
-    std::string symbol;
+    static const dimension pixel_block = 4;
 
-    if (local_symbols.find(e) != local_symbols.end())
+    loop channel = loops.back();
+    std::vector<loop> outer, reduced;
+    for (unsigned i = 0; i + 1 < loops.size(); i++)
     {
-        symbol = local_symbols.at(e);
-        local_symbols.erase(e);
+        (loops[i].reduced ? reduced : outer).push_back(loops[i]);
     }
-    else if (global_symbols.find(e) != global_symbols.end())
+
+    dimension reduced_work = 1;
+    for (loop l : reduced)
     {
-        symbol =
-            (e->shape.empty()
-                 ? global_symbols.at(e)
-                 : (global_symbols.at(e) + get_indices(to_ranges(e->shape))));
+        reduced_work *= l.bound - l.begin;
     }
-    else if (ir_visitor::visited.find(e) == ir_visitor::visited.end())
+
+    /* channels are blocked by the largest divisor of their extent of at most
+     * 32 floats, unless it is too small to fill a vector. */
+    dimension channels = channel.bound - channel.begin, channel_block = 1;
+    for (dimension size = 32; size >= 1 && channel_block == 1; size--)
     {
-        ir_visitor::visit(e);
-        symbol = get_symbol(e);
+        channel_block = channels % size == 0 ? size : 1;
     }
-    else
+    if (channel_block < 8)
     {
-        tcc_error("symbol for e is not found.");
+        channel_block = channels;
     }
 
-    if (dep_analysis.reused.find(e) != dep_analysis.reused.end())
+    bool blocked = !outer.empty() && !outer.back().batched;
+    loop pixel = blocked ? outer.back() : loop();
+    if (blocked)
     {
-        tcc_assert(dep_analysis.reused.at(e) > 0,
-                   "referencing reused variable too many times.");
-        dep_analysis.reused[e]--;
+        outer.pop_back();
+    }
 
-        tcc_assert(global_symbols.find(e) != global_symbols.end(),
-                   "reused must be global.");
-        if (dep_analysis.reused.at(e) == 0 && !dep_analysis.inputs.count(e) &&
-            output != e)
+    /* pixels are split into full blocks and a remainder of single pixels. */
+    dimension pixels = pixel.bound - pixel.begin;
+    dimension begins[] = { pixel.begin,
+                           pixel.begin + pixels / pixel_block * pixel_block };
+    dimension sizes[] = { pixel_block, 1 };
+    for (unsigned section = 0; section < 2; section++)
+    {
+        dimension size = blocked ? sizes[section] : 1;
+        dimension count = section == 0 ? pixels / pixel_block
+                                       : pixels % pixel_block;
+        count = blocked ? count : 1 - section;
+        if (count == 0)
         {
-            reusable_symbols.insert(global_symbols.at(e));
+            continue;
         }
-    }
 
-    return symbol;
-}
+        std::vector<loop> block_loops = outer;
+        if (blocked)
+        {
+            block_loops.push_back(
+                { add_loop_symbol(), 0, count, false, false });
+        }
 
-std::string ir_codegen::newline(int indent)
-{
-    tcc_assert(!(indent < 0 && indent_offset.empty()),
-               "can not unindent while indent offset is zero.");
+        std::string c0 = add_loop_symbol(), p = add_loop_symbol(),
+                    acc = "acc[" + p + "][" + channel.symbol + "-" + c0 + "]";
+        std::function<void(bool, std::vector<std::string>)>
+            open_pixel_loops = [&](bool declare,
+                                   std::vector<std::string> invariants) {
+            body << "for (int " << p << "=0;" << p << "<" << size << ";" << p
+                 << "++) {" << newline(1);
+            if (declare && blocked)
+            {
+                body << "int " << pixel.symbol << "=" << begins[section]
+                     << "+" << block_loops.back().symbol << "*" << size << "+"
+                     << p << ";" << newline();
+            }
+            for (std::string invariant : invariants)
+            {
+                body << invariant << newline();
+            }
+            if (options.vectorize)
+            {
+                body << "#pragma omp simd" << newline();
+            }
+            body << "for (int " << channel.symbol << "=" << c0 << ";"
+                 << channel.symbol << "<" << c0 << "+" << channel_block << ";"
+                 << channel.symbol << "++) {" << newline(1);
+        };
+        std::function<void()> close_pixel_loops = [&]() {
+            body << newline(-1) << "}" << newline(-1) << "}" << newline();
+        };
 
-    if (indent != 0)
-        indent_offset = indent > 0
-                            ? indent_offset + "    "
-                            : indent_offset.substr(0, indent_offset.size() - 4);
-    return "\n" + indent_offset;
+        open_loops(block_loops, {}, size * channels * reduced_work);
+        body << "for (int " << c0 << "=" << channel.begin << ";" << c0 << "<"
+             << channel.bound << ";" << c0 << "+=" << channel_block << ") {"
+             << newline(1) << "float acc[" << size << "][" << channel_block
+             << "];" << newline();
+
+        open_pixel_loops(false, {});
+        body << acc << "=" << init << ";";
+        close_pixel_loops();
+
+        open_loops(reduced);
+        body << "#pragma GCC unroll " << size << newline();
+        open_pixel_loops(true, declarations);
+        body << stmt(acc) << ";";
+        close_pixel_loops();
+        close_loops(reduced);
+
+        open_pixel_loops(true, {});
+        body << store(acc) << ";";
+        close_pixel_loops();
+        body << newline(-1) << "}" << newline();
+        close_loops(block_loops);
+    }
 }
 
-void ir_codegen::nest(exprs ranges,
-                      expr e,
-                      std::function<std::string()> generate_stmt,
-                      bool force_append)
+/* match_gemm matches e to a sum of x = a * b over a contiguous block of
+ * dimensions of stored matrices a and b. dimensions of x before the block
+ * index rows of a and those after it columns of b, and a and b have the
+ * dimensions of x without the trailing and leading ones respectively, so
+ * that both are row major matrices. b may additionally be indexed by a run
+ * of leading dimensions of x, which then select one of several matrices;
+ * these and all dimensions before them enumerate groups of matrices. a gemm
+ * with a null a is returned if e does not match or its loops are scheduled.
+ */
+ir_codegen::gemm ir_codegen::match_gemm(reduce_expr e)
 {
-    std::function<void(unsigned, exprs)> update_local =
-        [&](unsigned matched_dims, exprs new_ranges) {
-            static unsigned icount = 1;
-            for (unsigned i = 0; i < new_ranges.size(); i++)
-            {
-                add_global_symbol(new_ranges[i],
-                                  i < matched_dims
-                                      ? get_symbol(local_ranges[i])
-                                      : "i" + std::to_string(icount++));
-            }
-            local_ranges = new_ranges;
-        };
+    if (is_scheduled(e) || e->reduce_type != reduce::type::sum ||
+        e->shape.empty() ||
+        e->x->type != exprtype::binary ||
+        downcast<binary>(e->x)->binary_type != binary::type::mul)
+    {
+        return {};
+    }
 
-    std::function<void(unsigned)> close_loop = [&](unsigned matched_dims) {
-        for (unsigned i = matched_dims; i < local_ranges.size(); i++)
-        {
-            body << newline(-1) << "}";
-        }
-    };
+    /* b must not be stored by another stage, which may read its constant
+     * in its original layout. */
+    binary_expr x = downcast<binary>(e->x);
+    if (x->x->type != exprtype::index || x->y->type != exprtype::index ||
+        is_materialized(x->y))
+    {
+        return {};
+    }
 
-    std::function<void(unsigned)> open_loop = [&](unsigned matched_dims) {
-        if (opt_parallelize && matched_dims == 0 && !local_ranges.empty())
+    unsigned k_begin = *std::min_element(e->reduce_dims.begin(),
+                                         e->reduce_dims.end());
+    unsigned k_end = k_begin + e->reduce_dims.size();
+    for (unsigned dim = k_begin; dim < k_end; dim++)
+    {
+        if (e->reduce_dims.find(dim) == e->reduce_dims.end())
         {
-            body << newline(0) << "#pragma omp parallel" << newline(0);
+            return {};
         }
+    }
+
+    index_expr a = downcast<index>(x->x), b = downcast<index>(x->y);
+    unsigned rank = x->shape.size(), matrix_rank = rank - k_begin;
+    if (b->indices.size() < matrix_rank ||
+        b->indices.size() - matrix_rank > k_begin)
+    {
+        return {};
+    }
 
-        for (unsigned i = matched_dims; i < local_ranges.size(); i++)
+    /* b is indexed by dims [group_begin, group_end) of x followed by the
+     * dims of its matrix. */
+    unsigned b_group_rank = b->indices.size() - matrix_rank, group_begin = 0,
+             group_end = 0;
+    if (b_group_rank > 0)
+    {
+        exprs::const_iterator it =
+            std::find(b->ranges.begin(), b->ranges.end(), b->indices[0]);
+        group_begin = it - b->ranges.begin();
+        group_end = group_begin + b_group_rank;
+        if (group_end > k_begin)
         {
-            std::string index_symbol = get_symbol(local_ranges[i]);
-            body << newline(0) << "for (int " << index_symbol << "=0;"
-                 << index_symbol << "<"
-                 << downcast<range>(local_ranges[i])->bound << ";"
-                 << index_symbol << "++) {" << newline(1);
+            return {};
         }
-    };
-
-    std::function<void(unsigned)> flush_local_and_close_loop =
-        [&](unsigned matched_dims) {
-            for (auto it = local_symbols.cbegin(); it != local_symbols.cend();)
-            {
-                if (!it->first->shape.empty() || it->first == output)
-                {
-                    body << newline() << add_global_symbol(it->first)
-                         << (it->first->shape.empty()
-                                 ? ""
-                                 : get_indices(to_ranges(it->first->shape)))
-                         << "=" << it->second << ";";
-                    it = local_symbols.erase(it);
-                }
-                else
-                {
-                    it++;
-                }
-            }
-
-            close_loop(matched_dims);
-        };
+    }
 
-    if (!e->shape.empty())
+    dimensions b_shape(x->shape.begin() + group_begin,
+                       x->shape.begin() + group_end);
+    b_shape.insert(b_shape.end(), x->shape.begin() + k_begin, x->shape.end());
+    if (a->x->shape !=
+            dimensions(x->shape.begin(), x->shape.begin() + k_end) ||
+        b->x->shape != b_shape || a->x->dtype != datatype::FP32 ||
+        b->x->dtype != datatype::FP32 ||
+        !is_materialized(a->x) || !is_materialized(b->x))
     {
-        ranges = squeeze_ranges(ranges);
-        unsigned matched_dims = match_ranges(local_ranges, ranges);
+        return {};
+    }
 
-        if (matched_dims < local_ranges.size())
+    for (unsigned dim = 0; dim < b->indices.size(); dim++)
+    {
+        unsigned x_dim = dim < b_group_rank ? group_begin + dim
+                                            : k_begin + dim - b_group_rank;
+        if (b->indices[dim] != b->ranges[x_dim])
         {
-            flush_local_and_close_loop(matched_dims);
+            return {};
         }
-        else
+    }
+    for (unsigned dim = 0; dim < k_end; dim++)
+    {
+        if (a->indices[dim] != a->ranges[dim])
         {
-            close_loop(matched_dims);
+            return {};
         }
+    }
 
-        update_local(matched_dims, ranges);
-        open_loop(matched_dims);
+    /* only groups or rows of a may have a runtime batch. */
+    if (batch_axes.find(b->x) != batch_axes.end() ||
+        (batch_axes.find(a->x) != batch_axes.end() &&
+         batch_axes.at(a->x) >= k_begin))
+    {
+        return {};
     }
 
-    if (generate_stmt != nullptr)
+    gemm g = { a->x, b->x, group_end, 1, 1, 1, 1, 1 };
+    for (unsigned dim = 0; dim < rank; dim++)
     {
-        if (force_append)
-        {
-            body << generate_stmt() << newline();
-        }
-        else if (dep_analysis.reused.find(e) != dep_analysis.reused.end() &&
-                 dep_analysis.reused[e] != 0)
+        dimension extent = x->shape[dim];
+        if (dim < group_end)
         {
-            body << add_global_symbol(e) << get_indices(ranges) << "="
-                 << generate_stmt() << ";" << newline();
+            g.groups *= extent;
+            g.b_groups *= dim >= group_begin ? extent : 1;
         }
         else
         {
-            add_local_symbol(e, generate_stmt());
+            (dim < k_begin ? g.m : dim < k_end ? g.k : g.n) *= extent;
         }
     }
-
-    if (e == output)
-    {
-        flush_local_and_close_loop(0);
-    }
+    return g;
 }
 
-void ir_codegen::visit(var_expr e)
+void ir_codegen::emit_gemm_stage(reduce_expr e, gemm g)
 {
-    add_global_symbol(e);
-}
+    /* the runtime batch scales the outermost of groups and rows. */
+    std::string groups = std::to_string(g.groups), rows = std::to_string(g.m);
+    if (batch_axes.find(g.a) != batch_axes.end())
+    {
+        (batch_axes.at(g.a) < g.group_rank ? groups : rows) =
+            "batch*" + std::to_string((batch_axes.at(g.a) < g.group_rank
+                                           ? g.groups
+                                           : g.m) /
+                                      options.max_batch);
+    }
 
-void ir_codegen::visit(cnst_expr e)
-{
-    if (e->shape.empty())
+    /* constant b read by no other stage is packed into panels when the
+     * weights are generated, looking through a reshape aliasing it. */
+    expr b = g.b;
+    if (b->type == exprtype::reshape &&
+        dep_analysis.reused.find(b) == dep_analysis.reused.end())
     {
-        switch (e->dtype)
-        {
-            case datatype::FP32:
-                add_global_symbol(e,
-                                  std::to_string(e->to_scalar<float>()) + "f");
-                break;
-            case datatype::INT64:
-                add_global_symbol(e, std::to_string(e->to_scalar<int64_t>()));
-                break;
-            default:
-                tcc_error("unsupported dtype.");
-        }
+        b = downcast<reshape>(b)->x;
     }
-    else
+    bool packed = b->type == exprtype::cnst &&
+                  dep_analysis.reused.find(b) == dep_analysis.reused.end();
+    if (packed)
     {
-        add_global_symbol(e);
+        packed_weights.insert({ b, g });
     }
-}
-
-void ir_codegen::visit(index_expr e)
-{
-    ir_visitor::visit(e->x);
 
-    nest(e->ranges, e);
-
-    if (local_symbols.find(e->x) != local_symbols.end())
+    /* in a chain, rows of the window of e are computed from the same rows
+     * of a. */
+    std::string a = global_symbols.at(g.a), c = add_global_symbol(e);
+    if (windows.find(e) != windows.end())
     {
-        exprs x_ranges = to_ranges(e->x->shape);
-        nest(
-            e->ranges,
-            e,
-            [&]() {
-                return add_global_symbol(e->x) + get_indices(x_ranges) + "=" +
-                       get_symbol(e->x) + ";";
-            },
-            true);
+        window w = windows.at(e);
+        rows = std::to_string(g.m / e->shape[1] * w.rows);
+        a += get_row_offset(g.a, w.origin);
+        c += get_row_offset(e, w.origin);
     }
 
-    tcc_assert_has_key(global_symbols, e->x);
-    nest(e->ranges, e, [&]() {
-        return global_symbols.at(e->x) +
-               get_indices(e->ranges, e->x->shape, e->indices);
-    });
+    uses_gemm = true;
+    body << "tcc_gemm(" << groups << "," << g.b_groups << "," << rows << ","
+         << g.n << "," << g.k << "," << a << "," << global_symbols.at(g.b)
+         << "," << packed << "," << c << ");" << newline();
 }
 
-void ir_codegen::visit(select_expr e)
+/* match_softmax matches e to exp(x - m) / s, where m and s are the max of
+ * x and the sum of exp(x - m) along the innermost dimension, indexed by the
+ * leading ones as built by build_softmax. the exprs in between must have no
+ * other users. x is returned, or null if e does not match. */
+expr ir_codegen::match_softmax(expr e)
 {
-    ir_visitor::visit(e->t);
-    ir_visitor::visit(e->f);
-
-    nest(e->ranges, e, [&]() {
-        return "(" + get_symbol(e->cond) + "?" + get_symbol(e->t) + ":" +
-               get_symbol(e->f) + ")";
-    });
-}
+    std::function<bool(expr)> is_unused = [&](expr x) {
+        return dep_analysis.reused.find(x) == dep_analysis.reused.end();
+    };
+    std::function<bool(expr, expr, reduce::type)> is_reduction =
+        [&](expr r, expr x, reduce::type reduce_type) {
+            if (r->type != exprtype::index || !is_unused(r))
+            {
+                return false;
+            }
 
-void ir_codegen::visit(reshape_expr e)
-{
-    ir_visitor::visit(e->x);
+            index_expr i = downcast<index>(r);
+            if (i->x->type != exprtype::reduce || !is_unused(i->x) ||
+                i->indices.size() + 1 != i->ranges.size() ||
+                !std::equal(i->indices.begin(),
+                            i->indices.end(),
+                            i->ranges.begin()))
+            {
+                return false;
+            }
 
-    exprs e_ranges = to_ranges(e->shape);
-    nest(e_ranges, e);
+            reduce_expr re = downcast<reduce>(i->x);
+            return re->reduce_type == reduce_type && re->x == x &&
+                   re->reduce_dims ==
+                       std::unordered_set<unsigned>{ static_cast<unsigned>(
+                           x->shape.size() - 1) };
+        };
 
-    if (global_symbols.find(e->x) != global_symbols.end())
+    if (e->type != exprtype::binary ||
+        downcast<binary>(e)->binary_type != binary::type::div)
     {
-        add_global_symbol(e, global_symbols.at(e->x));
+        return nullptr;
     }
-    else if (dep_analysis.reused.find(e) != dep_analysis.reused.end() &&
-             dep_analysis.reused.at(e) != 0)
+
+    binary_expr b = downcast<binary>(e);
+    if (b->x->type != exprtype::unary ||
+        downcast<unary>(b->x)->unary_type != unary::type::exp ||
+        dep_analysis.reused.find(b->x) == dep_analysis.reused.end() ||
+        dep_analysis.reused.at(b->x) != 2)
     {
-        nest(
-            e_ranges,
-            e,
-            [&]() {
-                return add_global_symbol(e) + get_indices(e_ranges) + "=" +
-                       get_symbol(e->x) + ";";
-            },
-            true);
+        return nullptr;
     }
-    else
+
+    expr d = downcast<unary>(b->x)->x;
+    if (d->type != exprtype::binary || !is_unused(d) ||
+        downcast<binary>(d)->binary_type != binary::type::sub)
     {
-        add_local_symbol(e, get_symbol(e->x));
+        return nullptr;
     }
+
+    expr x = downcast<binary>(d)->x;
+    return !x->shape.empty() &&
+                   is_reduction(downcast<binary>(d)->y,
+                                x,
+                                reduce::type::max) &&
+                   is_reduction(b->y, b->x, reduce::type::sum)
+               ? x
+               : nullptr;
 }
 
-void ir_codegen::visit(reduce_expr e)
+/* emit_softmax_stage emits the softmax e of x along its innermost dimension.
+ * rows are split into blocks of softmax_block elements; a first pass stores
+ * the exponentials of every block relative to the running max of the row,
+ * rescaling the running sum whenever the max grows, and a second pass
+ * scales each block by its own correction and the reciprocal of the sum.
+ * while the max is -inf, exponentials are taken relative to 0 instead, as
+ * -inf - -inf is nan. both passes are simd loops over blocks that stay in
+ * cache. */
+void ir_codegen::emit_softmax_stage(expr e, expr x)
 {
-    ir_visitor::visit(e->x);
+    static const dimension softmax_block = 256;
 
-    exprs unreduced_ranges = to_ranges(e->x->shape);
-    exprs reduced_ranges;
-    for (unsigned i = 0; i < unreduced_ranges.size(); i++)
+    std::vector<loop> loops;
+    std::vector<std::string> indices;
+    for (unsigned i = 0; i + 1 < e->shape.size(); i++)
     {
-        if (e->reduce_dims.find(i) == e->reduce_dims.end())
+        indices.push_back("0");
+        if (e->shape[i] != 1)
         {
-            reduced_ranges.push_back(unreduced_ranges[i]);
+            loops.push_back(
+                { add_loop_symbol(), 0, e->shape[i], false, is_batched(e, i) });
+            indices.back() = loops.back().symbol;
         }
     }
 
-    //nest({}, e);
+    dimension n = e->shape.back();
+    std::string j = add_loop_symbol(), j0 = add_loop_symbol();
+    indices.push_back(j);
+    std::string x_symbol = generate(x, indices);
+    add_global_symbol(e);
+    std::string e_symbol = get_symbol(e, indices);
 
-    nest(
-        unreduced_ranges,
-        e,
-        [&]() {
-            std::string x_symbol = get_symbol(e->x);
-            std::string e_symbol =
-                e->shape.empty()
-                    ? add_global_symbol(e)
-                    : add_global_symbol(e) + get_indices(unreduced_ranges,
-                                                         e->shape,
-                                                         reduced_ranges);
+    std::string simd = options.vectorize ? "#pragma omp simd" : "";
+    std::function<std::string(std::string)> reduction =
+        [&](std::string clause) {
+            return simd.empty() ? "" : simd + " reduction(" + clause + ")";
+        };
+    std::function<void(std::string)> open_block = [&](std::string header) {
+        body << "for (int " << j0 << "=0;" << j0 << "<" << n << ";" << j0
+             << "+=" << softmax_block << ") {" << newline(1) << "int end="
+             << j0 << "+" << softmax_block << "<" << n << "?" << j0 << "+"
+             << softmax_block << ":" << n << ";" << newline() << header
+             << newline();
+    };
+    std::function<void(std::string, std::string)> emit_loop =
+        [&](std::string pragma, std::string stmt) {
+            if (!pragma.empty())
+            {
+                body << pragma << newline();
+            }
+            body << "for (int " << j << "=" << j0 << ";" << j << "<end;" << j
+                 << "++) {" << newline(1) << stmt << ";" << newline(-1) << "}"
+                 << newline();
+        };
+    std::string block_max =
+        "ms[" + j0 + "/" + std::to_string(softmax_block) + "]";
 
-            std::string reduce_stmt = ([&]() {
-                switch (e->reduce_type)
-                {
-                    case reduce::type::avg:
-                        return e_symbol + "+=" + x_symbol + "/" +
-                               std::to_string(e->reduce_size) + ".f";
-                    case reduce::type::max:
-                        return e_symbol + "=" + x_symbol + ">" + e_symbol +
-                               "?" + x_symbol + ":" + e_symbol;
-                    case reduce::type::sum:
-                        return e_symbol + "+=" + x_symbol;
-                    default:
-                        tcc_error("unknown reduce type");
-                }
-            })();
+    open_loops(loops, {}, 3 * n);
+    if (loops.empty())
+    {
+        body << "{" << newline(1);
+    }
+    body << "float m=-INFINITY,s=0,ms["
+         << (n + softmax_block - 1) / softmax_block << "];" << newline();
+    open_block("float bm=m,bs=0;");
+    emit_loop(reduction("max:bm"),
+              "bm=" + x_symbol + ">bm?" + x_symbol + ":bm");
+    body << "const float bo=bm==-INFINITY?0:bm;" << newline();
+    emit_loop(reduction("+:bs"),
+              e_symbol + "=" +
+                  generate_unary(unary::type::exp, x_symbol + "-bo") +
+                  ";bs+=" + e_symbol);
+    body << "s=s*" << generate_unary(unary::type::exp, "m-bo") << "+bs;"
+         << newline() << "m=" << block_max << "=bm;"
+         << newline(-1) << "}" << newline() << "const float r=1.f/s;"
+         << newline();
+    open_block("const float c=" +
+               generate_unary(unary::type::exp, block_max + "-m") + "*r;");
+    emit_loop(simd, e_symbol + "*=c");
+    body << newline(-1) << "}" << newline();
+    if (loops.empty())
+    {
+        body << newline(-1) << "}" << newline();
+    }
+    close_loops(loops);
+}
 
-            return opt_parallelize
-                       ? ("#pragma omp single" + newline() + "{" +
-                          newline(1) + reduce_stmt + ";" + newline(-1) + "}")
-                       : reduce_stmt + ";";
-        },
-        true);
+void ir_codegen::visit(var_expr e)
+{
+    schedule(e);
+}
 
-    if (e != output)
-    { // fixed bug: extra closing braces when reduce is output
-        nest(reduced_ranges, e);
-    }
+void ir_codegen::visit(cnst_expr e)
+{
+    schedule(e);
 }
 
-void ir_codegen::visit(unary_expr e)
+void ir_codegen::visit(index_expr e)
 {
-    ir_visitor::visit(e->x);
+    ir_visitor::visit(e);
+    schedule(e);
+}
 
-    std::string expr_symbol = ([&]() {
-        switch (e->unary_type)
-        {
-            case unary::type::exp:
-                return "expf";
-            default:
-                tcc_error("unknown unary type.");
-        }
-    }());
+void ir_codegen::visit(select_expr e)
+{
+    ir_visitor::visit(e);
+    schedule(e);
+}
 
-    nest(to_ranges(e->shape), e, [&]() {
-        return expr_symbol + "(" + get_symbol(e->x) + ")";
-    });
+void ir_codegen::visit(reshape_expr e)
+{
+    ir_visitor::visit(e);
+    schedule(e);
 }
 
-void ir_codegen::visit(binary_expr e)
+void ir_codegen::visit(reduce_expr e)
 {
-    ir_visitor::visit(e->x);
-    ir_visitor::visit(e->y);
-
-    std::string expr_symbol = ([&]() {
-        switch (e->binary_type)
-        {
-            case binary::type::add:
-                return "+";
-            case binary::type::sub:
-                return "-";
-            case binary::type::mul:
-                return "*";
-            case binary::type::div:
-                return "/";
-            case binary::type::mod:
-                return "%";
-            case binary::type::logical_and:
-                return "&&";
-            case binary::type::greater:
-                return ">";
-            case binary::type::greater_eq:
-                return ">=";
-            case binary::type::less:
-                return "<";
-            default:
-                tcc_error("unknown binary type.");
-        }
-    }());
+    ir_visitor::visit(e);
+    schedule(e);
+}
+
+void ir_codegen::visit(unary_expr e)
+{
+    ir_visitor::visit(e);
+    schedule(e);
+}
 
-    nest(to_ranges(e->shape), e, [&]() {
-        return "(" + get_symbol(e->x) + expr_symbol + get_symbol(e->y) + ")";
-    });
+void ir_codegen::visit(binary_expr e)
+{
+    ir_visitor::visit(e);
+    schedule(e);
 }
 
 } // namespace tcc
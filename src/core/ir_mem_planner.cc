@@ -0,0 +1,84 @@
+#include "tcc/core/ir_mem_planner.h"
+#include <algorithm>
+#include <limits>
+
+namespace tcc {
+
+ir_mem_planner_result ir_mem_planner::apply(std::vector<ir_mem_block> blocks,
+                                            dimension alignment)
+{
+    tcc_assert(alignment > 0, "invalid alignment.");
+
+    ir_mem_planner_result result;
+    for (ir_mem_block& block : blocks)
+    {
+        tcc_assert(block.first <= block.last, "invalid lifetime.");
+        block.size = (block.size + alignment - 1) / alignment * alignment;
+    }
+
+    /* ties are broken by lifetime and then by the given order,
+     * so that the plan is deterministic. */
+    std::stable_sort(blocks.begin(),
+                     blocks.end(),
+                     [](const ir_mem_block& a, const ir_mem_block& b) {
+                         if (a.size != b.size)
+                             return a.size > b.size;
+                         if (a.first != b.first)
+                             return a.first < b.first;
+                         return a.last < b.last;
+                     });
+
+    std::vector<ir_mem_block> placed;
+    for (ir_mem_block block : blocks)
+    {
+        std::vector<ir_mem_block> conflicts;
+        std::copy_if(placed.begin(),
+                     placed.end(),
+                     std::back_inserter(conflicts),
+                     [&](const ir_mem_block& p) {
+                         return p.first <= block.last && block.first <= p.last;
+                     });
+        std::sort(conflicts.begin(),
+                  conflicts.end(),
+                  [&](const ir_mem_block& a, const ir_mem_block& b) {
+                      return result.offsets.at(a.e) < result.offsets.at(b.e);
+                  });
+
+        dimension offset = -1, best_gap = std::numeric_limits<dimension>::max();
+        dimension end = 0;
+        for (ir_mem_block conflict : conflicts)
+        {
+            dimension gap = result.offsets.at(conflict.e) - end;
+            if (gap >= block.size && gap < best_gap)
+            {
+                offset = end;
+                best_gap = gap;
+            }
+            end = std::max(end, result.offsets.at(conflict.e) + conflict.size);
+        }
+        offset = offset < 0 ? end : offset;
+
+        result.offsets[block.e] = offset;
+        result.arena_size = std::max(result.arena_size, offset + block.size);
+        placed.push_back(block);
+    }
+
+    /* the peak is the largest total size of buffers live at the same time,
+     * a lower bound of the arena size. */
+    for (ir_mem_block block : blocks)
+    {
+        dimension live_size = 0;
+        for (ir_mem_block other : blocks)
+        {
+            if (other.first <= block.first && block.first <= other.last)
+            {
+                live_size += other.size;
+            }
+        }
+        result.peak_size = std::max(result.peak_size, live_size);
+    }
+
+    return result;
+}
+
+} // namespace tcc
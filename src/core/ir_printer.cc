@@ -185,6 +185,10 @@ void ir_printer::visit(unary_expr e)
         {
             case unary::type::exp:
                 return "exp";
+            case unary::type::sigmoid:
+                return "sigmoid";
+            case unary::type::tanh:
+                return "tanh";
             default:
                 tcc_error("unknown unary type.");
         }
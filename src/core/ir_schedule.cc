@@ -0,0 +1,341 @@
+#include "tcc/core/ir_schedule.h"
+#include <fstream>
+#include <functional>
+#include <sstream>
+
+namespace tcc {
+
+ir_schedule::stage& ir_schedule::stage::split(std::string loop,
+                                              std::string outer,
+                                              std::string inner,
+                                              dimension factor)
+{
+    tcc_assert(factor > 0, "split factor of " + loop + " is not positive.");
+    directives.push_back(
+        { directive::type::split, { loop, outer, inner }, factor });
+    return *this;
+}
+
+ir_schedule::stage& ir_schedule::stage::tile(std::string y,
+                                             std::string x,
+                                             std::string yo,
+                                             std::string xo,
+                                             std::string yi,
+                                             std::string xi,
+                                             dimension y_factor,
+                                             dimension x_factor)
+{
+    return split(y, yo, yi, y_factor)
+        .split(x, xo, xi, x_factor)
+        .reorder({ yo, xo, yi, xi });
+}
+
+ir_schedule::stage& ir_schedule::stage::reorder(std::vector<std::string> loops)
+{
+    directives.push_back({ directive::type::reorder, loops, 0 });
+    return *this;
+}
+
+ir_schedule::stage& ir_schedule::stage::vectorize(std::string loop)
+{
+    directives.push_back({ directive::type::vectorize, { loop }, 0 });
+    return *this;
+}
+
+ir_schedule::stage& ir_schedule::stage::parallel(std::string loop)
+{
+    directives.push_back({ directive::type::parallel, { loop }, 0 });
+    return *this;
+}
+
+ir_schedule::stage& ir_schedule::stage::unroll(std::string loop,
+                                               dimension factor)
+{
+    tcc_assert(factor > 0, "unroll factor of " + loop + " is not positive.");
+    directives.push_back({ directive::type::unroll, { loop }, factor });
+    return *this;
+}
+
+ir_schedule::stage& ir_schedule::stage::compute_inline()
+{
+    compute = placement::inlined;
+    return *this;
+}
+
+ir_schedule::stage& ir_schedule::stage::compute_root()
+{
+    compute = placement::root;
+    return *this;
+}
+
+ir_schedule::stage& ir_schedule::stage::compute_at(expr consumer,
+                                                   dimension rows)
+{
+    tcc_assert_not_null(consumer);
+    tcc_assert(rows > 0, "stripe height is not positive.");
+    compute = placement::at;
+    this->consumer = consumer;
+    this->rows = rows;
+    return *this;
+}
+
+bool ir_schedule::stage::splits(std::string loop) const
+{
+    for (directive d : directives)
+    {
+        if (d.directive_type == directive::type::split && d.loops[0] == loop)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+ir_schedule::stage& ir_schedule::operator[](expr e)
+{
+    tcc_assert_not_null(e);
+    return stages[e];
+}
+
+ir_schedule ir_schedule_parser::apply(const std::string schedule_path,
+                                      expr ir)
+{
+    std::ifstream file(schedule_path);
+    tcc_assert(file, "failed to open file at " + schedule_path + ".");
+
+    std::shared_ptr<ir_schedule_parser> v(new ir_schedule_parser);
+    ir->accept(v);
+
+    ir_schedule schedule;
+    std::string line;
+    for (unsigned line_number = 1; std::getline(file, line); line_number++)
+    {
+        std::vector<std::string> args;
+        std::string arg;
+        std::istringstream tokens(line.substr(0, line.find('#')));
+        while (tokens >> arg)
+        {
+            args.push_back(arg);
+        }
+        if (args.empty())
+        {
+            continue;
+        }
+
+        std::string location =
+            schedule_path + ":" + std::to_string(line_number) + ": ";
+        tcc_assert(args.size() >= 2, location + "missing directive.");
+        ir_schedule::stage& s = schedule[v->to_expr(args[0], location)];
+        args.erase(args.begin());
+        v->parse(s, args, location);
+    }
+    return schedule;
+}
+
+ir_schedule::stage ir_schedule_parser::parse_stage(const std::string text,
+                                                   const std::string location)
+{
+    ir_schedule_parser parser;
+    ir_schedule::stage s;
+    std::istringstream directives(text);
+    std::string directive;
+    while (std::getline(directives, directive, ';'))
+    {
+        std::vector<std::string> args;
+        std::string arg;
+        std::istringstream tokens(directive);
+        while (tokens >> arg)
+        {
+            args.push_back(arg);
+        }
+        if (!args.empty())
+        {
+            parser.parse(s, args, location);
+        }
+    }
+    return s;
+}
+
+std::string ir_schedule_parser::to_string(const ir_schedule::stage s)
+{
+    typedef ir_schedule::directive::type type;
+
+    std::string text;
+    for (ir_schedule::directive d : s.directives)
+    {
+        text += text.empty() ? "" : "; ";
+        switch (d.directive_type)
+        {
+            case type::split:
+                text += "split";
+                break;
+            case type::reorder:
+                text += "reorder";
+                break;
+            case type::vectorize:
+                text += "vectorize";
+                break;
+            case type::parallel:
+                text += "parallel";
+                break;
+            case type::unroll:
+                text += "unroll";
+                break;
+        }
+        for (std::string loop : d.loops)
+        {
+            text += " " + loop;
+        }
+        if (d.directive_type == type::split ||
+            d.directive_type == type::unroll)
+        {
+            text += " " + std::to_string(d.factor);
+        }
+    }
+    return text;
+}
+
+expr ir_schedule_parser::to_expr(const std::string id,
+                                 const std::string location)
+{
+    tcc_assert(ids.find(id) != ids.end(),
+               location + "unknown expr " + id + ".");
+    return ids.at(id);
+}
+
+/* parse adds the directive args[0] with arguments args[1...] to s. */
+void ir_schedule_parser::parse(ir_schedule::stage& s,
+                               std::vector<std::string> args,
+                               const std::string location)
+{
+    std::function<dimension(std::string)> to_factor = [&](std::string value) {
+        tcc_assert(!value.empty() && value.find_first_not_of("0123456789") ==
+                                         std::string::npos,
+                   location + "invalid factor " + value + ".");
+        return static_cast<dimension>(std::stoll(value));
+    };
+
+    std::string directive = args[0];
+    args.erase(args.begin());
+
+    std::function<void(unsigned)> expect_args = [&](unsigned count) {
+        tcc_assert(args.size() == count,
+                   location + directive + " takes " + std::to_string(count) +
+                       " arguments.");
+    };
+    if (directive == "split")
+    {
+        expect_args(4);
+        s.split(args[0], args[1], args[2], to_factor(args[3]));
+    }
+    else if (directive == "tile")
+    {
+        expect_args(8);
+        s.tile(args[0],
+               args[1],
+               args[2],
+               args[3],
+               args[4],
+               args[5],
+               to_factor(args[6]),
+               to_factor(args[7]));
+    }
+    else if (directive == "reorder")
+    {
+        tcc_assert(args.size() >= 2,
+                   location + "reorder takes at least 2 arguments.");
+        s.reorder(args);
+    }
+    else if (directive == "vectorize")
+    {
+        expect_args(1);
+        s.vectorize(args[0]);
+    }
+    else if (directive == "parallel")
+    {
+        expect_args(1);
+        s.parallel(args[0]);
+    }
+    else if (directive == "unroll")
+    {
+        expect_args(2);
+        s.unroll(args[0], to_factor(args[1]));
+    }
+    else if (directive == "compute_inline")
+    {
+        expect_args(0);
+        s.compute_inline();
+    }
+    else if (directive == "compute_root")
+    {
+        expect_args(0);
+        s.compute_root();
+    }
+    else if (directive == "compute_at")
+    {
+        expect_args(2);
+        s.compute_at(to_expr(args[0], location), to_factor(args[1]));
+    }
+    else
+    {
+        tcc_error(location + "unknown directive " + directive + ".");
+    }
+}
+
+/* exprs are numbered like the nodes of ir_codegen, which skips ranges and
+ * scalars other than reductions. */
+void ir_schedule_parser::number(expr e)
+{
+    if (!e->shape.empty() || e->type == exprtype::reduce)
+    {
+        ids.insert({ "n" + std::to_string(ids.size()), e });
+    }
+}
+
+void ir_schedule_parser::visit(var_expr e)
+{
+    number(e);
+}
+
+void ir_schedule_parser::visit(cnst_expr e)
+{
+    number(e);
+}
+
+void ir_schedule_parser::visit(index_expr e)
+{
+    ir_visitor::visit(e);
+    number(e);
+}
+
+void ir_schedule_parser::visit(select_expr e)
+{
+    ir_visitor::visit(e);
+    number(e);
+}
+
+void ir_schedule_parser::visit(reshape_expr e)
+{
+    ir_visitor::visit(e);
+    number(e);
+}
+
+void ir_schedule_parser::visit(reduce_expr e)
+{
+    ir_visitor::visit(e);
+    number(e);
+}
+
+void ir_schedule_parser::visit(unary_expr e)
+{
+    ir_visitor::visit(e);
+    number(e);
+}
+
+void ir_schedule_parser::visit(binary_expr e)
+{
+    ir_visitor::visit(e);
+    number(e);
+}
+
+} // namespace tcc
@@ -0,0 +1,519 @@
+#include "tcc/core/ir_tuner.h"
+#include "tcc/core/ir_dep_analysis.h"
+#include "tcc/core/ir_util.h"
+#include <algorithm>
+#include <chrono>
+#include <dlfcn.h>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <sys/stat.h>
+
+namespace tcc {
+
+/* pixel tiles and simd widths of channels tried by the variants. */
+static const dimension tile_sizes[] = { 1, 2, 4 };
+static const dimension simd_widths[] = { 4, 8, 16 };
+
+/* get_cpu_model returns the model name of the local cpu. */
+static std::string get_cpu_model()
+{
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line))
+    {
+        if (line.rfind("model name", 0) == 0)
+        {
+            std::string model = line.substr(line.find(':') + 1);
+            model.erase(0, model.find_first_not_of(" \t"));
+            return model;
+        }
+    }
+    return "unknown";
+}
+
+/* extract_layer returns reduction r computed on its own, with the stored
+ * exprs it reads, inputs and other reductions, replaced by inputs. */
+static reduce_expr extract_layer(reduce_expr r)
+{
+    std::unordered_map<expr, expr> copies;
+    std::function<expr(expr)> copy = [&](expr e) -> expr {
+        if (copies.find(e) != copies.end())
+        {
+            return copies.at(e);
+        }
+
+        expr c;
+        switch (e->type)
+        {
+            case exprtype::var:
+            case exprtype::reduce:
+                c = var::make(e->dtype, e->shape);
+                break;
+            case exprtype::cnst:
+            case exprtype::range:
+                c = e;
+                break;
+            case exprtype::index:
+            {
+                index_expr i = downcast<index>(e);
+                c = index::make(i->ranges, copy(i->x), i->indices);
+                break;
+            }
+            case exprtype::select:
+            {
+                select_expr s = downcast<select>(e);
+                c = select::make(s->ranges, s->cond, copy(s->t), copy(s->f));
+                break;
+            }
+            case exprtype::reshape:
+                c = reshape::make(e->shape, copy(downcast<reshape>(e)->x));
+                break;
+            case exprtype::unary:
+            {
+                unary_expr u = downcast<unary>(e);
+                c = unary::make(u->unary_type, copy(u->x));
+                break;
+            }
+            case exprtype::binary:
+            {
+                binary_expr b = downcast<binary>(e);
+                c = binary::make(b->binary_type, copy(b->x), copy(b->y));
+                break;
+            }
+            default:
+                tcc_error("unknown exprtype.");
+        }
+        copies.insert({ e, c });
+        return c;
+    };
+    return downcast<reduce>(
+        reduce::make(r->reduce_type, r->reduce_dims, copy(r->x)));
+}
+
+/* get_signature returns the signature of layer under the given options: its
+ * reduction, the shape and reduced dimensions of its operand, a hash of the
+ * structure of the operand and the options that shape the generated loops.
+ * the structure omits the values of constant tensors but keeps scalars,
+ * which determine strides and paddings. */
+static std::string get_signature(reduce_expr layer, ir_codegen_options options)
+{
+    std::unordered_map<expr, std::string> ranges;
+    std::function<std::string(dimensions)> describe_shape =
+        [](dimensions shape) {
+            std::string text;
+            for (dimension dim : shape)
+            {
+                text += (text.empty() ? "" : ",") + std::to_string(dim);
+            }
+            return "[" + text + "]";
+        };
+    std::function<std::string(expr)> describe = [&](expr e) -> std::string {
+        if (e->type == exprtype::range)
+        {
+            if (ranges.find(e) == ranges.end())
+            {
+                dimension bound = downcast<range>(e)->bound;
+                ranges.insert({ e,
+                                "r" + std::to_string(ranges.size()) + ":" +
+                                    std::to_string(bound) });
+            }
+            return ranges.at(e);
+        }
+
+        std::string text = to_string(e->type) + describe_shape(e->shape);
+        if (e->type == exprtype::cnst && e->shape.empty())
+        {
+            std::ostringstream data;
+            for (unsigned char byte : downcast<cnst>(e)->data)
+            {
+                data << std::hex << std::setw(2) << std::setfill('0')
+                     << static_cast<unsigned>(byte);
+            }
+            text += data.str();
+        }
+        else if (e->type == exprtype::unary)
+        {
+            text += std::to_string(static_cast<int>(
+                downcast<unary>(e)->unary_type));
+        }
+        else if (e->type == exprtype::binary)
+        {
+            text += std::to_string(static_cast<int>(
+                downcast<binary>(e)->binary_type));
+        }
+        else if (e->type == exprtype::index)
+        {
+            for (expr r : downcast<index>(e)->ranges)
+            {
+                text += describe(r);
+            }
+        }
+        else if (e->type == exprtype::select)
+        {
+            for (expr r : downcast<select>(e)->ranges)
+            {
+                text += describe(r);
+            }
+        }
+
+        text += "(";
+        for (expr operand : operands(e))
+        {
+            text += describe(operand) + ",";
+        }
+        return text + ")";
+    };
+
+    /* the structure is hashed with 64 bit fnv-1a, which is stable across
+     * platforms and runs. */
+    std::string structure = describe(layer->x);
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : structure)
+    {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+
+    std::vector<unsigned> reduce_dims(layer->reduce_dims.begin(),
+                                      layer->reduce_dims.end());
+    std::sort(reduce_dims.begin(), reduce_dims.end());
+    std::string dims;
+    for (unsigned dim : reduce_dims)
+    {
+        dims += (dims.empty() ? "" : ",") + std::to_string(dim);
+    }
+
+    std::ostringstream signature;
+    signature << (layer->reduce_type == reduce::type::avg   ? "avg"
+                  : layer->reduce_type == reduce::type::max ? "max"
+                                                            : "sum")
+              << describe_shape(layer->x->shape) << "{" << dims << "}:"
+              << std::hex << std::setw(16) << std::setfill('0') << hash
+              << std::dec << ":v" << options.vectorize << "p"
+              << options.parallelize << "t" << options.threads;
+    return signature.str();
+}
+
+/* enumerate_variants returns the automatic loop nest of layer, followed by
+ * variants of loops d<i> over its operand. u are its unreduced loops, where
+ * the last one, c, typically iterates over channels and the one before, p,
+ * over pixels, and r its reduced loops. variants either move r inside of u
+ * with the innermost reduced loop vectorized, or split c into simd loops
+ * ci of every width of simd_widths and p into tiles pi of every size of
+ * tile_sizes and order the loops u, po, co, r, pi, ci with pi unrolled.
+ * when parallelization is enabled, every variant is tried with either of
+ * the first two unreduced loops parallelized. */
+static std::vector<ir_schedule::stage> enumerate_variants(
+    reduce_expr layer, ir_codegen_options options)
+{
+    std::vector<std::string> u, r;
+    std::unordered_map<std::string, dimension> extents;
+    for (unsigned i = 0; i < layer->x->shape.size(); i++)
+    {
+        if (layer->x->shape[i] != 1)
+        {
+            std::string loop = "d" + std::to_string(i);
+            extents.insert({ loop, layer->x->shape[i] });
+            (layer->reduce_dims.count(i) ? r : u).push_back(loop);
+        }
+    }
+
+    std::vector<ir_schedule::stage> variants(1);
+    if (u.empty() || r.empty())
+    {
+        return variants;
+    }
+
+    std::string c = u.back(), p = u.size() > 1 ? u[u.size() - 2] : "";
+    std::vector<std::string> parallel_loops = { "" };
+    if (options.parallelize)
+    {
+        parallel_loops = { u[0] };
+        if (u.size() > 1)
+        {
+            parallel_loops.push_back(u[1]);
+        }
+    }
+
+    for (std::string parallel_loop : parallel_loops)
+    {
+        ir_schedule::stage reduced_inside;
+        std::vector<std::string> order = u;
+        order.insert(order.end(), r.begin(), r.end());
+        reduced_inside.reorder(order).vectorize(r.back());
+        if (!parallel_loop.empty())
+        {
+            reduced_inside.parallel(parallel_loop);
+        }
+        variants.push_back(reduced_inside);
+
+        for (dimension width : simd_widths)
+        {
+            for (dimension tile : tile_sizes)
+            {
+                if (extents.at(c) % width != 0 ||
+                    (tile > 1 && (p.empty() || extents.at(p) % tile != 0)))
+                {
+                    continue;
+                }
+
+                ir_schedule::stage variant;
+                variant.split(c, "co", "ci", width);
+                order.assign(u.begin(), u.end() - 1);
+                if (tile > 1)
+                {
+                    variant.split(p, "po", "pi", tile);
+                    order.back() = "po";
+                }
+                order.push_back("co");
+                order.insert(order.end(), r.begin(), r.end());
+                if (tile > 1)
+                {
+                    order.push_back("pi");
+                }
+                order.push_back("ci");
+                variant.reorder(order).vectorize("ci");
+                if (tile > 1)
+                {
+                    variant.unroll("pi", tile);
+                }
+                if (!parallel_loop.empty())
+                {
+                    variant.parallel(parallel_loop == c ? "co"
+                                     : parallel_loop == p && tile > 1
+                                         ? "po"
+                                         : parallel_loop);
+                }
+                variants.push_back(variant);
+            }
+        }
+    }
+    return variants;
+}
+
+/* time_layer compiles layer with the given options as target_name and
+ * returns the shortest time of options.repeats calls in microseconds, or
+ * infinity if it fails to compile. */
+static double time_layer(const std::string target_name,
+                         expr layer,
+                         ir_codegen_options codegen_options,
+                         ir_tuner_options options)
+{
+    tcc_assert(!system(("rm -rf " + target_name).c_str()) &&
+                   !mkdir(target_name.c_str(), S_IRWXU),
+               "failed to create tuning directory at " + target_name + ".");
+    ir_codegen::apply(target_name, layer, codegen_options);
+
+    std::function<double(double)> clean_up = [&](double time) {
+        tcc_assert(!system(("rm -rf " + target_name).c_str()),
+                   "failed to remove tuning directory at " + target_name +
+                       ".");
+        return time;
+    };
+
+    const std::string compile_cmd = "cd " + target_name + " && " +
+                                    options.compiler + " -o " + target_name +
+                                    ".so " + target_name +
+                                    ".c -lm > /dev/null 2>&1";
+    if (system(compile_cmd.c_str()))
+    {
+        tcc_info("failed to compile " + target_name + ".");
+        return clean_up(std::numeric_limits<double>::infinity());
+    }
+
+    const std::string lib_path = "./" + target_name + "/" + target_name + ".so";
+    void* lib = dlopen(lib_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    tcc_assert(lib, "can not open shared library at " + lib_path + ".");
+    void* func = dlsym(lib, target_name.c_str());
+    tcc_assert(func, "can not find function symbol " + target_name + ".");
+
+    /* inputs are passed in the order of the generated signature. */
+    std::vector<std::vector<float>> buffers;
+    for (expr input : ir_dep_analysis::apply(layer).inputs)
+    {
+        buffers.push_back(std::vector<float>(input->size(), 0.5f));
+    }
+    buffers.push_back(std::vector<float>(layer->size()));
+
+    std::vector<float*> args;
+    for (std::vector<float>& buffer : buffers)
+    {
+        args.push_back(buffer.data());
+    }
+
+    typedef float* f;
+    std::function<void()> call = [&]() {
+        switch (args.size())
+        {
+            case 1:
+                reinterpret_cast<void (*)(f)>(func)(args[0]);
+                break;
+            case 2:
+                reinterpret_cast<void (*)(f, f)>(func)(args[0], args[1]);
+                break;
+            case 3:
+                reinterpret_cast<void (*)(f, f, f)>(func)(
+                    args[0], args[1], args[2]);
+                break;
+            case 4:
+                reinterpret_cast<void (*)(f, f, f, f)>(func)(
+                    args[0], args[1], args[2], args[3]);
+                break;
+            default:
+                tcc_error("layers with more than 3 inputs are not tuned.");
+        }
+    };
+
+    double best = std::numeric_limits<double>::infinity();
+    call();
+    for (unsigned i = 0; i < options.repeats; i++)
+    {
+        std::chrono::steady_clock::time_point begin =
+            std::chrono::steady_clock::now();
+        call();
+        std::chrono::steady_clock::time_point end =
+            std::chrono::steady_clock::now();
+        best = std::min(
+            best,
+            std::chrono::duration<double, std::micro>(end - begin).count());
+    }
+    dlclose(lib);
+    return clean_up(best);
+}
+
+ir_schedule ir_tuner::apply(const std::string target_name,
+                            expr ir,
+                            ir_codegen_options codegen_options,
+                            ir_tuner_options options)
+{
+    /* the database maps the cpu model and signature of layers to the
+     * directives of their fastest schedules. */
+    typedef std::pair<std::string, std::string> key;
+    std::map<key, std::string> database;
+    std::ifstream file(options.database_path);
+    std::string line;
+    for (unsigned line_number = 1; std::getline(file, line); line_number++)
+    {
+        if (line.empty())
+        {
+            continue;
+        }
+
+        std::string::size_type first = line.find('\t'),
+                               second = line.find('\t', first + 1);
+        tcc_assert(second != std::string::npos,
+                   options.database_path + ":" +
+                       std::to_string(line_number) +
+                       ": expected cpu model, signature and schedule.");
+        database[{ line.substr(0, first),
+                   line.substr(first + 1, second - first - 1) }] =
+            line.substr(second + 1);
+    }
+    file.close();
+
+    /* layers are compiled on their own with static storage and weights
+     * embedded into the library. */
+    ir_codegen_options layer_options = codegen_options;
+    layer_options.weights = ir_codegen_options::storage::blob;
+    layer_options.workspace = false;
+    layer_options.max_batch = 0;
+    layer_options.fused_tiling = 0;
+    layer_options.print_fusion = false;
+    layer_options.schedule = ir_schedule();
+
+    std::vector<reduce_expr> layers;
+    std::unordered_set<expr> visited;
+    std::function<void(expr)> collect = [&](expr e) {
+        if (!visited.insert(e).second)
+        {
+            return;
+        }
+        for (expr operand : operands(e))
+        {
+            collect(operand);
+        }
+        if (e->type == exprtype::reduce && e->shape.size() >= 3)
+        {
+            layers.push_back(downcast<reduce>(e));
+        }
+    };
+    collect(ir);
+
+    std::string cpu_model = get_cpu_model();
+    ir_schedule schedule = codegen_options.schedule;
+    bool updated = false;
+    unsigned variant_count = 0;
+    for (reduce_expr r : layers)
+    {
+        if (schedule.stages.find(r) != schedule.stages.end())
+        {
+            continue;
+        }
+
+        reduce_expr layer = extract_layer(r);
+        std::string signature = get_signature(layer, layer_options);
+        key k = { cpu_model, signature };
+        if (database.find(k) == database.end())
+        {
+            std::vector<ir_schedule::stage> variants =
+                enumerate_variants(layer, layer_options);
+            if (variants.size() == 1 ||
+                ir_dep_analysis::apply(layer).inputs.size() > 3)
+            {
+                continue;
+            }
+
+            double best = std::numeric_limits<double>::infinity(),
+                   automatic = best;
+            for (ir_schedule::stage variant : variants)
+            {
+                ir_codegen_options variant_options = layer_options;
+                if (!variant.directives.empty())
+                {
+                    variant_options.schedule[layer] = variant;
+                }
+
+                double time = time_layer(target_name + "_tune" +
+                                             std::to_string(variant_count++),
+                                         layer,
+                                         variant_options,
+                                         options);
+                automatic = variant.directives.empty() ? time : automatic;
+                if (time < best)
+                {
+                    best = time;
+                    database[k] = ir_schedule_parser::to_string(variant);
+                }
+            }
+            tcc_assert(database.find(k) != database.end(),
+                       "failed to compile any variant of " + signature + ".");
+            updated = true;
+            tcc_info("tuned " + signature + " in " + std::to_string(best) +
+                     " us, automatically in " + std::to_string(automatic) +
+                     " us.");
+        }
+
+        if (!database.at(k).empty())
+        {
+            schedule[r] = ir_schedule_parser::parse_stage(
+                database.at(k), options.database_path + ": ");
+        }
+    }
+
+    if (updated && !options.database_path.empty())
+    {
+        std::ofstream out(options.database_path, std::ios::trunc);
+        tcc_assert(out,
+                   "failed to open file at " + options.database_path + ".");
+        for (auto entry : database)
+        {
+            out << entry.first.first << "\t" << entry.first.second << "\t"
+                << entry.second << "\n";
+        }
+    }
+    return schedule;
+}
+
+} // namespace tcc
@@ -8,6 +8,16 @@ expr exp(expr e)
     return unary::make(unary::type::exp, e);
 }
 
+expr sigmoid(expr e)
+{
+    return unary::make(unary::type::sigmoid, e);
+}
+
+expr tanh(expr e)
+{
+    return unary::make(unary::type::tanh, e);
+}
+
 expr operator+(expr lhs, expr rhs)
 {
     return binary::make(binary::type::add, lhs, rhs);
@@ -80,6 +90,39 @@ std::string to_string(exprtype et)
     }
 }
 
+exprs operands(expr e)
+{
+    switch (e->type)
+    {
+        case exprtype::var:
+        case exprtype::cnst:
+        case exprtype::range:
+            return {};
+        case exprtype::index:
+        {
+            index_expr i = downcast<index>(e);
+            exprs x({ i->x });
+            x.insert(x.end(), i->indices.begin(), i->indices.end());
+            return x;
+        }
+        case exprtype::select:
+        {
+            select_expr s = downcast<select>(e);
+            return { s->cond, s->t, s->f };
+        }
+        case exprtype::reshape:
+            return { downcast<reshape>(e)->x };
+        case exprtype::reduce:
+            return { downcast<reduce>(e)->x };
+        case exprtype::unary:
+            return { downcast<unary>(e)->x };
+        case exprtype::binary:
+            return { downcast<binary>(e)->x, downcast<binary>(e)->y };
+        default:
+            tcc_error("unknown exprtype.");
+    }
+}
+
 exprs to_ranges(dimensions shape)
 {
     exprs ranges;
@@ -1,6 +1,8 @@
 #include "tcc/frontend/op.h"
 #include "tcc/common/logging.h"
 #include "tcc/core/ir_util.h"
+#include <algorithm>
+#include <cmath>
 
 namespace tcc {
 
@@ -51,7 +53,7 @@ expr build_avgpool(std::string data_format,
     o_h = (i_h - k_h) / s_h + 1;
     o_w = (i_w - k_w) / s_w + 1;
 
-    exprs i = to_ranges({ i_n, o_h, o_w, k_h, k_h, i_c });
+    exprs i = to_ranges({ i_n, o_h, o_w, k_h, k_w, i_c });
     expr value_frag =
         select::make(i,
                      ((i[1] * cnst::make(s_h) + i[3] >= cnst::make(0l)) &&
@@ -83,16 +85,124 @@ expr build_biasadd(std::string data_format, expr input, expr bias)
     return input + bias;
 }
 
+/* build_winograd_conv2d computes a stride 1, 3x3 convolution with the
+ * input padded by p on each side by winograd's minimal filtering algorithm
+ * f(2x2, 3x3): the output is split into 2x2 tiles, each computed from a 4x4
+ * input tile d and the filter g as a^t [(g g g^t) . (b^t d b)] a. the
+ * transformed filters are precomputed, and the elementwise products of all
+ * tiles are summed over input channels as 16 matrix multiplications. */
+static expr build_winograd_conv2d(expr input, expr filter, dimension p)
+{
+    static const float b_t[4][4] = {
+        { 1, 0, -1, 0 }, { 0, 1, 1, 0 }, { 0, -1, 1, 0 }, { 0, 1, 0, -1 }
+    };
+    static const float g[4][3] = {
+        { 1, 0, 0 }, { 0.5, 0.5, 0.5 }, { 0.5, -0.5, 0.5 }, { 0, 0, 1 }
+    };
+    static const float a_t[2][4] = { { 1, 1, 1, 0 }, { 0, 1, -1, -1 } };
+
+    dimension i_n, i_h, i_w, i_c, o_h, o_w, o_c, t_h, t_w;
+    i_n = input->shape[0];
+    i_h = input->shape[1];
+    i_w = input->shape[2];
+    i_c = input->shape[3];
+    o_h = i_h + 2 * p - 2;
+    o_w = i_w + 2 * p - 2;
+    o_c = filter->shape[3];
+    t_h = (o_h + 1) / 2;
+    t_w = (o_w + 1) / 2;
+
+    /* transformed filters u [4, 4, i_c, o_c]. */
+    std::vector<float> f = downcast<cnst>(filter)->to_vector<float>(),
+                       u(16 * i_c * o_c, 0.0f);
+    for (dimension k = 0; k < 16 * i_c * o_c; k++)
+    {
+        dimension y = k / (4 * i_c * o_c), x = k / (i_c * o_c) % 4,
+                  co = k % (i_c * o_c);
+        for (unsigned a = 0; a < 3; a++)
+        {
+            for (unsigned b = 0; b < 3; b++)
+            {
+                u[k] += g[y][a] * f[(a * 3 + b) * i_c * o_c + co] * g[x][b];
+            }
+        }
+    }
+
+    std::vector<float> b_t_data(&b_t[0][0], &b_t[0][0] + 16), a_t_data;
+    for (unsigned k = 0; k < 16 * 4; k++)
+    {
+        a_t_data.push_back(a_t[k / 32][k / 4 % 4] * a_t[k / 16 % 2][k % 4]);
+    }
+    expr b_t_cnst = cnst::make(b_t_data, { 4, 4 });
+    expr a_t_cnst = cnst::make(a_t_data, { 2, 2, 4, 4 });
+
+    /* rows of the transformed input tiles, b^t d, [i_n, 4, 4, t_h, t_w,
+     * i_c], with the input padded by p on each side and by zeros beyond
+     * the last tile when the output is odd. */
+    exprs i = to_ranges({ i_n, 4, 4, t_h, t_w, i_c, 4 });
+    expr h = i[3] * cnst::make(2l) + i[6] - cnst::make(p),
+         w = i[4] * cnst::make(2l) + i[2] - cnst::make(p);
+    expr rows = reduce::make(
+        reduce::type::sum,
+        { 6 },
+        select::make(i,
+                     (h >= cnst::make(0l)) && (h < cnst::make(i_h)) &&
+                         (w >= cnst::make(0l)) && (w < cnst::make(i_w)),
+                     index::make(i, input, { i[0], h, w, i[5] }),
+                     cnst::make(0.0f)) *
+            index::make(i, b_t_cnst, { i[1], i[6] }));
+
+    /* transformed input tiles, b^t d b, [i_n, 4, 4, t_h, t_w, i_c]. */
+    exprs j = to_ranges({ i_n, 4, 4, t_h, t_w, i_c, 4 });
+    expr tiles = reduce::make(
+        reduce::type::sum,
+        { 6 },
+        index::make(j, rows, { j[0], j[1], j[6], j[3], j[4], j[5] }) *
+            index::make(j, b_t_cnst, { j[2], j[6] }));
+
+    /* elementwise products summed over input channels, [i_n, 4, 4, t_h,
+     * t_w, o_c]. */
+    exprs k = to_ranges({ i_n, 4, 4, t_h, t_w, i_c, o_c });
+    expr products = reduce::make(
+        reduce::type::sum,
+        { 5 },
+        index::make(k, tiles, { k[0], k[1], k[2], k[3], k[4], k[5] }) *
+            index::make(k,
+                        cnst::make(u, { 4, 4, i_c, o_c }),
+                        { k[1], k[2], k[5], k[6] }));
+
+    /* output tiles a^t m a, cropped to the output size. */
+    exprs l = to_ranges({ i_n, o_h, o_w, o_c, 4, 4 });
+    return reduce::make(reduce::type::sum,
+                        { 4, 5 },
+                        index::make(l,
+                                    products,
+                                    { l[0],
+                                      l[4],
+                                      l[5],
+                                      l[1] / cnst::make(2l),
+                                      l[2] / cnst::make(2l),
+                                      l[3] }) *
+                            index::make(l,
+                                        a_t_cnst,
+                                        { l[1] % cnst::make(2l),
+                                          l[2] % cnst::make(2l),
+                                          l[4],
+                                          l[5] }));
+}
+
 expr build_conv2d(std::string data_format,
                   std::string padding,
                   dimensions strides,
                   dimensions dilations,
                   expr input,
-                  expr filter)
+                  expr filter,
+                  conv2d_lowering lowering)
 {
     tcc_assert(data_format == "NHWC",
                data_format + " data format is not supported.");
-    tcc_assert(padding == "SAME", padding + " padding is not supported.");
+    tcc_assert(padding == "SAME" || padding == "VALID",
+               padding + " padding is not supported.");
     tcc_assert(strides.size() == 4 && strides[0] == 1 && strides[3] == 1,
                "strides along batch or channel dimension are not supported.");
     tcc_assert(dilations == dimensions({ 1, 1, 1, 1 }),
@@ -116,42 +226,92 @@ expr build_conv2d(std::string data_format,
 
     tcc_assert(f_h % 2 == 1 && f_w % 2 == 1, "filter dimensions are not even.");
 
-    dimension s_h, s_w, p_h, p_w;
+    dimension s_h, s_w;
     s_h = strides[1];
     s_w = strides[2];
-    p_h = f_h / 2;
-    p_w = f_w / 2;
 
-    tcc_assert(i_n == 1, "batched input is not supported.");
     tcc_assert(f_h <= i_h && f_w <= i_w, "invalid filter size.");
     tcc_assert(i_c == f_c,
                "channel dimensions of input and filter do not agree.");
 
     dimension o_n, o_h, o_w, o_c;
     o_n = i_n;
-    o_h = (i_h + p_h * 2 - f_h) / s_h + 1;
-    o_w = (i_w + p_w * 2 - f_w) / s_w + 1;
+    o_h = padding == "SAME" ? (i_h + s_h - 1) / s_h : (i_h - f_h) / s_h + 1;
+    o_w = padding == "SAME" ? (i_w + s_w - 1) / s_w : (i_w - f_w) / s_w + 1;
     o_c = f_n;
 
-    exprs i = to_ranges({ o_n, o_h, o_w, f_h, f_w, f_c, o_c });
-    expr input_frag = select::make(
-        i,
-        ((i[1] * cnst::make(s_h) + i[3] - cnst::make(p_h) * cnst::make(2l) >=
-          cnst::make(0l)) &&
-         (i[1] * cnst::make(s_h) + i[3] - cnst::make(p_h) * cnst::make(2l) <
-          cnst::make(i_h)) &&
-         (i[2] * cnst::make(s_w) + i[4] - cnst::make(p_w) * cnst::make(2l) >=
-          cnst::make(0l)) &&
-         (i[2] * cnst::make(s_w) + i[4] - cnst::make(p_w) * cnst::make(2l) <
-          cnst::make(i_w))),
-        index::make(
+    /* a pointwise convolution needs no padding and multiplies the strided
+     * input, a row major [o_n * o_h * o_w, i_c] matrix, with the filter as
+     * a [f_c, o_c] matrix, regardless of lowering. */
+    if (f_h == 1 && f_w == 1)
+    {
+        if (s_h != 1 || s_w != 1)
+        {
+            exprs i = to_ranges({ o_n, o_h, o_w, i_c });
+            input = index::make(i,
+                                input,
+                                { i[0],
+                                  i[1] * cnst::make(s_h),
+                                  i[2] * cnst::make(s_w),
+                                  i[3] });
+        }
+
+        exprs j = to_ranges({ o_n, o_h, o_w, f_c, o_c });
+        return reduce::make(
+            reduce::type::sum,
+            { 3 },
+            index::make(j, input, { j[0], j[1], j[2], j[3] }) *
+                reshape::make({ f_c, o_c }, filter));
+    }
+
+    if (lowering == conv2d_lowering::winograd && f_h == 3 && f_w == 3 &&
+        s_h == 1 && s_w == 1 && filter->type == exprtype::cnst)
+    {
+        return build_winograd_conv2d(
+            input, filter, padding == "SAME" ? 1 : 0);
+    }
+
+    /* same padding pads the input evenly, with the odd row or column at
+     * the bottom or right; valid padding reads the input only. */
+    dimension p_h, p_w;
+    p_h = std::max((o_h - 1) * s_h + f_h - i_h, dimension(0)) / 2;
+    p_w = std::max((o_w - 1) * s_w + f_w - i_w, dimension(0)) / 2;
+
+    /* the gemm lowering stores the input fragments as an im2col buffer of
+     * shape [o_n, o_h, o_w, f_h, f_w, f_c], a row major matrix that is
+     * multiplied with the filter, a row major [f_h * f_w * f_c, o_c] matrix. */
+    exprs i = lowering == conv2d_lowering::gemm
+                  ? to_ranges({ o_n, o_h, o_w, f_h, f_w, f_c })
+                  : to_ranges({ o_n, o_h, o_w, f_h, f_w, f_c, o_c });
+    expr input_frag =
+        index::make(i,
+                    input,
+                    { i[0],
+                      i[1] * cnst::make(s_h) + i[3] - cnst::make(p_h),
+                      i[2] * cnst::make(s_w) + i[4] - cnst::make(p_w),
+                      i[5] });
+    if (padding == "SAME")
+    {
+        input_frag = select::make(
             i,
-            input,
-            { i[0],
-              i[1] * cnst::make(s_h) + i[3] - cnst::make(p_h) * cnst::make(2l),
-              i[2] * cnst::make(s_w) + i[4] - cnst::make(p_w) * cnst::make(2l),
-              i[5] }),
-        cnst::make(0.0f));
+            ((i[1] * cnst::make(s_h) + i[3] - cnst::make(p_h) >=
+              cnst::make(0l)) &&
+             (i[1] * cnst::make(s_h) + i[3] - cnst::make(p_h) <
+              cnst::make(i_h)) &&
+             (i[2] * cnst::make(s_w) + i[4] - cnst::make(p_w) >=
+              cnst::make(0l)) &&
+             (i[2] * cnst::make(s_w) + i[4] - cnst::make(p_w) <
+              cnst::make(i_w))),
+            input_frag,
+            cnst::make(0.0f));
+    }
+
+    if (lowering == conv2d_lowering::gemm)
+    {
+        exprs j = to_ranges({ o_n, o_h, o_w, f_h, f_w, f_c, o_c });
+        input_frag = index::make(
+            j, input_frag, { j[0], j[1], j[2], j[3], j[4], j[5] });
+    }
 
     return reduce::make(reduce::type::sum, { 3, 4, 5 }, input_frag * filter);
 }
@@ -189,43 +349,55 @@ expr build_depthwiseconv2dnative(std::string data_format,
 
     tcc_assert(f_h % 2 == 1 && f_w % 2 == 1, "filter dimensions are not even.");
 
-    dimension s_h, s_w, p_h, p_w;
+    dimension s_h, s_w;
     s_h = strides[1];
     s_w = strides[2];
-    p_h = f_h / 2;
-    p_w = f_w / 2;
 
-    tcc_assert(i_n == 1, "batched input is not supported.");
     tcc_assert(f_h <= i_h && f_w <= i_w, "invalid filter size.");
     tcc_assert(i_c == f_c,
                "channel dimensions of input and filter do not agree.");
 
     dimension o_n, o_h, o_w, o_c;
     o_n = i_n;
-    o_h = (i_h + p_h * 2 - f_h) / s_h + 1;
-    o_w = (i_w + p_w * 2 - f_w) / s_w + 1;
+    o_h = (i_h + s_h - 1) / s_h;
+    o_w = (i_w + s_w - 1) / s_w;
     o_c = f_n * f_c;
 
-    exprs i = to_ranges({ o_n, o_h, o_w, f_h, f_w, f_c, f_n });
+    /* same padding pads the input evenly, with the odd row or column at
+     * the bottom or right. */
+    dimension p_h, p_w;
+    p_h = std::max((o_h - 1) * s_h + f_h - i_h, dimension(0)) / 2;
+    p_w = std::max((o_w - 1) * s_w + f_w - i_w, dimension(0)) / 2;
+
+    /* channels, and for a channel multiplier above one the multiplier, are
+     * the innermost dimensions, so that codegen keeps them vectorized. a
+     * multiplier of one needs no reshape of the result. */
+    exprs i = f_n == 1 ? to_ranges({ o_n, o_h, o_w, f_h, f_w, f_c })
+                       : to_ranges({ o_n, o_h, o_w, f_h, f_w, f_c, f_n });
     expr input_frag = select::make(
         i,
-        ((i[1] * cnst::make(s_h) + i[3] - cnst::make(p_h) * cnst::make(2l) >=
-          cnst::make(0l)) &&
-         (i[1] * cnst::make(s_h) + i[3] - cnst::make(p_h) * cnst::make(2l) <
-          cnst::make(i_h)) &&
-         (i[2] * cnst::make(s_w) + i[4] - cnst::make(p_w) * cnst::make(2l) >=
-          cnst::make(0l)) &&
-         (i[2] * cnst::make(s_w) + i[4] - cnst::make(p_w) * cnst::make(2l) <
-          cnst::make(i_w))),
+        ((i[1] * cnst::make(s_h) + i[3] - cnst::make(p_h) >= cnst::make(0l)) &&
+         (i[1] * cnst::make(s_h) + i[3] - cnst::make(p_h) < cnst::make(i_h)) &&
+         (i[2] * cnst::make(s_w) + i[4] - cnst::make(p_w) >= cnst::make(0l)) &&
+         (i[2] * cnst::make(s_w) + i[4] - cnst::make(p_w) < cnst::make(i_w))),
         index::make(
             i,
             input,
             { i[0],
-              i[1] * cnst::make(s_h) + i[3] - cnst::make(p_h) * cnst::make(2l),
-              i[2] * cnst::make(s_w) + i[4] - cnst::make(p_w) * cnst::make(2l),
+              i[1] * cnst::make(s_h) + i[3] - cnst::make(p_h),
+              i[2] * cnst::make(s_w) + i[4] - cnst::make(p_w),
               i[5] }),
         cnst::make(0.0f));
 
+    if (f_n == 1)
+    {
+        return reduce::make(
+            reduce::type::sum,
+            { 3, 4 },
+            input_frag *
+                index::make(i, filter, { i[3], i[4], i[5], cnst::make(0l) }));
+    }
+
     return reshape::make(
         { o_n, o_h, o_w, o_c },
         reduce::make(reduce::type::sum, { 3, 4 }, input_frag * filter));
@@ -256,8 +428,29 @@ expr build_fusedbatchnorm(float epsilon,
     tcc_assert(
         variance->shape.size() == 1 && variance->shape[0] == x->shape[3],
         "dimension of variance do not agree with channel dimension of x.");
+    tcc_assert(scale->type == exprtype::cnst &&
+                   offset->type == exprtype::cnst &&
+                   mean->type == exprtype::cnst &&
+                   variance->type == exprtype::cnst,
+               "non-constant batch normalization parameters are not "
+               "supported.");
+
+    /* scale / sqrt(variance + epsilon) and offset - mean * multiplier are
+     * precomputed, leaving a multiply and an add per element. */
+    std::vector<float> s = downcast<cnst>(scale)->to_vector<float>();
+    std::vector<float> o = downcast<cnst>(offset)->to_vector<float>();
+    std::vector<float> m = downcast<cnst>(mean)->to_vector<float>();
+    std::vector<float> v = downcast<cnst>(variance)->to_vector<float>();
+
+    std::vector<float> multiplier, bias;
+    for (unsigned c = 0; c < s.size(); c++)
+    {
+        multiplier.push_back(s[c] / std::sqrt(v[c] + epsilon));
+        bias.push_back(o[c] - m[c] * multiplier.back());
+    }
 
-    return ((x - mean) / (variance + cnst::make(epsilon))) * scale + offset;
+    return x * cnst::make(multiplier, scale->shape) +
+           cnst::make(bias, offset->shape);
 }
 
 expr build_relu6(expr features)
@@ -281,14 +474,14 @@ expr build_reshape(expr tensor, expr shape)
     {
         for (dimension dim : downcast<cnst>(shape)->to_vector<dimension>())
         {
-            to_shape.push_back(dim < 0 ? 1 : static_cast<dimension>(dim));
+            to_shape.push_back(static_cast<dimension>(dim));
         }
     }
     else if (shape->dtype == datatype::INT32)
     {
         for (int32_t dim : downcast<cnst>(shape)->to_vector<int32_t>())
         {
-            to_shape.push_back(dim < 0 ? 1 : static_cast<dimension>(dim));
+            to_shape.push_back(static_cast<dimension>(dim));
         }
     }
     else
@@ -296,6 +489,28 @@ expr build_reshape(expr tensor, expr shape)
         tcc_error("dtype of shape is unsupported.");
     }
 
+    /* a dimension of -1 is inferred from the size of tensor. */
+    dimension known_size = 1;
+    int inferred_dim = -1;
+    for (unsigned i = 0; i < to_shape.size(); i++)
+    {
+        if (to_shape[i] < 0)
+        {
+            tcc_assert(inferred_dim < 0, "more than one dimension is -1.");
+            inferred_dim = i;
+        }
+        else
+        {
+            known_size *= to_shape[i];
+        }
+    }
+    if (inferred_dim >= 0)
+    {
+        tcc_assert(known_size > 0 && tensor->size() % known_size == 0,
+                   "shape is incompatible with size of tensor.");
+        to_shape[inferred_dim] = tensor->size() / known_size;
+    }
+
     return reshape::make(to_shape, tensor);
 }
 
@@ -305,14 +520,20 @@ expr build_shape(expr input)
     return cnst::make(input->shape);
 }
 
+expr build_sigmoid(expr x)
+{
+    tcc_assert_not_null(x);
+    return sigmoid(x);
+}
+
 expr build_softmax(expr logits)
 {
     tcc_assert_not_null(logits);
     tcc_assert_size_eq(logits->shape, 2);
 
     exprs i = to_ranges(logits->shape);
-    expr mx = reduce::make(reduce::type::max, { 0, 1 }, logits);
-    expr de = exp(logits - mx);
+    expr mx = reduce::make(reduce::type::max, { 1 }, logits);
+    expr de = exp(logits - index::make(i, mx, { i[0] }));
     expr sm = reduce::make(reduce::type::sum, { 1 }, de);
     return de / index::make(i, sm, { i[0] });
 }
@@ -342,4 +563,43 @@ expr build_squeeze(dimensions squeeze_dims, expr input)
     return reshape::make(squeezed_shape, input);
 }
 
+expr build_tanh(expr x)
+{
+    tcc_assert_not_null(x);
+    return tanh(x);
+}
+
+expr build_transpose(expr x, expr perm)
+{
+    tcc_assert_not_null(x);
+    tcc_assert_not_null(perm);
+    tcc_assert(perm->type == exprtype::cnst && perm->dtype == datatype::INT32,
+               "perm is not an INT32 cnst.");
+    tcc_assert_size_eq(perm->shape, 1);
+    tcc_assert(perm->shape[0] == static_cast<dimension>(x->shape.size()),
+               "perm does not agree with rank of x.");
+
+    /* dimension i of the output is dimension perm[i] of x. */
+    std::vector<int32_t> p = downcast<cnst>(perm)->to_vector<int32_t>();
+    dimensions shape;
+    for (int32_t dim : p)
+    {
+        tcc_assert(dim >= 0 && dim < static_cast<int32_t>(x->shape.size()),
+                   "perm dim is out of bound.");
+        shape.push_back(x->shape[dim]);
+    }
+
+    exprs i = to_ranges(shape), indices(x->shape.size());
+    for (unsigned dim = 0; dim < p.size(); dim++)
+    {
+        indices[p[dim]] = i[dim];
+    }
+    for (expr index : indices)
+    {
+        tcc_assert_not_null(index);
+    }
+
+    return index::make(i, x, indices);
+}
+
 } // namespace tcc
@@ -2,7 +2,10 @@
 #include "proto/graph.pb.h"
 #include "tcc/common/logging.h"
 #include "tcc/frontend/op.h"
+#include <cmath>
+#include <cstring>
 #include <fstream>
+#include <functional>
 
 namespace tcc {
 
@@ -144,7 +147,8 @@ static dimensions parse_attr_int_vec(
 static void parse_node(
     tensorflow::NodeDef& node,
     std::unordered_map<std::string, expr>& parsed_nodes,
-    std::unordered_map<std::string, dimensions>& input_shapes)
+    std::unordered_map<std::string, dimensions>& input_shapes,
+    conv2d_lowering lowering)
 {
     expr output;
 
@@ -211,7 +215,7 @@ static void parse_node(
         expr filter = parsed_nodes.at(node.input()[1]);
 
         output = build_conv2d(
-            data_format, padding, strides, dilations, input, filter);
+            data_format, padding, strides, dilations, input, filter, lowering);
     }
     else if (node.op() == "DepthwiseConv2dNative")
     {
@@ -267,6 +271,14 @@ static void parse_node(
 
         output = build_shape(input);
     }
+    else if (node.op() == "Sigmoid")
+    {
+        tcc_assert_size_eq(node.input(), 1);
+
+        expr x = parsed_nodes.at(node.input()[0]);
+
+        output = build_sigmoid(x);
+    }
     else if (node.op() == "Softmax")
     {
         tcc_assert_size_eq(node.input(), 1);
@@ -285,6 +297,23 @@ static void parse_node(
 
         output = build_squeeze(squeeze_dims, input);
     }
+    else if (node.op() == "Tanh")
+    {
+        tcc_assert_size_eq(node.input(), 1);
+
+        expr x = parsed_nodes.at(node.input()[0]);
+
+        output = build_tanh(x);
+    }
+    else if (node.op() == "Transpose")
+    {
+        tcc_assert_size_eq(node.input(), 2);
+
+        expr x = parsed_nodes.at(node.input()[0]);
+        expr perm = parsed_nodes.at(node.input()[1]);
+
+        output = build_transpose(x, perm);
+    }
     else
     {
         tcc_error("unsupported tensorflow op " + node.op() + ".");
@@ -296,12 +325,271 @@ static void parse_node(
     parsed_nodes.insert({ node.name(), output });
 }
 
+static std::vector<float> parse_const_floats(tensorflow::NodeDef& node)
+{
+    tcc_assert(node.op() == "Const", node.name() + " is not a Const node.");
+    tcc_assert(parse_tensor_dtype(node.attr()) == datatype::FP32,
+               "dtype of " + node.name() + " is not FP32.");
+
+    const std::string data = parse_tensor_data(node.attr());
+    std::vector<float> values(data.size() / sizeof(float));
+    std::memcpy(values.data(), data.data(), values.size() * sizeof(float));
+    return values;
+}
+
+static void set_const_floats(tensorflow::NodeDef& node,
+                             std::vector<float>& values)
+{
+    (*node.mutable_attr())["value"].mutable_tensor()->set_tensor_content(
+        std::string(reinterpret_cast<const char*>(values.data()),
+                    values.size() * sizeof(float)));
+}
+
+/* fold_batchnorm folds FusedBatchNorm nodes that follow a Conv2D or
+ * DepthwiseConv2dNative node, directly or through a BiasAdd node, into new
+ * filter and bias Const nodes:
+ *
+ *     multiplier = scale / sqrt(variance + epsilon)
+ *     filter' = filter * multiplier
+ *     bias' = (bias - mean) * multiplier + offset
+ *
+ * the FusedBatchNorm node is replaced by a BiasAdd node of the same name.
+ * output channels are the innermost dimensions of both filter layouts. */
+static void fold_batchnorm(
+    std::unordered_map<std::string, tensorflow::NodeDef>& nodes)
+{
+    std::unordered_map<std::string, int> consumers;
+    std::vector<std::string> batchnorm_names;
+    for (auto& node : nodes)
+    {
+        for (std::string input_name : node.second.input())
+        {
+            consumers[input_name]++;
+        }
+        if (node.second.op() == "FusedBatchNorm")
+        {
+            batchnorm_names.push_back(node.first);
+        }
+    }
+
+    for (std::string batchnorm_name : batchnorm_names)
+    {
+        tensorflow::NodeDef& batchnorm = nodes.at(batchnorm_name);
+        tcc_assert_size_eq(batchnorm.input(), 5);
+
+        std::string conv_name = batchnorm.input()[0];
+        std::string biasadd_name;
+        if (nodes.at(conv_name).op() == "BiasAdd" &&
+            consumers[conv_name] == 1 &&
+            nodes.at(nodes.at(conv_name).input()[1]).op() == "Const")
+        {
+            biasadd_name = conv_name;
+            conv_name = nodes.at(biasadd_name).input()[0];
+        }
+
+        tensorflow::NodeDef& conv = nodes.at(conv_name);
+        if ((conv.op() != "Conv2D" && conv.op() != "DepthwiseConv2dNative") ||
+            consumers[conv_name] != 1 ||
+            nodes.at(conv.input()[1]).op() != "Const")
+        {
+            continue;
+        }
+
+        bool constant_params = true;
+        for (int i = 1; i < 5; i++)
+        {
+            constant_params &= nodes.at(batchnorm.input()[i]).op() == "Const";
+        }
+        if (!constant_params)
+        {
+            continue;
+        }
+
+        float epsilon = parse_attr_float(batchnorm.attr(), "epsilon");
+        std::vector<float> scale =
+            parse_const_floats(nodes.at(batchnorm.input()[1]));
+        std::vector<float> offset =
+            parse_const_floats(nodes.at(batchnorm.input()[2]));
+        std::vector<float> mean =
+            parse_const_floats(nodes.at(batchnorm.input()[3]));
+        std::vector<float> variance =
+            parse_const_floats(nodes.at(batchnorm.input()[4]));
+        std::vector<float> filter =
+            parse_const_floats(nodes.at(conv.input()[1]));
+        std::vector<float> bias =
+            biasadd_name.empty()
+                ? std::vector<float>(scale.size(), 0.f)
+                : parse_const_floats(
+                      nodes.at(nodes.at(biasadd_name).input()[1]));
+
+        size_t channels = scale.size();
+        tcc_assert(offset.size() == channels && mean.size() == channels &&
+                       variance.size() == channels &&
+                       bias.size() == channels &&
+                       filter.size() % channels == 0,
+                   "dimensions of " + batchnorm_name + " do not agree.");
+
+        std::vector<float> multiplier;
+        for (size_t c = 0; c < channels; c++)
+        {
+            multiplier.push_back(scale[c] / std::sqrt(variance[c] + epsilon));
+            bias[c] = (bias[c] - mean[c]) * multiplier[c] + offset[c];
+        }
+        for (size_t i = 0; i < filter.size(); i++)
+        {
+            filter[i] *= multiplier[i % channels];
+        }
+
+        tensorflow::NodeDef folded_filter = nodes.at(conv.input()[1]);
+        folded_filter.set_name(batchnorm_name + "/folded_filter");
+        set_const_floats(folded_filter, filter);
+
+        tensorflow::NodeDef folded_bias = nodes.at(batchnorm.input()[2]);
+        folded_bias.set_name(batchnorm_name + "/folded_bias");
+        set_const_floats(folded_bias, bias);
+
+        conv.set_input(1, folded_filter.name());
+
+        tensorflow::NodeDef biasadd;
+        biasadd.set_name(batchnorm_name);
+        biasadd.set_op("BiasAdd");
+        biasadd.add_input(conv_name);
+        biasadd.add_input(folded_bias.name());
+        (*biasadd.mutable_attr())["data_format"] =
+            batchnorm.attr().at("data_format");
+
+        nodes.insert({ folded_filter.name(), folded_filter });
+        nodes.insert({ folded_bias.name(), folded_bias });
+        nodes.at(batchnorm_name) = biasadd;
+    }
+}
+
+/* assign_layout keeps activations of graphs with NCHW ops in the NHWC
+ * layout, whose innermost channels are vectorized by codegen. ops with a
+ * data_format attribute are rewritten to NHWC and elementwise ops keep the
+ * layout of their inputs, so that activations are transposed only where
+ * they enter from NCHW inputs and where they reach the output or ops that
+ * depend on the NCHW layout, such as Reshape. returns the name of the output
+ * node, which is a new Transpose node if the output is transposed. */
+static std::string assign_layout(
+    std::unordered_map<std::string, tensorflow::NodeDef>& nodes,
+    std::string output_name)
+{
+    /* names of nodes computing NCHW tensors of the graph in NHWC. */
+    std::unordered_set<std::string> transposed;
+    std::unordered_set<std::string> visited;
+
+    std::function<std::string(std::string, bool)> transpose =
+        [&](std::string input_name, bool to_nhwc) {
+            std::string name = input_name + (to_nhwc ? "/to_nhwc" : "/to_nchw");
+            if (nodes.find(name) != nodes.end())
+            {
+                return name;
+            }
+
+            std::vector<int32_t> perm = { 0, 3, 1, 2 };
+            if (to_nhwc)
+            {
+                perm = { 0, 2, 3, 1 };
+            }
+            tensorflow::NodeDef perm_node;
+            perm_node.set_name(name + "/perm");
+            perm_node.set_op("Const");
+            tensorflow::TensorProto* tensor =
+                (*perm_node.mutable_attr())["value"].mutable_tensor();
+            tensor->set_dtype(tensorflow::DT_INT32);
+            tensor->mutable_tensor_shape()->add_dim()->set_size(perm.size());
+            tensor->set_tensor_content(
+                std::string(reinterpret_cast<const char*>(perm.data()),
+                            perm.size() * sizeof(int32_t)));
+
+            tensorflow::NodeDef transpose_node;
+            transpose_node.set_name(name);
+            transpose_node.set_op("Transpose");
+            transpose_node.add_input(input_name);
+            transpose_node.add_input(perm_node.name());
+
+            nodes.insert({ perm_node.name(), perm_node });
+            nodes.insert({ name, transpose_node });
+            return name;
+        };
+
+    std::function<void(std::string)> assign = [&](std::string name) {
+        if (!visited.insert(name).second)
+        {
+            return;
+        }
+
+        tcc_assert_has_key(nodes, name);
+        for (std::string input_name : nodes.at(name).input())
+        {
+            assign(input_name);
+        }
+
+        tensorflow::NodeDef& node = nodes.at(name);
+        bool elementwise = node.op() == "Add" || node.op() == "Relu6" ||
+                           node.op() == "Sigmoid" || node.op() == "Tanh";
+        bool all_transposed = true;
+        for (std::string input_name : node.input())
+        {
+            all_transposed &= transposed.count(input_name) > 0;
+        }
+
+        if (node.attr().count("data_format") &&
+            node.attr().at("data_format").s() == "NCHW")
+        {
+            if (!transposed.count(node.input()[0]))
+            {
+                node.set_input(0, transpose(node.input()[0], true));
+            }
+
+            (*node.mutable_attr())["data_format"].set_s("NHWC");
+            for (std::string attr_name : { "strides", "ksize", "dilations" })
+            {
+                if (!node.attr().count(attr_name))
+                {
+                    continue;
+                }
+                dimensions values = parse_attr_int_vec(node.attr(), attr_name);
+                tcc_assert_size_eq(values, 4);
+                tensorflow::AttrValue_ListValue* list =
+                    (*node.mutable_attr())[attr_name].mutable_list();
+                list->clear_i();
+                for (unsigned dim : { 0, 2, 3, 1 })
+                {
+                    list->add_i(values[dim]);
+                }
+            }
+            transposed.insert(name);
+        }
+        else if (elementwise && all_transposed)
+        {
+            transposed.insert(name);
+        }
+        else
+        {
+            for (int i = 0; i < node.input_size(); i++)
+            {
+                if (transposed.count(node.input()[i]))
+                {
+                    node.set_input(i, transpose(node.input()[i], false));
+                }
+            }
+        }
+    };
+
+    assign(output_name);
+    return transposed.count(output_name) ? transpose(output_name, false)
+                                         : output_name;
+}
+
 static void recurse_graph(
     std::string current_node_name,
     std::unordered_map<std::string, tensorflow::NodeDef>& nodes,
     std::unordered_set<std::string>& traversed,
     std::unordered_map<std::string, expr>& parsed_nodes,
-    std::unordered_map<std::string, dimensions>& input_shapes)
+    std::unordered_map<std::string, dimensions>& input_shapes,
+    conv2d_lowering lowering)
 {
     if (traversed.find(current_node_name) == traversed.end())
     {
@@ -314,18 +602,23 @@ static void recurse_graph(
          * reaches base case when there is no inputs to the current node. */
         for (std::string input_node_name : current_node.input())
         {
-            recurse_graph(
-                input_node_name, nodes, traversed, parsed_nodes, input_shapes);
+            recurse_graph(input_node_name,
+                          nodes,
+                          traversed,
+                          parsed_nodes,
+                          input_shapes,
+                          lowering);
             tcc_assert_has_key(parsed_nodes, input_node_name);
         }
 
-        parse_node(current_node, parsed_nodes, input_shapes);
+        parse_node(current_node, parsed_nodes, input_shapes, lowering);
     }
 }
 
 static expr parse_graph(
     tensorflow::GraphDef& graph,
-    std::unordered_map<std::string, dimensions>& input_shapes)
+    std::unordered_map<std::string, dimensions>& input_shapes,
+    conv2d_lowering lowering)
 {
     /* collect all tensorflow nodes into hashtable and
      * find output nodes of the tensorflow graph. */
@@ -354,21 +647,28 @@ static expr parse_graph(
                "supported.");
     std::string output_name = *output_names.begin();
 
+    /* rewrite the graph before parsing; nodes that are no longer
+     * reachable from the output are not parsed. */
+    fold_batchnorm(nodes);
+    output_name = assign_layout(nodes, output_name);
+
     /* recurively traverse the tensorflow graph and
      * parse each tensorflow node into core. */
     std::unordered_set<std::string> traversed;
     std::unordered_map<std::string, expr> parsed_nodes;
-    recurse_graph(output_name, nodes, traversed, parsed_nodes, input_shapes);
+    recurse_graph(
+        output_name, nodes, traversed, parsed_nodes, input_shapes, lowering);
 
     tcc_assert_has_key(parsed_nodes, output_name);
     return parsed_nodes.at(output_name);
 }
 
 expr parse(const std::string input_path,
-           std::unordered_map<std::string, dimensions>& input_shapes)
+           std::unordered_map<std::string, dimensions>& input_shapes,
+           conv2d_lowering lowering)
 {
     tensorflow::GraphDef graph = load_graph(input_path);
-    return parse_graph(graph, input_shapes);
+    return parse_graph(graph, input_shapes, lowering);
 }
 
 } // namespace tcc
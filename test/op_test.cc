@@ -1,11 +1,25 @@
+#include "proto/graph.pb.h"
 #include "tcc/common/logging.h"
 #include "tcc/core/ir_codegen.h"
+#include "tcc/core/ir_mem_planner.h"
 #include "tcc/core/ir_printer.h"
+#include "tcc/core/ir_tuner.h"
+#include "tcc/core/ir_util.h"
 #include "tcc/frontend/op.h"
+#include "tcc/frontend/parser.h"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <dlfcn.h>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <random>
 #include <sys/stat.h>
+#include <thread>
 
 static tcc::expr util_generate_cnst(tcc::dimensions shape)
 {
@@ -14,7 +28,190 @@ static tcc::expr util_generate_cnst(tcc::dimensions shape)
     return tcc::cnst::make(std::vector<float>(size, 1.f), shape);
 }
 
-static void* util_compile_expr(std::string target_name, tcc::expr e)
+/* util_generate_random_values returns size values uniformly distributed in
+ * [-1, 1), which are the same on every run. */
+static std::vector<float> util_generate_random_values(tcc::dimension size)
+{
+    static std::mt19937 generator(0);
+    std::uniform_real_distribution<float> distribution(-1.f, 1.f);
+    std::vector<float> values(size);
+    for (float& value : values)
+        value = distribution(generator);
+    return values;
+}
+
+/* util_conv2d returns the convolution of input [n, h, w, c] with filter
+ * [k_h, k_w, c, o], with same padding unless valid is set. */
+static std::vector<float> util_conv2d(std::vector<float> input,
+                                      tcc::dimensions input_shape,
+                                      std::vector<float> filter,
+                                      tcc::dimensions filter_shape,
+                                      tcc::dimension stride,
+                                      bool valid = false)
+{
+    tcc::dimension n = input_shape[0], h = input_shape[1], w = input_shape[2],
+                   c = input_shape[3], k_h = filter_shape[0],
+                   k_w = filter_shape[1], o = filter_shape[3];
+    tcc::dimension o_h = valid ? (h - k_h) / stride + 1
+                               : (h + stride - 1) / stride,
+                   o_w = valid ? (w - k_w) / stride + 1
+                               : (w + stride - 1) / stride;
+    tcc::dimension p_h = std::max((o_h - 1) * stride + k_h - h,
+                                  tcc::dimension(0)) / 2,
+                   p_w = std::max((o_w - 1) * stride + k_w - w,
+                                  tcc::dimension(0)) / 2;
+
+    std::vector<float> output(n * o_h * o_w * o);
+    for (tcc::dimension b = 0; b < n; b++)
+        for (tcc::dimension y = 0; y < o_h; y++)
+            for (tcc::dimension x = 0; x < o_w; x++)
+                for (tcc::dimension f = 0; f < o; f++)
+                {
+                    double sum = 0;
+                    for (tcc::dimension i = 0; i < k_h; i++)
+                        for (tcc::dimension j = 0; j < k_w; j++)
+                        {
+                            tcc::dimension iy = y * stride + i - p_h,
+                                           ix = x * stride + j - p_w;
+                            if (iy < 0 || iy >= h || ix < 0 || ix >= w)
+                                continue;
+                            for (tcc::dimension k = 0; k < c; k++)
+                                sum += input[((b * h + iy) * w + ix) * c + k] *
+                                       filter[((i * k_w + j) * c + k) * o + f];
+                        }
+                    output[((b * o_h + y) * o_w + x) * o + f] = sum;
+                }
+    return output;
+}
+
+/* util_depthwise_conv2d returns the depthwise convolution of input
+ * [n, h, w, c] with filter [k_h, k_w, c, m], whose output channel c * m + q
+ * is channel c filtered by multiplier q, with same padding unless valid is
+ * set. */
+static std::vector<float> util_depthwise_conv2d(std::vector<float> input,
+                                                tcc::dimensions input_shape,
+                                                std::vector<float> filter,
+                                                tcc::dimensions filter_shape,
+                                                tcc::dimension stride,
+                                                bool valid = false)
+{
+    tcc::dimension n = input_shape[0], h = input_shape[1], w = input_shape[2],
+                   c = input_shape[3], k_h = filter_shape[0],
+                   k_w = filter_shape[1], m = filter_shape[3];
+    tcc::dimension o_h = valid ? (h - k_h) / stride + 1
+                               : (h + stride - 1) / stride,
+                   o_w = valid ? (w - k_w) / stride + 1
+                               : (w + stride - 1) / stride;
+    tcc::dimension p_h = std::max((o_h - 1) * stride + k_h - h,
+                                  tcc::dimension(0)) / 2,
+                   p_w = std::max((o_w - 1) * stride + k_w - w,
+                                  tcc::dimension(0)) / 2;
+
+    std::vector<float> output(n * o_h * o_w * c * m);
+    for (tcc::dimension b = 0; b < n; b++)
+        for (tcc::dimension y = 0; y < o_h; y++)
+            for (tcc::dimension x = 0; x < o_w; x++)
+                for (tcc::dimension k = 0; k < c; k++)
+                    for (tcc::dimension q = 0; q < m; q++)
+                    {
+                        double sum = 0;
+                        for (tcc::dimension i = 0; i < k_h; i++)
+                            for (tcc::dimension j = 0; j < k_w; j++)
+                            {
+                                tcc::dimension iy = y * stride + i - p_h,
+                                               ix = x * stride + j - p_w;
+                                if (iy < 0 || iy >= h || ix < 0 || ix >= w)
+                                    continue;
+                                sum +=
+                                    input[((b * h + iy) * w + ix) * c + k] *
+                                    filter[((i * k_w + j) * c + k) * m + q];
+                            }
+                        output[(((b * o_h + y) * o_w + x) * c + k) * m + q] =
+                            sum;
+                    }
+    return output;
+}
+
+/* util_assert_near asserts that actual agrees with expected within
+ * tolerance, relative to the magnitude of expected. */
+static void util_assert_near(const float* actual,
+                             std::vector<float> expected,
+                             float tolerance,
+                             std::string message)
+{
+    for (size_t i = 0; i < expected.size(); i++)
+        tcc_assert(std::fabs(actual[i] - expected[i]) <=
+                       tolerance * (1 + std::fabs(expected[i])),
+                   message + " at " + std::to_string(i) + ": " +
+                       std::to_string(actual[i]) + " instead of " +
+                       std::to_string(expected[i]) + ".");
+}
+
+/* util_add_node adds a node named name of op reading inputs to graph. */
+static tensorflow::NodeDef* util_add_node(tensorflow::GraphDef& graph,
+                                          std::string name,
+                                          std::string op,
+                                          std::vector<std::string> inputs = {})
+{
+    tensorflow::NodeDef* node = graph.add_node();
+    node->set_name(name);
+    node->set_op(op);
+    for (std::string input : inputs)
+        node->add_input(input);
+    return node;
+}
+
+/* util_add_const adds a Const node of FP32 values to graph. */
+static void util_add_const(tensorflow::GraphDef& graph,
+                           std::string name,
+                           std::vector<float> values,
+                           tcc::dimensions shape)
+{
+    tensorflow::TensorProto* tensor =
+        (*util_add_node(graph, name, "Const")->mutable_attr())["value"]
+            .mutable_tensor();
+    tensor->set_dtype(tensorflow::DT_FLOAT);
+    for (tcc::dimension dim : shape)
+        tensor->mutable_tensor_shape()->add_dim()->set_size(dim);
+    tensor->set_tensor_content(std::string(
+        reinterpret_cast<const char*>(values.data()),
+        values.size() * sizeof(float)));
+}
+
+/* util_set_attr sets the string or integer list attribute name of node. */
+static void util_set_attr(tensorflow::NodeDef* node,
+                          std::string name,
+                          std::string value)
+{
+    (*node->mutable_attr())[name].set_s(value);
+}
+
+static void util_set_attr(tensorflow::NodeDef* node,
+                          std::string name,
+                          tcc::dimensions values)
+{
+    for (tcc::dimension value : values)
+        (*node->mutable_attr())[name].mutable_list()->add_i(value);
+}
+
+/* util_parse_graph writes graph to <target_name>.pb and parses it. */
+static tcc::expr util_parse_graph(
+    std::string target_name,
+    tensorflow::GraphDef graph,
+    std::unordered_map<std::string, tcc::dimensions> input_shapes)
+{
+    const std::string graph_path = target_name + ".pb";
+    std::ofstream file(graph_path, std::ios::trunc | std::ios::binary);
+    tcc_assert(graph.SerializeToOstream(&file),
+               "failed to write graph to " + graph_path);
+    file.close();
+
+    return tcc::parse(graph_path, input_shapes);
+}
+
+static void* util_compile_expr(std::string target_name,
+                               tcc::expr e,
+                               tcc::ir_codegen_options options = {})
 {
     struct stat info;
     if (stat(target_name.c_str(), &info))
@@ -31,7 +228,7 @@ static void* util_compile_expr(std::string target_name, tcc::expr e)
         tcc::ir_printer::apply(target_name, e);
         tcc_info("successfully generated dot file.");
 
-        tcc::ir_codegen::apply(target_name, e);
+        tcc::ir_codegen::apply(target_name, e, options);
         tcc_info("successfully generated source files.");
     }
 
@@ -64,11 +261,164 @@ static void* util_compile_expr(std::string target_name, tcc::expr e)
     }
 }
 
+/* util_load_symbol returns a symbol of the shared library compiled by
+ * util_compile_expr for target_name. */
+static void* util_load_symbol(std::string target_name, std::string symbol)
+{
+    const std::string lib_path = target_name + "/" + target_name + ".so";
+
+    void* shared_lib = dlopen(lib_path.c_str(), RTLD_NOW);
+    tcc_assert(shared_lib, "can not open shared library at " + lib_path);
+
+    void* sym = dlsym(shared_lib, symbol.c_str());
+    tcc_assert(sym, "can not find symbol " + symbol + ".");
+    return sym;
+}
+
+/* util_run_expr compiles e as target_name and returns its output for the
+ * values of its inputs, which are passed in the order of ir_dep_analysis as
+ * in the generated signature. options must not have a runtime batch. */
+static std::vector<float> util_run_expr(
+    std::string target_name,
+    tcc::expr e,
+    tcc::ir_codegen_options options = {},
+    std::vector<std::vector<float>> inputs = {})
+{
+    tcc_assert(inputs.size() == tcc::ir_dep_analysis::apply(e).inputs.size(),
+               "values of inputs are missing.");
+    void* func = util_compile_expr(target_name, e, options);
+
+    std::vector<float> workspace;
+    if (options.workspace)
+    {
+        size_t (*workspace_size)(void) = (size_t(*)(void))util_load_symbol(
+            target_name, target_name + "_workspace_size");
+        workspace.resize(workspace_size() / sizeof(float) + 1);
+    }
+
+    std::vector<float> output(e->size());
+    std::vector<void*> args;
+    if (options.workspace)
+        args.push_back(workspace.data());
+    for (std::vector<float>& input : inputs)
+        args.push_back(input.data());
+    args.push_back(output.data());
+
+    typedef void* p;
+    switch (args.size())
+    {
+        case 1:
+            ((void (*)(p))func)(args[0]);
+            break;
+        case 2:
+            ((void (*)(p, p))func)(args[0], args[1]);
+            break;
+        case 3:
+            ((void (*)(p, p, p))func)(args[0], args[1], args[2]);
+            break;
+        default:
+            tcc_error("exprs with more than 2 inputs are not run.");
+    }
+    return output;
+}
+
+/* util_read_source returns the generated source file of target_name. */
+static std::string util_read_source(std::string target_name)
+{
+    const std::string source_path = target_name + "/" + target_name + ".c";
+    std::ifstream file(source_path);
+    tcc_assert(file, "failed to open file at " + source_path);
+    return std::string(std::istreambuf_iterator<char>(file),
+                       std::istreambuf_iterator<char>());
+}
+
 static float* util_zero_array(int size)
 {
     return (float*)calloc(size, sizeof(float));
 }
 
+/* util_assert_disjoint asserts that no two blocks of plan with overlapping
+ * lifetimes overlap in memory, with sizes rounded up to alignment. */
+static void util_assert_disjoint(std::vector<tcc::ir_mem_block> blocks,
+                                 tcc::ir_mem_planner_result plan,
+                                 tcc::dimension alignment)
+{
+    std::function<tcc::dimension(tcc::ir_mem_block)> aligned_size =
+        [&](tcc::ir_mem_block block) {
+            return (block.size + alignment - 1) / alignment * alignment;
+        };
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        tcc::ir_mem_block a = blocks[i];
+        tcc::dimension a_offset = plan.offsets.at(a.e);
+        tcc_assert(a_offset % alignment == 0 &&
+                       a_offset + aligned_size(a) <= plan.arena_size,
+                   "block " + std::to_string(i) + " is misplaced.");
+        for (size_t j = 0; j < i; j++)
+        {
+            tcc::ir_mem_block b = blocks[j];
+            tcc::dimension b_offset = plan.offsets.at(b.e);
+            tcc_assert(a.first > b.last || b.first > a.last ||
+                           a_offset + aligned_size(a) <= b_offset ||
+                           b_offset + aligned_size(b) <= a_offset,
+                       "blocks " + std::to_string(j) + " and " +
+                           std::to_string(i) + " overlap.");
+        }
+    }
+}
+
+static void test_mem_planner(std::string)
+{
+    /* sizes round up to 128, 64, 256, 64 and 64 bytes; the most memory is
+     * live from stage 2 to 3, holding the second, third and fifth or the
+     * third, fourth and fifth block. */
+    std::vector<tcc::ir_mem_block> blocks = {
+        { util_generate_cnst({ 1 }), 100, 0, 1 },
+        { util_generate_cnst({ 1 }), 64, 1, 2 },
+        { util_generate_cnst({ 1 }), 200, 2, 3 },
+        { util_generate_cnst({ 1 }), 10, 3, 4 },
+        { util_generate_cnst({ 1 }), 1, 0, 4 }
+    };
+    tcc::ir_mem_planner_result plan = tcc::ir_mem_planner::apply(blocks, 64);
+    util_assert_disjoint(blocks, plan, 64);
+    tcc_assert(plan.peak_size == 384 && plan.arena_size >= plan.peak_size,
+               "arena of " + std::to_string(plan.arena_size) +
+                   " bytes with a peak of " + std::to_string(plan.peak_size) +
+                   " bytes is incorrect.");
+
+    /* two live bytes take a line each. */
+    tcc::ir_mem_planner_result bytes = tcc::ir_mem_planner::apply(
+        { { util_generate_cnst({ 1 }), 1, 0, 0 },
+          { util_generate_cnst({ 1 }), 1, 0, 0 } },
+        64);
+    tcc_assert(bytes.arena_size == 128 && bytes.peak_size == 128,
+               "sizes are not rounded to the alignment.");
+
+    /* random lifetimes and sizes with many ties plan disjoint blocks, the
+     * same for equal inputs. */
+    std::mt19937 generator(0);
+    for (int round = 0; round < 20; round++)
+    {
+        std::vector<tcc::ir_mem_block> random_blocks;
+        for (int i = 0; i < 40; i++)
+        {
+            unsigned first = generator() % 30;
+            random_blocks.push_back({ util_generate_cnst({ 1 }),
+                                      tcc::dimension(generator() % 8 * 48 + 1),
+                                      first,
+                                      first + unsigned(generator() % 10) });
+        }
+        tcc::ir_mem_planner_result random_plan =
+            tcc::ir_mem_planner::apply(random_blocks, 64);
+        util_assert_disjoint(random_blocks, random_plan, 64);
+        tcc_assert(random_plan.arena_size >= random_plan.peak_size,
+                   "arena is smaller than the peak.");
+        tcc_assert(tcc::ir_mem_planner::apply(random_blocks, 64).offsets ==
+                       random_plan.offsets,
+                   "plans of equal blocks differ.");
+    }
+}
+
 static void test_conv2d(std::string target_name)
 {
     tcc::expr input = util_generate_cnst({ 1, 7, 7, 1 });
@@ -104,6 +454,1243 @@ static void test_conv2d(std::string target_name)
     free(out);
 }
 
+static void test_conv2d_parallel(std::string target_name)
+{
+    std::vector<float> input_values =
+        util_generate_random_values(56 * 56 * 32);
+    std::vector<float> filter_values =
+        util_generate_random_values(3 * 3 * 32 * 64);
+    tcc::expr input = tcc::cnst::make(input_values, { 1, 56, 56, 32 });
+    tcc::expr filter = tcc::cnst::make(filter_values, { 3, 3, 32, 64 });
+    tcc::expr output = build_conv2d(
+        "NHWC", "SAME", { 1, 1, 1, 1 }, { 1, 1, 1, 1 }, input, filter);
+
+    tcc::ir_codegen_options options;
+    options.parallelize = true;
+
+    void (*conv2d)(float*) =
+        (void (*)(float*))util_compile_expr(target_name, output, options);
+
+    std::chrono::steady_clock::time_point begin;
+    std::chrono::steady_clock::time_point end;
+
+    float* out = util_zero_array(56 * 56 * 64);
+
+    begin = std::chrono::steady_clock::now();
+    conv2d(out);
+    end = std::chrono::steady_clock::now();
+
+    tcc_info(
+        "inference time: " +
+        std::to_string(
+            std::chrono::duration_cast<std::chrono::microseconds>(end - begin)
+                .count()) +
+        " us.");
+
+    util_assert_near(out,
+                     util_conv2d(input_values,
+                                 { 1, 56, 56, 32 },
+                                 filter_values,
+                                 { 3, 3, 32, 64 },
+                                 1),
+                     1e-4f,
+                     "parallel outputs are incorrect");
+
+    free(out);
+}
+
+static void test_conv2d_workspace(std::string target_name)
+{
+    tcc::expr input = tcc::var::make(tcc::datatype::FP32, { 1, 16, 16, 8 });
+    tcc::expr conv2d = build_relu6(build_conv2d(
+        "NHWC",
+        "SAME",
+        { 1, 1, 1, 1 },
+        { 1, 1, 1, 1 },
+        input,
+        tcc::cnst::make(util_generate_random_values(3 * 3 * 8 * 16),
+                        { 3, 3, 8, 16 })));
+    tcc::expr depthwise = build_relu6(build_depthwiseconv2dnative(
+        "NHWC",
+        "SAME",
+        { 1, 1, 1, 1 },
+        { 1, 1, 1, 1 },
+        conv2d,
+        tcc::cnst::make(util_generate_random_values(3 * 3 * 16),
+                        { 3, 3, 16, 1 })));
+    tcc::expr output =
+        build_conv2d("NHWC",
+                     "SAME",
+                     { 1, 1, 1, 1 },
+                     { 1, 1, 1, 1 },
+                     depthwise,
+                     tcc::cnst::make(util_generate_random_values(16 * 8),
+                                     { 1, 1, 16, 8 }));
+
+    /* every thread passes a workspace, an input and an output of its own
+     * and has to compute what a single call computes. */
+    static const int threads = 8, calls = 50;
+    std::vector<std::vector<float>> inputs;
+    for (int t = 0; t < threads; t++)
+        inputs.push_back(util_generate_random_values(16 * 16 * 8));
+    for (bool parallelize : { false, true })
+    {
+        tcc::ir_codegen_options options;
+        options.parallelize = parallelize;
+        options.workspace = true;
+        std::string name = target_name + (parallelize ? "_parallel" : "");
+
+        void (*run)(void*, float*, float*) =
+            (void (*)(void*, float*, float*))util_compile_expr(
+                name, output, options);
+        size_t (*workspace_size)(void) = (size_t(*)(void))util_load_symbol(
+            name, name + "_workspace_size");
+
+        std::vector<std::vector<float>> expected;
+        std::vector<float> workspace(workspace_size() / sizeof(float) + 1);
+        for (std::vector<float>& values : inputs)
+        {
+            expected.emplace_back(output->size());
+            run(workspace.data(), values.data(), expected.back().data());
+        }
+
+        std::vector<std::thread> callers;
+        std::atomic<int> failures(0);
+        for (int t = 0; t < threads; t++)
+            callers.emplace_back([&, t]() {
+                std::vector<float> own_workspace(workspace.size()),
+                    input = inputs[t], out(output->size());
+                for (int call = 0; call < calls; call++)
+                {
+                    run(own_workspace.data(), input.data(), out.data());
+                    failures += out != expected[t];
+                }
+            });
+        for (std::thread& caller : callers)
+            caller.join();
+        tcc_assert(!failures,
+                   name + " outputs of concurrent calls are incorrect.");
+    }
+}
+
+static void test_conv2d_batched(std::string target_name)
+{
+    std::vector<float> input_values =
+        util_generate_random_values(4 * 7 * 7 * 2);
+    std::vector<float> filter_values = util_generate_random_values(3 * 3 * 2);
+    tcc::expr input = tcc::cnst::make(input_values, { 4, 7, 7, 2 });
+    tcc::expr filter = tcc::cnst::make(filter_values, { 3, 3, 2, 1 });
+    tcc::expr output = build_conv2d(
+        "NHWC", "SAME", { 1, 1, 1, 1 }, { 1, 1, 1, 1 }, input, filter);
+
+    void (*conv2d)(float*) =
+        (void (*)(float*))util_compile_expr(target_name, output);
+
+    float* out = util_zero_array(4 * 7 * 7);
+    conv2d(out);
+
+    /* every image of the batch is convolved on its own with the filter. */
+    for (int n = 0; n < 4; n++)
+        util_assert_near(
+            out + n * 7 * 7,
+            util_conv2d(std::vector<float>(input_values.begin() + n * 7 * 7 * 2,
+                                           input_values.begin() +
+                                               (n + 1) * 7 * 7 * 2),
+                        { 1, 7, 7, 2 },
+                        filter_values,
+                        { 3, 3, 2, 1 },
+                        1),
+            1e-5f,
+            "batched outputs of image " + std::to_string(n) +
+                " are incorrect");
+
+    free(out);
+}
+
+static void test_conv2d_runtime_batch(std::string target_name)
+{
+    std::vector<float> input_values =
+        util_generate_random_values(4 * 7 * 7 * 2);
+    std::vector<float> filter_values =
+        util_generate_random_values(3 * 3 * 2 * 3);
+    tcc::expr input = tcc::var::make(tcc::datatype::FP32, { 4, 7, 7, 2 });
+    tcc::expr filter = tcc::cnst::make(filter_values, { 3, 3, 2, 3 });
+    tcc::expr output = build_conv2d(
+        "NHWC", "SAME", { 1, 1, 1, 1 }, { 1, 1, 1, 1 }, input, filter);
+
+    tcc::ir_codegen_options options;
+    options.max_batch = 4;
+
+    int (*conv2d)(int, float*, float*) = (int (*)(int, float*, float*))
+        util_compile_expr(target_name, output, options);
+
+    /* only the leading batch images are read and written; the images after
+     * them are nan in the input and left untouched in the output. batches
+     * out of range compute nothing. */
+    const float untouched = -12345.f;
+    std::vector<float> out(4 * 7 * 7 * 3);
+    for (int batch = 0; batch <= 5; batch++)
+    {
+        std::vector<float> in = input_values;
+        std::fill(in.begin() + std::min(batch, 4) * 7 * 7 * 2,
+                  in.end(),
+                  std::nanf(""));
+        std::fill(out.begin(), out.end(), untouched);
+
+        bool valid = batch >= 1 && batch <= 4;
+        tcc_assert(conv2d(batch, in.data(), out.data()) == (valid ? 0 : -1),
+                   "batch " + std::to_string(batch) + " is not checked.");
+        for (int n = 0; n < 4; n++)
+        {
+            if (n < batch && valid)
+            {
+                util_assert_near(
+                    out.data() + n * 7 * 7 * 3,
+                    util_conv2d(
+                        std::vector<float>(in.begin() + n * 7 * 7 * 2,
+                                           in.begin() + (n + 1) * 7 * 7 * 2),
+                        { 1, 7, 7, 2 },
+                        filter_values,
+                        { 3, 3, 2, 3 },
+                        1),
+                    1e-5f,
+                    "outputs of batch " + std::to_string(batch) +
+                        " are incorrect");
+            }
+            else
+            {
+                tcc_assert(std::all_of(out.begin() + n * 7 * 7 * 3,
+                                       out.begin() + (n + 1) * 7 * 7 * 3,
+                                       [&](float value) {
+                                           return value == untouched;
+                                       }),
+                           "batch " + std::to_string(batch) +
+                               " writes image " + std::to_string(n) + ".");
+            }
+        }
+    }
+}
+
+static void test_batchnorm_folding(std::string target_name)
+{
+    /* a convolution with a bias and a depthwise convolution without. */
+    for (bool depthwise : { false, true })
+    {
+        tcc::dimensions filter_shape = { 3, 3, 4, depthwise ? 2 : 6 };
+        tcc::dimension channels = depthwise ? 8 : 6;
+        std::vector<float> input_values =
+            util_generate_random_values(9 * 9 * 4);
+        std::vector<float> filter_values =
+            util_generate_random_values(3 * 3 * 4 * filter_shape[3]);
+        std::vector<float> bias = util_generate_random_values(channels);
+        std::vector<float> scale = util_generate_random_values(channels);
+        std::vector<float> offset = util_generate_random_values(channels);
+        std::vector<float> mean = util_generate_random_values(channels);
+        std::vector<float> variance = util_generate_random_values(channels);
+        for (float& value : variance)
+            value += 1.5f;
+
+        std::string conv_op = depthwise ? "DepthwiseConv2dNative" : "Conv2D";
+        tensorflow::GraphDef graph;
+        (*util_add_node(graph, "input", "Placeholder")->mutable_attr())["dtype"]
+            .set_type(tensorflow::DT_FLOAT);
+        util_add_const(graph, "filter", filter_values, filter_shape);
+        tensorflow::NodeDef* conv =
+            util_add_node(graph, "conv", conv_op, { "input", "filter" });
+        util_set_attr(conv, "data_format", "NHWC");
+        util_set_attr(conv, "padding", "SAME");
+        util_set_attr(conv, "strides", tcc::dimensions{ 1, 2, 2, 1 });
+        util_set_attr(conv, "dilations", tcc::dimensions{ 1, 1, 1, 1 });
+        std::string x = "conv";
+        if (!depthwise)
+        {
+            util_add_const(graph, "bias", bias, { channels });
+            util_set_attr(
+                util_add_node(graph, "biasadd", "BiasAdd", { x, "bias" }),
+                "data_format",
+                "NHWC");
+            x = "biasadd";
+        }
+        util_add_const(graph, "scale", scale, { channels });
+        util_add_const(graph, "offset", offset, { channels });
+        util_add_const(graph, "mean", mean, { channels });
+        util_add_const(graph, "variance", variance, { channels });
+        tensorflow::NodeDef* batchnorm = util_add_node(
+            graph,
+            "batchnorm",
+            "FusedBatchNorm",
+            { x, "scale", "offset", "mean", "variance" });
+        (*batchnorm->mutable_attr())["epsilon"].set_f(0.001f);
+        util_set_attr(batchnorm, "data_format", "NHWC");
+        util_add_node(graph, "output", "Relu6", { "batchnorm" });
+
+        std::string name =
+            target_name + (depthwise ? "_depthwise" : "_conv2d");
+        tcc::expr folded =
+            util_parse_graph(name, graph, { { "input", { 1, 9, 9, 4 } } });
+        tcc::expr input = *tcc::ir_dep_analysis::apply(folded).inputs.begin();
+
+        /* the baseline applies the batch norm to the convolution. */
+        tcc::expr filter = tcc::cnst::make(filter_values, filter_shape);
+        tcc::expr unfolded =
+            depthwise ? build_depthwiseconv2dnative("NHWC",
+                                                    "SAME",
+                                                    { 1, 2, 2, 1 },
+                                                    { 1, 1, 1, 1 },
+                                                    input,
+                                                    filter)
+                      : build_biasadd("NHWC",
+                                      build_conv2d("NHWC",
+                                                   "SAME",
+                                                   { 1, 2, 2, 1 },
+                                                   { 1, 1, 1, 1 },
+                                                   input,
+                                                   filter),
+                                      tcc::cnst::make(bias, { channels }));
+        unfolded = build_relu6(
+            build_fusedbatchnorm(0.001f,
+                                 "NHWC",
+                                 unfolded,
+                                 tcc::cnst::make(scale, { channels }),
+                                 tcc::cnst::make(offset, { channels }),
+                                 tcc::cnst::make(mean, { channels }),
+                                 tcc::cnst::make(variance, { channels })));
+
+        /* folding scales the filter, so the original filter is not read. */
+        std::function<bool(tcc::expr)> reads_filter = [&](tcc::expr e) {
+            if (e->type == tcc::exprtype::cnst && e->size() == filter->size() &&
+                !e->shape.empty() &&
+                tcc::downcast<tcc::cnst>(e)->to_vector<float>() ==
+                    filter_values)
+                return true;
+            for (tcc::expr operand : tcc::operands(e))
+                if (reads_filter(operand))
+                    return true;
+            return false;
+        };
+        tcc_assert(!reads_filter(folded), "batch norm is not folded.");
+
+        std::vector<float> out =
+            util_run_expr(name + "_folded", folded, {}, { input_values });
+        util_assert_near(
+            out.data(),
+            util_run_expr(name + "_unfolded", unfolded, {}, { input_values }),
+            1e-4f,
+            "folded batch norm outputs are incorrect");
+    }
+}
+
+static void test_nchw_layout(std::string target_name)
+{
+    std::vector<float> input_values =
+        util_generate_random_values(2 * 9 * 10 * 4);
+    std::vector<float> filter_values =
+        util_generate_random_values(3 * 3 * 4 * 8);
+    std::vector<float> bias_values = util_generate_random_values(8);
+    std::vector<float> depthwise_values =
+        util_generate_random_values(3 * 3 * 8);
+
+    /* a convolution, a bias, a depthwise convolution and a residual add in
+     * either data format. */
+    std::function<tcc::expr(std::string)> parse = [&](std::string format) {
+        std::function<tcc::dimensions(tcc::dimension)> spatial =
+            [&](tcc::dimension value) {
+                return format == "NCHW" ? tcc::dimensions{ 1, 1, value, value }
+                                        : tcc::dimensions{ 1, value, value, 1 };
+            };
+
+        tensorflow::GraphDef graph;
+        (*util_add_node(graph, "input", "Placeholder")->mutable_attr())["dtype"]
+            .set_type(tensorflow::DT_FLOAT);
+        util_add_const(graph, "filter", filter_values, { 3, 3, 4, 8 });
+        tensorflow::NodeDef* conv =
+            util_add_node(graph, "conv", "Conv2D", { "input", "filter" });
+        util_set_attr(conv, "data_format", format);
+        util_set_attr(conv, "padding", "SAME");
+        util_set_attr(conv, "strides", spatial(2));
+        util_set_attr(conv, "dilations", spatial(1));
+        util_add_const(graph, "bias", bias_values, { 8 });
+        util_set_attr(
+            util_add_node(graph, "biasadd", "BiasAdd", { "conv", "bias" }),
+            "data_format",
+            format);
+        util_add_node(graph, "relu", "Relu6", { "biasadd" });
+        util_add_const(
+            graph, "depthwise_filter", depthwise_values, { 3, 3, 8, 1 });
+        tensorflow::NodeDef* depthwise =
+            util_add_node(graph,
+                          "depthwise",
+                          "DepthwiseConv2dNative",
+                          { "relu", "depthwise_filter" });
+        util_set_attr(depthwise, "data_format", format);
+        util_set_attr(depthwise, "padding", "SAME");
+        util_set_attr(depthwise, "strides", spatial(1));
+        util_set_attr(depthwise, "dilations", spatial(1));
+        util_add_node(graph, "add", "Add", { "depthwise", "relu" });
+        util_add_node(graph, "output", "Relu6", { "add" });
+
+        return util_parse_graph(
+            target_name + "_" + format,
+            graph,
+            { { "input",
+                format == "NCHW" ? tcc::dimensions{ 2, 4, 9, 10 }
+                                 : tcc::dimensions{ 2, 9, 10, 4 } } });
+    };
+    tcc::expr nhwc = parse("NHWC"), nchw = parse("NCHW");
+
+    /* the NCHW graph is computed in NHWC and transposed at its output. */
+    tcc_assert(nchw->shape == tcc::dimensions({ 2, 8, 5, 5 }) &&
+                   nchw->type == tcc::exprtype::index &&
+                   tcc::downcast<tcc::index>(nchw)->x->shape == nhwc->shape,
+               "activations of the NCHW graph are not kept in NHWC.");
+
+    std::vector<float> nchw_input(input_values.size());
+    for (int n = 0; n < 2; n++)
+        for (int h = 0; h < 9; h++)
+            for (int w = 0; w < 10; w++)
+                for (int c = 0; c < 4; c++)
+                    nchw_input[((n * 4 + c) * 9 + h) * 10 + w] =
+                        input_values[((n * 9 + h) * 10 + w) * 4 + c];
+    std::vector<float> expected = util_run_expr(
+        target_name + "_nhwc", nhwc, {}, { input_values });
+    std::vector<float> out = util_run_expr(
+        target_name + "_nchw", nchw, {}, { nchw_input });
+
+    std::vector<float> nchw_expected(expected.size());
+    for (int n = 0; n < 2; n++)
+        for (int h = 0; h < 5; h++)
+            for (int w = 0; w < 5; w++)
+                for (int c = 0; c < 8; c++)
+                    nchw_expected[((n * 8 + c) * 5 + h) * 5 + w] =
+                        expected[((n * 5 + h) * 5 + w) * 8 + c];
+    util_assert_near(
+        out.data(), nchw_expected, 1e-5f, "NCHW outputs are incorrect");
+}
+
+static void test_conv2d_gemm(std::string target_name)
+{
+    /* 5 input and 37 output channels are multiples of neither simd widths
+     * nor gemm panels. */
+    tcc::ir_codegen_options options;
+    options.vectorize = true;
+    for (tcc::dimension k : { 1, 3, 5 })
+        for (tcc::dimension stride : { 1, 2 })
+            for (std::string padding : { "SAME", "VALID" })
+            {
+                std::vector<float> input_values =
+                    util_generate_random_values(2 * 11 * 9 * 5);
+                std::vector<float> filter_values =
+                    util_generate_random_values(k * k * 5 * 37);
+                tcc::expr input =
+                    tcc::cnst::make(input_values, { 2, 11, 9, 5 });
+                tcc::expr filter =
+                    tcc::cnst::make(filter_values, { k, k, 5, 37 });
+
+                std::string name = target_name + "_k" + std::to_string(k) +
+                                   "_s" + std::to_string(stride) + "_" +
+                                   padding;
+                std::vector<float> direct = util_run_expr(
+                    name + "_direct",
+                    build_conv2d("NHWC",
+                                 padding,
+                                 { 1, stride, stride, 1 },
+                                 { 1, 1, 1, 1 },
+                                 input,
+                                 filter),
+                    options);
+                std::vector<float> gemm =
+                    util_run_expr(name + "_gemm",
+                                  build_conv2d("NHWC",
+                                               padding,
+                                               { 1, stride, stride, 1 },
+                                               { 1, 1, 1, 1 },
+                                               input,
+                                               filter,
+                                               tcc::conv2d_lowering::gemm),
+                                  options);
+
+                util_assert_near(direct.data(),
+                                 util_conv2d(input_values,
+                                             { 2, 11, 9, 5 },
+                                             filter_values,
+                                             { k, k, 5, 37 },
+                                             stride,
+                                             padding == "VALID"),
+                                 1e-4f,
+                                 name + " direct outputs are incorrect");
+                util_assert_near(gemm.data(),
+                                 direct,
+                                 1e-4f,
+                                 name + " gemm outputs are incorrect");
+            }
+}
+
+static void test_conv2d_pointwise(std::string target_name)
+{
+    for (tcc::dimension stride : { 1, 2 })
+    {
+        std::vector<float> input_values =
+            util_generate_random_values(2 * 13 * 11 * 19);
+        std::vector<float> filter_values =
+            util_generate_random_values(19 * 45);
+        tcc::expr input = tcc::cnst::make(input_values, { 2, 13, 11, 19 });
+        tcc::expr filter = tcc::cnst::make(filter_values, { 1, 1, 19, 45 });
+        tcc::dimension o_h = (13 + stride - 1) / stride,
+                       o_w = (11 + stride - 1) / stride;
+
+        /* the baseline is the stencil of a general convolution, a
+         * reduction over fragments of the input and the filter. */
+        tcc::exprs i = tcc::to_ranges({ 2, o_h, o_w, 1, 1, 19, 45 });
+        tcc::expr stencil = tcc::reduce::make(
+            tcc::reduce::type::sum,
+            { 3, 4, 5 },
+            tcc::index::make(i,
+                             input,
+                             { i[0],
+                               i[1] * tcc::cnst::make(stride) + i[3],
+                               i[2] * tcc::cnst::make(stride) + i[4],
+                               i[5] }) *
+                filter);
+
+        std::string name = target_name + "_s" + std::to_string(stride);
+        std::vector<float> pointwise = util_run_expr(
+            name,
+            build_conv2d("NHWC",
+                         "SAME",
+                         { 1, stride, stride, 1 },
+                         { 1, 1, 1, 1 },
+                         input,
+                         filter));
+        tcc_assert(util_read_source(name).find("tcc_gemm(") !=
+                       std::string::npos,
+                   "pointwise convolution is not a gemm.");
+
+        util_assert_near(pointwise.data(),
+                         util_run_expr(name + "_stencil", stencil),
+                         1e-4f,
+                         "pointwise outputs are incorrect");
+    }
+}
+
+static void test_conv2d_packed(std::string target_name)
+{
+    /* 37 output channels end in a partial panel. */
+    for (tcc::dimension k : { 1, 3 })
+    {
+        std::vector<float> filter_values =
+            util_generate_random_values(k * k * 19 * 37);
+        tcc::expr input = tcc::cnst::make(
+            util_generate_random_values(2 * 13 * 11 * 19), { 2, 13, 11, 19 });
+        tcc::expr packed = build_conv2d(
+            "NHWC",
+            "SAME",
+            { 1, 1, 1, 1 },
+            { 1, 1, 1, 1 },
+            input,
+            tcc::cnst::make(filter_values, { k, k, 19, 37 }),
+            tcc::conv2d_lowering::gemm);
+
+        /* a filter passed at runtime is read row major. */
+        tcc::expr unpacked =
+            build_conv2d("NHWC",
+                         "SAME",
+                         { 1, 1, 1, 1 },
+                         { 1, 1, 1, 1 },
+                         input,
+                         tcc::var::make(tcc::datatype::FP32, { k, k, 19, 37 }),
+                         tcc::conv2d_lowering::gemm);
+
+        std::string name = target_name + "_k" + std::to_string(k);
+        std::vector<float> expected = util_run_expr(
+            name + "_unpacked", unpacked, {}, { filter_values });
+        util_assert_near(util_run_expr(name, packed).data(),
+                         expected,
+                         1e-4f,
+                         name + " packed outputs are incorrect");
+
+        /* the flag before the output of the last gemm call tells whether
+         * its filter is packed. */
+        for (std::string target : { name, name + "_unpacked" })
+        {
+            std::string source = util_read_source(target);
+            std::string call = source.substr(source.rfind("tcc_gemm("));
+            call = call.substr(0, call.rfind(","));
+            tcc_assert(call.substr(call.rfind(",") + 1) ==
+                           (target == name ? "1" : "0"),
+                       target + " filters are not packed as expected.");
+        }
+    }
+}
+
+static void test_conv2d_winograd(std::string target_name)
+{
+    /* outputs of odd sizes end in partial tiles, and 5 input and 37 output
+     * channels are multiples of neither simd widths nor gemm panels. */
+    tcc::ir_codegen_options options;
+    options.vectorize = true;
+    for (tcc::dimensions shape :
+         { tcc::dimensions{ 2, 9, 7, 5 }, tcc::dimensions{ 2, 10, 8, 5 } })
+        for (std::string padding : { "SAME", "VALID" })
+        {
+            std::vector<float> input_values =
+                util_generate_random_values(2 * shape[1] * shape[2] * 5);
+            std::vector<float> filter_values =
+                util_generate_random_values(3 * 3 * 5 * 37);
+            tcc::expr input = tcc::cnst::make(input_values, shape);
+            tcc::expr filter = tcc::cnst::make(filter_values, { 3, 3, 5, 37 });
+
+            tcc::expr direct = build_conv2d(
+                "NHWC", padding, { 1, 1, 1, 1 }, { 1, 1, 1, 1 }, input, filter);
+            tcc::expr winograd = build_conv2d("NHWC",
+                                              padding,
+                                              { 1, 1, 1, 1 },
+                                              { 1, 1, 1, 1 },
+                                              input,
+                                              filter,
+                                              tcc::conv2d_lowering::winograd);
+
+            /* the output transform of winograd's algorithm reduces over
+             * tiles of 4x4 instead of the filter and the input channels. */
+            tcc_assert(direct->shape == winograd->shape &&
+                           tcc::downcast<tcc::reduce>(winograd)
+                                   ->reduce_dims.size() == 2,
+                       "convolution is not lowered by winograd's algorithm.");
+
+            std::string name = target_name + "_" +
+                               std::to_string(shape[1]) + "x" +
+                               std::to_string(shape[2]) + "_" + padding;
+            std::vector<float> expected =
+                util_run_expr(name + "_direct", direct, options);
+            util_assert_near(expected.data(),
+                             util_conv2d(input_values,
+                                         shape,
+                                         filter_values,
+                                         { 3, 3, 5, 37 },
+                                         1,
+                                         padding == "VALID"),
+                             1e-4f,
+                             name + " direct outputs are incorrect");
+            util_assert_near(
+                util_run_expr(name + "_winograd", winograd, options).data(),
+                expected,
+                1e-4f,
+                name + " winograd outputs are incorrect");
+        }
+}
+
+static void test_depthwise_conv2d(std::string target_name)
+{
+    /* 19 channels are no multiple of simd widths, and output columns are
+     * no multiple of pixel blocks. */
+    tcc::ir_codegen_options options;
+    options.vectorize = true;
+    for (tcc::dimension stride : { 1, 2 })
+        for (tcc::dimension multiplier : { 1, 2 })
+        {
+            std::vector<float> input_values =
+                util_generate_random_values(2 * 13 * 11 * 19);
+            std::vector<float> filter_values =
+                util_generate_random_values(3 * 3 * 19 * multiplier);
+            tcc::expr input =
+                tcc::cnst::make(input_values, { 2, 13, 11, 19 });
+            tcc::expr filter =
+                tcc::cnst::make(filter_values, { 3, 3, 19, multiplier });
+            tcc::expr output =
+                build_depthwiseconv2dnative("NHWC",
+                                            "SAME",
+                                            { 1, stride, stride, 1 },
+                                            { 1, 1, 1, 1 },
+                                            input,
+                                            filter);
+            tcc::expr stage = multiplier == 1
+                                  ? output
+                                  : tcc::downcast<tcc::reshape>(output)->x;
+
+            std::string name = target_name + "_s" + std::to_string(stride) +
+                               "_m" + std::to_string(multiplier);
+            std::vector<float> blocked =
+                util_run_expr(name + "_blocked", output, options);
+            tcc_assert(util_read_source(name + "_blocked").find("acc[") !=
+                           std::string::npos,
+                       "depthwise convolution is not blocked.");
+            util_assert_near(blocked.data(),
+                             util_depthwise_conv2d(input_values,
+                                                   { 2, 13, 11, 19 },
+                                                   filter_values,
+                                                   { 3, 3, 19, multiplier },
+                                                   stride),
+                             1e-5f,
+                             name + " blocked outputs are incorrect");
+
+            /* a scheduled stage keeps its loop nest and accumulates in the
+             * output, the innermost loop being the channel or multiplier
+             * loop. */
+            tcc::ir_codegen_options baseline = options;
+            baseline.schedule[stage].vectorize(multiplier == 1 ? "d5" : "d6");
+            util_assert_near(
+                blocked.data(),
+                util_run_expr(name + "_baseline", output, baseline),
+                1e-5f,
+                name + " scheduled outputs are incorrect");
+        }
+}
+
+static void test_affine_indices(std::string target_name)
+{
+    std::vector<float> input_values =
+        util_generate_random_values(2 * 11 * 9 * 5);
+    std::vector<float> filter_values =
+        util_generate_random_values(3 * 3 * 5 * 7);
+    tcc::expr input = tcc::cnst::make(input_values, { 2, 11, 9, 5 });
+    tcc::expr filter = tcc::cnst::make(filter_values, { 3, 3, 5, 7 });
+
+    /* a strided and padded convolution, whose indices have constant terms,
+     * and a transpose, whose innermost loop strides through its input. */
+    tcc::expr conv2d = build_conv2d(
+        "NHWC", "SAME", { 1, 2, 2, 1 }, { 1, 1, 1, 1 }, input, filter);
+    std::vector<int32_t> perm = { 0, 3, 1, 2 };
+    tcc::expr transpose = build_transpose(
+        tcc::var::make(tcc::datatype::FP32, { 2, 11, 9, 5 }),
+        build_const(std::string(reinterpret_cast<const char*>(perm.data()),
+                                perm.size() * sizeof(int32_t)),
+                    tcc::datatype::INT32,
+                    { 4 }));
+    std::vector<float> transposed(input_values.size());
+    for (int n = 0; n < 2; n++)
+        for (int h = 0; h < 11; h++)
+            for (int w = 0; w < 9; w++)
+                for (int c = 0; c < 5; c++)
+                    transposed[((n * 5 + c) * 11 + h) * 9 + w] =
+                        input_values[((n * 11 + h) * 9 + w) * 5 + c];
+
+    /* worksharing loops collapsing the innermost loop take the invariant
+     * parts of addresses into their bodies. */
+    for (int variant = 0; variant < 3; variant++)
+    {
+        tcc::ir_codegen_options options;
+        options.parallelize = variant > 0;
+        options.vectorize = variant > 1;
+
+        std::string name = target_name + "_" + std::to_string(variant);
+        util_assert_near(
+            util_run_expr(name + "_conv2d", conv2d, options).data(),
+            util_conv2d(input_values,
+                        { 2, 11, 9, 5 },
+                        filter_values,
+                        { 3, 3, 5, 7 },
+                        2),
+            1e-4f,
+            name + " convolution outputs are incorrect");
+        tcc_assert(util_read_source(name + "_conv2d").find("const int ") !=
+                       std::string::npos,
+                   name + " invariant addresses are not hoisted.");
+        util_assert_near(util_run_expr(name + "_transpose",
+                                       transpose,
+                                       options,
+                                       { input_values })
+                             .data(),
+                         transposed,
+                         0,
+                         name + " transpose outputs are incorrect");
+    }
+}
+
+static void test_local_reduce(std::string target_name)
+{
+    /* trailing reductions over a row, over the two innermost dimensions and
+     * over a whole tensor, whose output keeps a dimension of extent 1 as
+     * scalar outputs are passed by value. */
+    struct reduction
+    {
+        std::string name;
+        tcc::reduce::type type;
+        tcc::dimensions shape;
+        std::unordered_set<unsigned> reduce_dims;
+    };
+    std::vector<reduction> reductions = {
+        { "sum", tcc::reduce::type::sum, { 6, 300 }, { 1 } },
+        { "max", tcc::reduce::type::max, { 6, 300 }, { 1 } },
+        { "avg", tcc::reduce::type::avg, { 6, 20, 30 }, { 1, 2 } },
+        { "total", tcc::reduce::type::sum, { 1, 6, 20, 30 }, { 1, 2, 3 } }
+    };
+
+    tcc::ir_codegen_options options;
+    options.parallelize = true;
+    options.vectorize = true;
+    for (reduction r : reductions)
+    {
+        tcc::dimension size = 1;
+        for (tcc::dimension dim : r.shape)
+            size *= dim;
+        std::vector<float> values = util_generate_random_values(size);
+        tcc::expr output = tcc::reduce::make(
+            r.type, r.reduce_dims, tcc::cnst::make(values, r.shape));
+
+        /* the baseline moves the reduced loops outside of the leading
+         * loop, so that the reduction accumulates in the output; a whole
+         * tensor is summed in order. */
+        std::vector<float> expected;
+        std::string name = target_name + "_" + r.name;
+        if (r.shape[0] > 1)
+        {
+            tcc::ir_codegen_options baseline = options;
+            std::vector<std::string> order;
+            for (unsigned i = 1; i <= r.shape.size(); i++)
+                order.push_back("d" + std::to_string(i % r.shape.size()));
+            baseline.schedule[output].reorder(order);
+            expected = util_run_expr(name + "_baseline", output, baseline);
+            tcc_assert(util_read_source(name + "_baseline")
+                               .find("float acc=") == std::string::npos,
+                       name + " baseline accumulates in local variables.");
+        }
+        else
+        {
+            expected = { std::accumulate(values.begin(), values.end(), 0.f) };
+        }
+
+        /* every call starts from initialized accumulators. */
+        void (*reduce)(float*) =
+            (void (*)(float*))util_compile_expr(name, output, options);
+        tcc_assert(util_read_source(name).find("float acc=") !=
+                       std::string::npos,
+                   name + " does not accumulate in local variables.");
+        std::vector<float> out(output->size());
+        for (int call = 0; call < 2; call++)
+        {
+            reduce(out.data());
+            util_assert_near(
+                out.data(), expected, 1e-4f, name + " outputs are incorrect");
+        }
+    }
+}
+
+static void test_softmax(std::string target_name)
+{
+    /* rows of a single block, of exactly one block and of several blocks
+     * ending in a partial one. */
+    tcc::ir_codegen_options options;
+    options.parallelize = true;
+    options.vectorize = true;
+    for (tcc::dimension n : { 10, 256, 1001 })
+    {
+        /* the second row lies far below the others and the third starts
+         * with -inf, which fills its first block for long rows. */
+        std::vector<float> values = util_generate_random_values(3 * n);
+        for (tcc::dimension j = 0; j < n; j++)
+        {
+            values[n + j] = values[n + j] * 10 - 1000;
+            values[2 * n + j] = j < std::min(n / 2, tcc::dimension(300))
+                                    ? -std::numeric_limits<float>::infinity()
+                                    : values[2 * n + j] * 10;
+        }
+
+        std::vector<float> expected(values.size());
+        for (tcc::dimension row = 0; row < 3; row++)
+        {
+            const float* x = values.data() + row * n;
+            double max = *std::max_element(x, x + n), sum = 0;
+            for (tcc::dimension j = 0; j < n; j++)
+                sum += std::exp(double(x[j]) - max);
+            for (tcc::dimension j = 0; j < n; j++)
+                expected[row * n + j] = std::exp(double(x[j]) - max) / sum;
+        }
+
+        std::string name = target_name + "_" + std::to_string(n);
+        std::vector<float> out = util_run_expr(
+            name, build_softmax(tcc::cnst::make(values, { 3, n })), options);
+        tcc_assert(util_read_source(name).find("ms[") != std::string::npos,
+                   name + " softmax is not fused.");
+        util_assert_near(
+            out.data(), expected, 1e-5f, name + " outputs are incorrect");
+    }
+}
+
+static void test_fast_math(std::string target_name)
+{
+    /* random values within the range where exp is finite, followed by nan
+     * and -inf. */
+    std::vector<float> values = util_generate_random_values(1000);
+    for (float& value : values)
+        value *= 80;
+    values.push_back(std::nanf(""));
+    values.push_back(-std::nanf(""));
+    values.push_back(-std::numeric_limits<float>::infinity());
+    tcc::expr x = tcc::cnst::make(values, { tcc::dimension(values.size()) });
+
+    tcc::ir_codegen_options exact, fast;
+    exact.vectorize = true;
+    fast.vectorize = true;
+    fast.math = tcc::ir_codegen_options::precision::fast;
+    std::vector<std::pair<std::string, tcc::expr>> functions = {
+        { "exp", tcc::exp(x) },
+        { "sigmoid", build_sigmoid(x) },
+        { "tanh", build_tanh(x) }
+    };
+    for (auto function : functions)
+    {
+        std::string name = target_name + "_" + function.first;
+        std::vector<float> expected =
+            util_run_expr(name + "_exact", function.second, exact);
+        std::vector<float> out =
+            util_run_expr(name + "_fast", function.second, fast);
+        tcc_assert(util_read_source(name + "_fast").find("tcc_expf(") !=
+                       std::string::npos,
+                   name + " does not use fast math.");
+
+        /* a few ulp relative to the exact result, which are below FLT_MIN
+         * for sigmoid of large negative values. */
+        for (size_t i = 0; i < values.size(); i++)
+            tcc_assert(std::isnan(expected[i])
+                           ? std::isnan(out[i])
+                           : std::fabs(out[i] - expected[i]) <=
+                                 1e-6f * std::fabs(expected[i]) + 1e-37f,
+                       name + " outputs are incorrect at " +
+                           std::to_string(i) + ": " +
+                           std::to_string(out[i]) + " instead of " +
+                           std::to_string(expected[i]) + ".");
+    }
+}
+
+static void test_fused_tiling(std::string target_name)
+{
+    /* inverted residual blocks expanding 16 to 64 channels, whose
+     * intermediates of 100 kb do not fit into 32 kb. */
+    for (tcc::dimension stride : { 1, 2 })
+    {
+        std::vector<float> input_values =
+            util_generate_random_values(20 * 20 * 16);
+        tcc::expr input =
+            tcc::var::make(tcc::datatype::FP32, { 1, 20, 20, 16 });
+        tcc::expr expand = build_relu6(
+            build_conv2d("NHWC",
+                         "SAME",
+                         { 1, 1, 1, 1 },
+                         { 1, 1, 1, 1 },
+                         input,
+                         tcc::cnst::make(util_generate_random_values(16 * 64),
+                                         { 1, 1, 16, 64 })));
+        tcc::expr depthwise = build_relu6(build_depthwiseconv2dnative(
+            "NHWC",
+            "SAME",
+            { 1, stride, stride, 1 },
+            { 1, 1, 1, 1 },
+            expand,
+            tcc::cnst::make(util_generate_random_values(3 * 3 * 64),
+                            { 3, 3, 64, 1 })));
+        tcc::expr output =
+            build_conv2d("NHWC",
+                         "SAME",
+                         { 1, 1, 1, 1 },
+                         { 1, 1, 1, 1 },
+                         depthwise,
+                         tcc::cnst::make(util_generate_random_values(64 * 16),
+                                         { 1, 1, 64, 16 }));
+
+        tcc::ir_codegen_options options;
+        options.parallelize = true;
+        options.workspace = true;
+        std::string name = target_name + "_s" + std::to_string(stride);
+        std::vector<float> expected =
+            util_run_expr(name + "_untiled", output, options, { input_values });
+        options.fused_tiling = 32 * 1024;
+        std::vector<float> out =
+            util_run_expr(name + "_tiled", output, options, { input_values });
+        util_assert_near(
+            out.data(), expected, 1e-4f, name + " tiled outputs are incorrect");
+
+        /* intermediates only hold stripes of rows when tiled. */
+        size_t (*untiled_size)(void) = (size_t(*)(void))util_load_symbol(
+            name + "_untiled", name + "_untiled_workspace_size");
+        size_t (*tiled_size)(void) = (size_t(*)(void))util_load_symbol(
+            name + "_tiled", name + "_tiled_workspace_size");
+        tcc_assert(tiled_size() <= size_t(options.fused_tiling) &&
+                       tiled_size() < untiled_size(),
+                   name + " chain is not computed over stripes.");
+    }
+}
+
+static void test_fusion_planner(std::string target_name)
+{
+    tcc::expr x = tcc::cnst::make(
+        util_generate_random_values(2 * 12 * 10 * 8), { 2, 12, 10, 8 });
+
+    /* a cheap producer read twice is recomputed by both of its readers. */
+    tcc::expr scaled = x * tcc::cnst::make(0.5f);
+    tcc::expr squared = scaled * scaled, shifted = scaled + x;
+    tcc::expr recomputed = squared - shifted;
+
+    /* a transcendental producer read twice is materialized. */
+    tcc::expr activation = tcc::tanh(x);
+    tcc::expr materialized = activation * activation - (activation + x);
+
+    /* the bias and the activation of a convolution are applied to its
+     * accumulators. */
+    tcc::expr conv2d = build_conv2d(
+        "NHWC",
+        "SAME",
+        { 1, 1, 1, 1 },
+        { 1, 1, 1, 1 },
+        x,
+        tcc::cnst::make(util_generate_random_values(3 * 3 * 8 * 16),
+                        { 3, 3, 8, 16 }));
+    tcc::expr biased =
+        build_biasadd("NHWC",
+                      conv2d,
+                      tcc::cnst::make(util_generate_random_values(16), { 16 }));
+    tcc::expr epilogue = build_relu6(biased);
+
+    /* the baselines place the producers the other way. */
+    struct plan
+    {
+        std::string name;
+        tcc::expr output;
+        std::string decision;
+        tcc::ir_schedule baseline;
+    };
+    std::vector<plan> plans = {
+        { "recompute", recomputed, "] n0: recompute", {} },
+        { "materialize", materialized, "] n0: materialize", {} },
+        { "epilogue", epilogue, ": epilogue of ", {} }
+    };
+    plans[0].baseline[scaled].compute_root();
+    plans[0].baseline[squared].compute_root();
+    plans[0].baseline[shifted].compute_root();
+    plans[1].baseline[activation].compute_inline();
+    plans[2].baseline[conv2d].compute_root();
+    plans[2].baseline[biased].compute_root();
+
+    for (plan p : plans)
+    {
+        tcc::ir_codegen_options options;
+        options.vectorize = true;
+        options.print_fusion = true;
+        std::string name = target_name + "_" + p.name;
+        std::vector<float> out = util_run_expr(name, p.output, options);
+
+        /* exprs are numbered in post order, so the producer reading x is
+         * n1 reading n0. */
+        std::ifstream file(name + "/" + name + ".fusion");
+        std::string fusion((std::istreambuf_iterator<char>(file)),
+                           std::istreambuf_iterator<char>());
+        tcc_assert(fusion.find(p.decision) != std::string::npos,
+                   name + " is not planned as expected:\n" + fusion);
+
+        options.schedule = p.baseline;
+        util_assert_near(
+            out.data(),
+            util_run_expr(name + "_baseline", p.output, options),
+            1e-5f,
+            name + " outputs are incorrect");
+    }
+}
+
+static void test_interchange(std::string target_name)
+{
+    /* sums over the rows of a transposed matrix, whose reduced loop
+     * strides through memory and moves outside, and over the middle
+     * dimension of a transposed tensor, whose reduced loop walks memory
+     * and moves inside. */
+    tcc::expr matrix =
+        tcc::cnst::make(util_generate_random_values(45 * 203), { 45, 203 });
+    tcc::exprs i = tcc::to_ranges({ 203, 45 });
+    tcc::expr rows =
+        tcc::reduce::make(tcc::reduce::type::sum,
+                          { 1 },
+                          tcc::index::make(i, matrix, { i[1], i[0] }));
+
+    tcc::expr tensor = tcc::cnst::make(util_generate_random_values(8 * 30 * 45),
+                                       { 8, 30, 45 });
+    tcc::exprs j = tcc::to_ranges({ 8, 45, 30 });
+    tcc::expr middle = tcc::reduce::make(
+        tcc::reduce::type::sum,
+        { 1 },
+        tcc::index::make(j, tensor, { j[0], j[2], j[1] }));
+
+    std::vector<std::pair<tcc::expr, std::string>> reductions = {
+        { rows, "acc[" }, { middle, "float acc=" }
+    };
+    for (unsigned k = 0; k < reductions.size(); k++)
+    {
+        tcc::expr output = reductions[k].first;
+        tcc::ir_codegen_options options;
+        options.vectorize = true;
+        std::string name = target_name + "_" + std::to_string(k);
+        std::vector<float> out = util_run_expr(name, output, options);
+        tcc_assert(util_read_source(name).find(reductions[k].second) !=
+                       std::string::npos,
+                   name + " loops are not interchanged.");
+
+        /* the baseline keeps the loops in the order of x. */
+        std::vector<std::string> order;
+        for (unsigned d = 0; d < output->shape.size() + 1; d++)
+            order.push_back("d" + std::to_string(d));
+        options.schedule[output].reorder(order);
+        util_assert_near(out.data(),
+                         util_run_expr(name + "_baseline", output, options),
+                         1e-5f,
+                         name + " outputs are incorrect");
+    }
+}
+
+static void test_conv2d_scheduled(std::string target_name)
+{
+    tcc::expr input = util_generate_cnst({ 1, 8, 8, 4 });
+    tcc::expr filter = util_generate_cnst({ 3, 3, 4, 8 });
+    tcc::expr output = build_conv2d(
+        "NHWC", "SAME", { 1, 1, 1, 1 }, { 1, 1, 1, 1 }, input, filter);
+
+    /* loops d1, d2 and d6 iterate over output rows, columns and channels. */
+    tcc::ir_codegen_options options;
+    options.schedule[output]
+        .tile("d1", "d2", "yo", "xo", "yi", "xi", 4, 2)
+        .split("d6", "co", "ci", 4)
+        .reorder({ "co", "ci" })
+        .vectorize("ci")
+        .parallel("yo");
+
+    void (*conv2d)(float*) =
+        (void (*)(float*))util_compile_expr(target_name, output, options);
+
+    float* out = util_zero_array(8 * 8 * 8);
+    conv2d(out);
+
+    /* every output sums the inputs under the filter, which are all ones. */
+    for (int h = 0; h < 8; h++)
+        for (int w = 0; w < 8; w++)
+            for (int c = 0; c < 8; c++)
+                tcc_assert(out[(h * 8 + w) * 8 + c] ==
+                               4 * (3 - (h == 0) - (h == 7)) *
+                                   (3 - (w == 0) - (w == 7)),
+                           "scheduled outputs are incorrect.");
+
+    free(out);
+}
+
+static void test_conv2d_tuned(std::string target_name)
+{
+    tcc::expr input = util_generate_cnst({ 1, 8, 8, 4 });
+    tcc::expr filter = util_generate_cnst({ 3, 3, 4, 8 });
+    tcc::expr output = build_conv2d(
+        "NHWC", "SAME", { 1, 1, 1, 1 }, { 1, 1, 1, 1 }, input, filter);
+
+    tcc::ir_tuner_options tuner_options;
+    tuner_options.database_path = target_name + ".tuning";
+    std::remove(tuner_options.database_path.c_str());
+
+    tcc::ir_codegen_options options;
+    options.vectorize = true;
+    tcc::ir_schedule tuned =
+        tcc::ir_tuner::apply(target_name, output, options, tuner_options);
+
+    /* a second run reuses the schedule recorded in the database. */
+    tcc::ir_schedule reused =
+        tcc::ir_tuner::apply(target_name, output, options, tuner_options);
+    tcc_assert(tuned.stages.size() == reused.stages.size() &&
+                   (tuned.stages.empty() ||
+                    tcc::ir_schedule_parser::to_string(tuned[output]) ==
+                        tcc::ir_schedule_parser::to_string(reused[output])),
+               "tuned schedules are not reused.");
+
+    options.schedule = tuned;
+    void (*conv2d)(float*) =
+        (void (*)(float*))util_compile_expr(target_name, output, options);
+
+    float* out = util_zero_array(8 * 8 * 8);
+    conv2d(out);
+
+    for (int h = 0; h < 8; h++)
+        for (int w = 0; w < 8; w++)
+            for (int c = 0; c < 8; c++)
+                tcc_assert(out[(h * 8 + w) * 8 + c] ==
+                               4 * (3 - (h == 0) - (h == 7)) *
+                                   (3 - (w == 0) - (w == 7)),
+                           "tuned outputs are incorrect.");
+
+    free(out);
+}
+
+static void test_nonfinite_cnst(std::string target_name)
+{
+    float inf = std::numeric_limits<float>::infinity();
+    tcc::expr values = tcc::cnst::make(
+        std::vector<float>({ 1.5f, inf, -inf, std::nanf("") }), { 4 });
+    tcc::expr output = values - tcc::cnst::make(-inf);
+
+    /* constants are printed as initializers of the generated source. */
+    tcc::ir_codegen_options options;
+    options.weights = tcc::ir_codegen_options::storage::text;
+
+    void (*nonfinite)(float*) =
+        (void (*)(float*))util_compile_expr(target_name, output, options);
+
+    float* out = util_zero_array(4);
+    nonfinite(out);
+
+    tcc_assert(out[0] == inf && out[1] == inf && std::isnan(out[2]) &&
+                   std::isnan(out[3]),
+               "non-finite constants are incorrect.");
+
+    free(out);
+}
+
+static void test_conv2d_external_weights(std::string target_name)
+{
+    std::vector<float> input_values =
+        util_generate_random_values(32 * 32 * 16);
+    std::vector<float> filter_values =
+        util_generate_random_values(3 * 3 * 16 * 32);
+    tcc::expr input = tcc::cnst::make(input_values, { 1, 32, 32, 16 });
+    tcc::expr filter = tcc::cnst::make(filter_values, { 3, 3, 16, 32 });
+    tcc::expr output = build_conv2d(
+        "NHWC", "SAME", { 1, 1, 1, 1 }, { 1, 1, 1, 1 }, input, filter);
+
+    tcc::ir_codegen_options options;
+    options.weights = tcc::ir_codegen_options::storage::external;
+
+    int (*conv2d)(float*) =
+        (int (*)(float*))util_compile_expr(target_name, output, options);
+    int (*load_weights)(const char*) = (int (*)(const char*))util_load_symbol(
+        target_name, target_name + "_load_weights");
+    void (*unload_weights)(void) = (void (*)(void))util_load_symbol(
+        target_name, target_name + "_unload_weights");
+    std::vector<float> expected = util_conv2d(
+        input_values, { 1, 32, 32, 16 }, filter_values, { 3, 3, 16, 32 }, 1);
+    std::string weights_path = target_name + "/" + target_name + ".weights";
+
+    /* nothing is computed before weights are loaded. */
+    float* out = util_zero_array(32 * 32 * 32);
+    tcc_assert(conv2d(out) == -1 &&
+                   std::all_of(out, out + 32 * 32 * 32, [](float value) {
+                       return value == 0;
+                   }),
+               "outputs are computed without weights.");
+
+    /* calls running while the weights are swapped keep reading the weights
+     * they started with, which stay mapped in between swaps. */
+    tcc_assert(!load_weights(weights_path.c_str()), "failed to load weights.");
+    std::atomic<bool> swapping(true);
+    std::thread caller([&]() {
+        while (swapping)
+        {
+            tcc_assert(!conv2d(out), "failed to run with loaded weights.");
+            util_assert_near(out, expected, 1e-5f, "outputs are incorrect");
+        }
+    });
+    for (int i = 0; i < 20; i++)
+    {
+        tcc_assert(!load_weights(weights_path.c_str()),
+                   "failed to swap weights.");
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    swapping = false;
+    caller.join();
+
+    unload_weights();
+    tcc_assert(conv2d(out) == -1, "unloaded weights are used.");
+
+    free(out);
+}
+
 #define TEST(target_name)                                                      \
     tcc_info("starting " #target_name " test.");                               \
     test_##target_name(#target_name);                                          \
@@ -111,7 +1698,30 @@ static void test_conv2d(std::string target_name)
 
 int main()
 {
+    TEST(mem_planner);
     TEST(conv2d);
+    TEST(conv2d_parallel);
+    TEST(nonfinite_cnst);
+    TEST(conv2d_external_weights);
+    TEST(conv2d_workspace);
+    TEST(conv2d_batched);
+    TEST(conv2d_runtime_batch);
+    TEST(batchnorm_folding);
+    TEST(nchw_layout);
+    TEST(conv2d_gemm);
+    TEST(conv2d_pointwise);
+    TEST(conv2d_packed);
+    TEST(conv2d_winograd);
+    TEST(depthwise_conv2d);
+    TEST(affine_indices);
+    TEST(local_reduce);
+    TEST(softmax);
+    TEST(fast_math);
+    TEST(fused_tiling);
+    TEST(fusion_planner);
+    TEST(interchange);
+    TEST(conv2d_scheduled);
+    TEST(conv2d_tuned);
 }
 
 #undef TEST